@@ -70,6 +70,8 @@ int resend_delay = -1;
 int random_id = 0;
 int do_daemonise = 0;
 int skip_kernel_setup = 0;
+int kernel_coalesce_window = 100;
+int kernel_coalesce_max_delay = 1000;
 const char *logfile = NULL,
     *pidfile = "/var/run/babeld.pid",
     *state_file = "/var/lib/babel-state";
@@ -86,30 +88,61 @@ int protocol_port;
 unsigned char protocol_group[16];
 int protocol_socket = -1;
 int kernel_socket = -1;
-static int kernel_routes_changed = 0;
-static int kernel_rules_changed = 0;
-static int kernel_link_changed = 0;
-static int kernel_addr_changed = 0;
+/* Kernel notifications not yet acted upon, as a set of CHANGE_* flags,
+   and the time at which we will act upon them. */
+static int kernel_changes = 0;
+static struct timeval kernel_changes_time, kernel_check_timeout;
 
 struct timeval check_neighbours_timeout, check_interfaces_timeout;
 
-static volatile sig_atomic_t exiting = 0, dumping = 0, reopening = 0;
+static volatile sig_atomic_t exiting = 0, dumping = 0, reopening = 0,
+    reloading = 0;
+
+/* The configuration, kept for reloading. */
+static const char **config_files = NULL;
+static int num_config_files = 0;
+static char **config_strings = NULL;
+static int num_config_strings = 0;
 
 static int accept_local_connections(void);
 static void init_signals(void);
 static void dump_tables(FILE *out);
 
+/* Notifications are coalesced: we only act once no notification has
+   arrived for kernel_coalesce_window, but no later than
+   kernel_coalesce_max_delay after the first one. */
+
+static void
+kernel_changed(int changes)
+{
+    struct timeval deadline;
+
+    if(!kernel_changes)
+        kernel_changes_time = now;
+    kernel_changes |= changes;
+
+    timeval_add_msec(&kernel_check_timeout, &now, kernel_coalesce_window);
+    timeval_add_msec(&deadline, &kernel_changes_time,
+                     kernel_coalesce_max_delay);
+    timeval_min(&kernel_check_timeout, &deadline);
+}
+
 static int
 kernel_route_notify(struct kernel_route *route, void *closure)
 {
-    kernel_routes_changed = 1;
+    kernel_changed(CHANGE_ROUTE);
     return -1;
 }
 
 static int
 kernel_addr_notify(struct kernel_addr *addr, void *closure)
 {
-    kernel_addr_changed = 1;
+    struct interface *ifp;
+    FOR_ALL_INTERFACES(ifp) {
+        if(ifp->ifindex == addr->ifindex)
+            ifp->flags |= IF_CHANGED;
+    }
+    kernel_changed(CHANGE_ADDR);
     return -1;
 }
 
@@ -119,7 +152,8 @@ kernel_link_notify(struct kernel_link *link, void *closure)
     struct interface *ifp;
     FOR_ALL_INTERFACES(ifp) {
         if(strcmp(ifp->name, link->ifname) == 0) {
-            kernel_link_changed = 1;
+            ifp->flags |= IF_CHANGED;
+            kernel_changed(CHANGE_LINK);
             return -1;
         }
     }
@@ -129,16 +163,13 @@ kernel_link_notify(struct kernel_link *link, void *closure)
 static int
 kernel_rule_notify(struct kernel_rule *rule, void *closure)
 {
-    int i;
     if(martian_prefix(rule->src, rule->src_plen))
         return 0;
 
-    i = rule->priority - src_table_prio;
-
-    if(i < 0 || SRC_TABLE_NUM <= i)
+    if(!own_rule_priority(rule->priority))
         return 0;
 
-    kernel_rules_changed = 1;
+    kernel_changed(CHANGE_RULE);
     return -1;
 }
 
@@ -147,9 +178,8 @@ main(int argc, char **argv)
 {
     struct sockaddr_in6 sin6;
     int rc, fd, i, opt;
-    time_t expiry_time, source_expiry_time, kernel_dump_time;
-    const char **config_files = NULL;
-    int num_config_files = 0;
+    time_t expiry_time, source_expiry_time, damping_expiry_time;
+    time_t kernel_dump_time;
     void *vrc;
     unsigned int seed;
     struct interface *ifp;
@@ -297,12 +327,19 @@ main(int argc, char **argv)
             config_files[num_config_files++] = optarg;
             break;
         case 'C':
-            rc = parse_config_from_string(optarg, strlen(optarg), NULL);
+            rc = parse_config_from_string(optarg, strlen(optarg), NULL, NULL);
             if(rc != CONFIG_ACTION_DONE) {
                 fprintf(stderr,
                         "Couldn't parse configuration from command line.\n");
                 exit(1);
             }
+            config_strings = realloc(config_strings,
+                                     (num_config_strings + 1) * sizeof(char*));
+            if(config_strings == NULL) {
+                fprintf(stderr, "Couldn't allocate config string.\n");
+                exit(1);
+            }
+            config_strings[num_config_strings++] = optarg;
             break;
         case 'D':
             do_daemonise = 1;
@@ -345,8 +382,6 @@ main(int argc, char **argv)
         }
     }
 
-    free(config_files);
-
     if(default_wireless_hello_interval <= 0)
         default_wireless_hello_interval = 4000;
     default_wireless_hello_interval = MAX(default_wireless_hello_interval, 5);
@@ -552,15 +587,13 @@ main(int argc, char **argv)
     if(rc < 0)
         fprintf(stderr, "Warning: couldn't check rules.\n");
 
-    kernel_routes_changed = 0;
-    kernel_rules_changed = 0;
-    kernel_link_changed = 0;
-    kernel_addr_changed = 0;
+    kernel_changes = 0;
     kernel_dump_time = now.tv_sec + roughly(30);
     schedule_neighbours_check(5000, 1);
     schedule_interfaces_check(30000, 1);
     expiry_time = now.tv_sec + roughly(30);
     source_expiry_time = now.tv_sec + roughly(300);
+    damping_expiry_time = now.tv_sec + roughly(10);
 
     /* Make some noise so that others notice us, and send retractions in
        case we were restarted recently */
@@ -590,7 +623,8 @@ main(int argc, char **argv)
 
     while(1) {
         struct timeval tv;
-        fd_set readfds;
+        fd_set readfds, writefds;
+        int changes, dump_pending;
 
         gettime(&now);
 
@@ -598,7 +632,11 @@ main(int argc, char **argv)
         timeval_min(&tv, &check_interfaces_timeout);
         timeval_min_sec(&tv, expiry_time);
         timeval_min_sec(&tv, source_expiry_time);
+        if(damping_half_life > 0)
+            timeval_min_sec(&tv, damping_expiry_time);
         timeval_min_sec(&tv, kernel_dump_time);
+        if(kernel_changes)
+            timeval_min(&tv, &kernel_check_timeout);
         timeval_min(&tv, &resend_time);
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
@@ -607,12 +645,22 @@ main(int argc, char **argv)
             timeval_min(&tv, &ifp->hello_timeout);
             timeval_min(&tv, &ifp->update_timeout);
             timeval_min(&tv, &ifp->update_flush_timeout);
+            if(ifp->probe_interval > 0)
+                timeval_min(&tv, &ifp->probe_timeout);
         }
         timeval_min(&tv, &unicast_flush_timeout);
+        for(i = 0; i < num_local_sockets; i++)
+            timeval_min(&tv, &local_sockets[i].pending_time);
         FD_ZERO(&readfds);
-        if(timeval_compare(&tv, &now) > 0) {
+        FD_ZERO(&writefds);
+        /* Don't sleep while a dump can make progress. */
+        dump_pending = local_dumping();
+        if(timeval_compare(&tv, &now) > 0 || dump_pending) {
             int maxfd = 0;
-            timeval_minus(&tv, &tv, &now);
+            if(dump_pending)
+                tv.tv_sec = tv.tv_usec = 0;
+            else
+                timeval_minus(&tv, &tv, &now);
             FD_SET(protocol_socket, &readfds);
             maxfd = MAX(maxfd, protocol_socket);
             if(kernel_socket < 0) kernel_setup_socket(1);
@@ -626,10 +674,13 @@ main(int argc, char **argv)
                 maxfd = MAX(maxfd, local_server_socket);
             }
             for(i = 0; i < num_local_sockets; i++) {
-                FD_SET(local_sockets[i].fd, &readfds);
+                if(local_sockets[i].dump == LOCAL_DUMP_NONE)
+                    FD_SET(local_sockets[i].fd, &readfds);
+                if(local_sockets[i].out_len > 0)
+                    FD_SET(local_sockets[i].fd, &writefds);
                 maxfd = MAX(maxfd, local_sockets[i].fd);
             }
-            rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+            rc = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
             if(rc < 0) {
                 if(errno != EINTR) {
                     perror("select");
@@ -637,6 +688,7 @@ main(int argc, char **argv)
                 }
                 rc = 0;
                 FD_ZERO(&readfds);
+                FD_ZERO(&writefds);
             }
         }
 
@@ -651,7 +703,14 @@ main(int argc, char **argv)
             filter.addr = kernel_addr_notify;
             filter.link = kernel_link_notify;
             filter.rule = kernel_rule_notify;
-            kernel_callback(&filter);
+            rc = kernel_callback(&filter);
+            if(rc > 0) {
+                if(rc & (CHANGE_LINK | CHANGE_ADDR)) {
+                    FOR_ALL_INTERFACES(ifp)
+                        ifp->flags |= IF_CHANGED;
+                }
+                kernel_changed(rc);
+            }
         }
 
         if(FD_ISSET(protocol_socket, &readfds)) {
@@ -681,6 +740,19 @@ main(int argc, char **argv)
         if(local_server_socket >= 0 && FD_ISSET(local_server_socket, &readfds))
            accept_local_connections();
 
+        i = 0;
+        while(i < num_local_sockets) {
+            if(FD_ISSET(local_sockets[i].fd, &writefds)) {
+                rc = local_flush(&local_sockets[i]);
+                if(rc < 0) {
+                    perror("write(local_socket)");
+                    local_socket_destroy(i);
+                    continue;
+                }
+            }
+            i++;
+        }
+
         i = 0;
         while(i < num_local_sockets) {
             if(FD_ISSET(local_sockets[i].fd, &readfds)) {
@@ -697,6 +769,9 @@ main(int argc, char **argv)
             i++;
         }
 
+        local_dump();
+        local_send_pending();
+
         if(reopening) {
             kernel_dump_time = now.tv_sec;
             check_neighbours_timeout = now;
@@ -709,34 +784,51 @@ main(int argc, char **argv)
             reopening = 0;
         }
 
-        if(kernel_link_changed || kernel_addr_changed) {
-            check_interfaces();
-            kernel_link_changed = 0;
+        if(reloading) {
+            reloading = 0;
+            rc = reload_config();
+            if(rc < 0)
+                fprintf(stderr, "Couldn't reload configuration.\n");
         }
 
-        if(kernel_routes_changed || kernel_addr_changed ||
-           kernel_rules_changed || now.tv_sec >= kernel_dump_time) {
+        if(kernel_changes &&
+           timeval_compare(&kernel_check_timeout, &now) <= 0) {
+            changes = kernel_changes;
+            kernel_changes = 0;
+            debugf("Acting upon kernel changes:%s%s%s%s (delayed %ums).\n",
+                   (changes & CHANGE_LINK) ? " link" : "",
+                   (changes & CHANGE_ADDR) ? " addr" : "",
+                   (changes & CHANGE_ROUTE) ? " route" : "",
+                   (changes & CHANGE_RULE) ? " rule" : "",
+                   timeval_minus_msec(&now, &kernel_changes_time));
+            if(changes & (CHANGE_LINK | CHANGE_ADDR))
+                check_changed_interfaces();
+        } else {
+            changes = 0;
+        }
+
+        if(now.tv_sec >= kernel_dump_time)
+            changes |= CHANGE_ROUTE | CHANGE_RULE;
+
+        if(changes & (CHANGE_ROUTE | CHANGE_ADDR)) {
             rc = check_xroutes(1);
             if(rc < 0)
                 fprintf(stderr, "Warning: couldn't check exported routes.\n");
+        }
+        if(changes & CHANGE_RULE) {
             rc = check_rules();
             if(rc < 0)
                 fprintf(stderr, "Warning: couldn't check rules.\n");
-            kernel_routes_changed = kernel_rules_changed =
-                kernel_addr_changed = 0;
+        }
+        if(changes & (CHANGE_ROUTE | CHANGE_ADDR | CHANGE_RULE)) {
             if(kernel_socket >= 0)
                 kernel_dump_time = now.tv_sec + roughly(300);
             else
                 kernel_dump_time = now.tv_sec + roughly(30);
         }
 
-        if(timeval_compare(&check_neighbours_timeout, &now) < 0) {
-            int msecs;
-            msecs = check_neighbours();
-            /* Multiply by 3/2 to allow neighbours to expire. */
-            msecs = MAX(3 * msecs / 2, 10);
-            schedule_neighbours_check(msecs, 1);
-        }
+        if(timeval_compare(&check_neighbours_timeout, &now) < 0)
+            check_neighbours();
 
         if(timeval_compare(&check_interfaces_timeout, &now) < 0) {
             check_interfaces();
@@ -754,11 +846,23 @@ main(int argc, char **argv)
             source_expiry_time = now.tv_sec + roughly(300);
         }
 
+        if(now.tv_sec >= damping_expiry_time) {
+            expire_damping();
+            damping_expiry_time = now.tv_sec + roughly(10);
+        }
+
+        process_route_changes();
+
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
                 continue;
-            if(timeval_compare(&now, &ifp->hello_timeout) >= 0)
+            if(timeval_compare(&now, &ifp->hello_timeout) >= 0) {
+                adapt_hello_interval(ifp);
                 send_hello(ifp);
+            }
+            if(ifp->probe_interval > 0 &&
+               timeval_compare(&now, &ifp->probe_timeout) >= 0)
+                send_probes(ifp);
             if(timeval_compare(&now, &ifp->update_timeout) >= 0)
                 send_update(ifp, 0, NULL, 0, NULL, 0);
             if(timeval_compare(&now, &ifp->update_flush_timeout) >= 0)
@@ -996,6 +1100,12 @@ sigreopening(int signo)
     reopening = 1;
 }
 
+static void
+sigreloading(int signo)
+{
+    reloading = 1;
+}
+
 static void
 init_signals(void)
 {
@@ -1009,7 +1119,7 @@ init_signals(void)
     sigaction(SIGTERM, &sa, NULL);
 
     sigemptyset(&ss);
-    sa.sa_handler = sigexit;
+    sa.sa_handler = sigreloading;
     sa.sa_mask = ss;
     sa.sa_flags = 0;
     sigaction(SIGHUP, &sa, NULL);
@@ -1086,6 +1196,7 @@ dump_route(FILE *out, struct babel_route *route)
             nexthop ? " nexthop " : "",
             nexthop ? format_address(nexthop) : "",
             route->installed ? " (installed)" :
+            route->multipath ? " (multipath)" :
             route_feasible(route) ? " (feasible)" : "");
 }
 
@@ -1110,6 +1221,17 @@ dump_tables(FILE *out)
     fprintf(out, "\n");
 
     fprintf(out, "My id %s seqno %d\n", format_eui64(myid), myseqno);
+    if(kernel_socket_overflows > 0)
+        fprintf(out, "Kernel socket overflows %u\n", kernel_socket_overflows);
+    if(kernel_backend == &simulator_kernel_backend)
+        fprintf(out, "Simulated kernel: %d routes, %d nexthops, "
+                "%u operations, %u failures\n",
+                kernel_simulator_routes(), kernel_simulator_nexthops(),
+                kernel_simulator_operations, kernel_simulator_failures);
+    fprintf(out, "Multi-hop requests: %u received, %u forwarded, %u sent, "
+            "%u duplicates, %u rate limited\n",
+            requests_received, requests_forwarded, requests_sent,
+            request_duplicates, requests_limited);
 
     FOR_ALL_NEIGHBOURS(neigh) {
         fprintf(out, "Neighbour %s dev %s reach %04x ureach %04x "
@@ -1177,3 +1299,44 @@ reopen_logfile()
 
     return 1;
 }
+
+/* Parse the configuration again, in the same order as at startup, and
+   apply the differences with the running configuration. */
+
+int
+reload_config()
+{
+    int i, rc, line;
+
+    rc = begin_reload();
+    if(rc < 0)
+        return -1;
+
+    for(i = 0; i < num_config_strings; i++) {
+        rc = parse_config_from_string(config_strings[i],
+                                      strlen(config_strings[i]),
+                                      NULL, NULL);
+        if(rc != CONFIG_ACTION_DONE) {
+            fprintf(stderr,
+                    "Couldn't parse configuration from command line.\n");
+            goto fail;
+        }
+    }
+
+    for(i = 0; i < num_config_files; i++) {
+        rc = parse_config_from_file(config_files[i], &line);
+        if(rc < 0) {
+            fprintf(stderr,
+                    "Couldn't parse configuration from file %s "
+                    "(error at line %d).\n",
+                    config_files[i], line);
+            goto fail;
+        }
+    }
+
+    return finish_reload(1);
+
+ fail:
+    finish_reload(0);
+    return -1;
+}
@@ -87,6 +87,7 @@ extern int default_wireless_hello_interval, default_wired_hello_interval;
 extern int resend_delay;
 extern int random_id;
 extern int skip_kernel_setup;
+extern int kernel_coalesce_window, kernel_coalesce_max_delay;
 extern int do_daemonise;
 extern const char *logfile, *pidfile, *state_file;
 extern int link_detect;
@@ -106,7 +107,10 @@ extern int protocol_socket;
 extern int kernel_socket;
 extern int max_request_hopcount;
 
+extern struct timeval check_neighbours_timeout;
+
 void schedule_neighbours_check(int msecs, int override);
 void schedule_interfaces_check(int msecs, int override);
 int resize_receive_buffer(int size);
 int reopen_logfile(void);
+int reload_config(void);
@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# Time the parsing of a large synthetic configuration file.
+#
+# Usage: ./bench-config.sh [babeld [lines [runs]]]
+#
+# The file holds a mix of in, out and redistribute filters, and ends with
+# an invalid line so that babeld exits as soon as it has parsed the rest,
+# before touching the kernel.
+
+set -e
+
+babeld="${1:-./babeld}"
+lines="${2:-50000}"
+runs="${3:-5}"
+
+conf="$(mktemp)"
+trap 'rm -f "$conf"' EXIT
+
+awk -v n="$lines" 'BEGIN {
+    for(i = 0; i < n; i++) {
+        a = int(i / 256) % 256; b = i % 256;
+        if(i % 4 == 0)
+            printf "in ip 10.%d.%d.0/24 deny\n", a, b;
+        else if(i % 4 == 1)
+            printf "out ip 2001:db8:%x:%x::/64 le 128 metric 256\n", a, b;
+        else if(i % 4 == 2)
+            printf "redistribute ip 172.16.%d.%d/32 proto 4 metric 128\n", a, b;
+        else
+            printf "in if eth%d ip 192.168.%d.0/24 ge 24 allow\n", a % 8, b;
+    }
+    print "end-of-benchmark";
+}' > "$conf"
+
+i=0
+while [ $i -lt "$runs" ]; do
+    "$babeld" -c "$conf" 2>/dev/null && exit 1
+    i=$((i + 1))
+done
+
+# The second line is the user and system time of babeld, summed over runs.
+echo "$lines lines, $runs runs:"
+times
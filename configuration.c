@@ -24,7 +24,13 @@ THE SOFTWARE.
 #include <string.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifdef __linux
 /* Defining it rather than including <linux/rtnetlink.h> because this
@@ -39,11 +45,39 @@ THE SOFTWARE.
 #include "kernel.h"
 #include "configuration.h"
 #include "rule.h"
+#include "trie.h"
+#include "source.h"
+#include "neighbour.h"
+#include "xroute.h"
+#include "message.h"
+#include "local.h"
+
+/* A chain of filters, together with its compiled form.  The filters that
+   match on a destination prefix are indexed by that prefix, so that only
+   the ones that cover the destination of a route need be tried; the
+   first match is the one with the smallest index. */
+
+struct filter_bucket {
+    int n, max;
+    struct filter **filters;    /* ordered by index */
+};
+
+struct filter_chain {
+    struct filter *filters;
+    struct filter *last;        /* so that appending is O(1) */
+    int compiled;
+    struct trie prefixes;       /* data are buckets */
+    struct filter_bucket wildcard;
+};
 
-struct filter *input_filters = NULL;
-struct filter *output_filters = NULL;
-struct filter *redistribute_filters = NULL;
-struct filter *install_filters = NULL;
+static struct filter_chain input_filters, output_filters,
+    redistribute_filters, install_filters;
+static struct filter_chain *const chains[4] = {
+    &input_filters, &output_filters, &redistribute_filters, &install_filters
+};
+
+/* Cached filter verdicts are tagged with this; 0 is never valid. */
+unsigned int filter_generation = 1;
 struct interface_conf *default_interface_conf = NULL;
 struct interface_conf *interface_confs = NULL;
 
@@ -52,6 +86,16 @@ struct interface_conf *interface_confs = NULL;
 
 int config_finalised = 0;
 
+/* While a reload is in progress, the old filters are set aside in
+   saved_chains and the new ones are parsed into the live chains;
+   interface configuration is parsed into reload_confs and
+   reload_default.  See finish_reload below. */
+
+static int config_reloading = 0;
+static struct filter_chain saved_chains[4];
+static unsigned int saved_generation;
+static struct interface_conf *reload_confs = NULL, *reload_default = NULL;
+
 /* This file implements a recursive descent parser with one character
    lookahead.  The looked-ahead character is returned from most
    functions.
@@ -62,6 +106,8 @@ int config_finalised = 0;
 /* get_next_char callback */
 typedef int (*gnc_t)(void*);
 
+#define TOKEN_SIZE 256
+
 static int
 skip_whitespace(int c, gnc_t gnc, void *closure)
 {
@@ -91,21 +137,33 @@ skip_eol(int c, gnc_t gnc, void *closure)
     return -2;
 }
 
+/* Read a word into buf, which must be at least TOKEN_SIZE bytes long.
+   This avoids an allocation for tokens that are only looked at. */
 static int
-getword(int c, char **token_r, gnc_t gnc, void *closure)
+getword_buf(int c, char *buf, gnc_t gnc, void *closure)
 {
-    char buf[256];
     int i = 0;
 
     c = skip_whitespace(c, gnc, closure);
     if(c < 0 || c == '"' || c == '\n' || c == '#' || c < 0)
         return -2;
     do {
-        if(i >= 255) return -2;
+        if(i >= TOKEN_SIZE - 1) return -2;
         buf[i++] = c;
         c = gnc(closure);
     } while(c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != '#' && c >= 0);
     buf[i] = '\0';
+    return c;
+}
+
+static int
+getword(int c, char **token_r, gnc_t gnc, void *closure)
+{
+    char buf[TOKEN_SIZE];
+
+    c = getword_buf(c, buf, gnc, closure);
+    if(c < -1)
+        return c;
     *token_r = strdup(buf);
     if(*token_r == NULL)
         return -2;
@@ -154,17 +212,14 @@ getstring(int c, char **token_r, gnc_t gnc, void *closure)
 static int
 getint(int c, int *int_r, gnc_t gnc, void *closure)
 {
-    char *t, *end;
+    char t[TOKEN_SIZE], *end;
     int i;
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     i = strtol(t, &end, 0);
-    if(*end != '\0') {
-        free(t);
+    if(*end != '\0')
         return -2;
-    }
-    free(t);
     *int_r = i;
     return c;
 }
@@ -172,17 +227,14 @@ getint(int c, int *int_r, gnc_t gnc, void *closure)
 static int
 getthousands(int c, int *int_r, gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     int i;
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     i = parse_thousands(t);
-    if(i < 0) {
-        free(t);
+    if(i < 0)
         return -2;
-    }
-    free(t);
     *int_r = i;
     return c;
 }
@@ -190,9 +242,9 @@ getthousands(int c, int *int_r, gnc_t gnc, void *closure)
 static int
 getbool(int c, int *bool_r, gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     int i;
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     if(strcmp(t, "true") == 0 || strcmp(t, "yes") == 0)
@@ -201,11 +253,8 @@ getbool(int c, int *bool_r, gnc_t gnc, void *closure)
         i = CONFIG_NO;
     else if(strcmp(t, "default") == 0 || strcmp(t, "auto") == 0)
         i = CONFIG_DEFAULT;
-    else {
-        free(t);
+    else
         return -2;
-    }
-    free(t);
     *bool_r = i;
     return c;
 }
@@ -213,20 +262,17 @@ getbool(int c, int *bool_r, gnc_t gnc, void *closure)
 static int
 getip(int c, unsigned char **ip_r, int *af_r, gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     unsigned char *ip;
     unsigned char addr[16];
     int af, rc;
 
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     rc = parse_address(t, addr, &af);
-    if(rc < 0) {
-        free(t);
+    if(rc < 0)
         return -2;
-    }
-    free(t);
 
     ip = malloc(16);
     if(ip == NULL) {
@@ -242,20 +288,17 @@ getip(int c, unsigned char **ip_r, int *af_r, gnc_t gnc, void *closure)
 static int
 getid(int c, unsigned char **id_r, gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     unsigned char *idp;
     unsigned char id[8];
     int rc;
 
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     rc = parse_eui64(t, id);
-    if(rc < 0) {
-        free(t);
+    if(rc < 0)
         return -2;
-    }
-    free(t);
 
     idp = malloc(8);
     if(idp == NULL) {
@@ -270,21 +313,18 @@ static int
 getnet(int c, unsigned char **p_r, unsigned char *plen_r, int *af_r,
        gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     unsigned char *ip;
     unsigned char addr[16];
     unsigned char plen;
     int af, rc;
 
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     rc = parse_net(t, addr, &plen, &af);
-    if(rc < 0) {
-        free(t);
+    if(rc < 0)
         return -2;
-    }
-    free(t);
     ip = malloc(16);
     if(ip == NULL)
         return -2;
@@ -298,9 +338,9 @@ getnet(int c, unsigned char **p_r, unsigned char *plen_r, int *af_r,
 static int
 get_interface_type(int c, int *type_r, gnc_t gnc, void *closure)
 {
-    char *t;
+    char t[TOKEN_SIZE];
     int i;
-    c = getword(c, &t, gnc, closure);
+    c = getword_buf(c, t, gnc, closure);
     if(c < -1)
         return c;
     if(strcmp(t, "default") == 0 || strcmp(t, "auto") == 0) {
@@ -312,10 +352,8 @@ get_interface_type(int c, int *type_r, gnc_t gnc, void *closure)
     } else if(strcmp(t, "tunnel") == 0) {
         i = IF_TYPE_TUNNEL;
     } else {
-        free(t);
         return -2;
     }
-    free(t);
     *type_r = i;
     return c;
 }
@@ -335,7 +373,7 @@ free_filter(struct filter *f)
 static int
 parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
 {
-    char *token;
+    char token[TOKEN_SIZE];
     struct filter *filter;
 
     filter = calloc(1, sizeof(struct filter));
@@ -350,7 +388,7 @@ parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
             c = skip_to_eol(c, gnc, closure);
             break;
         }
-        c = getword(c, &token, gnc, closure);
+        c = getword_buf(c, token, gnc, closure);
         if(c < -1) {
             free_filter(filter);
             return -2;
@@ -472,7 +510,6 @@ parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
         } else {
             goto error;
         }
-        free(token);
     }
     if(filter->af == 0) {
         if(filter->plen_le < 128 || filter->plen_ge > 0 ||
@@ -492,7 +529,6 @@ parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
     return c;
 
  error:
-    free(token);
     free_filter(filter);
     return -2;
 }
@@ -503,7 +539,7 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
                        struct interface_conf **if_conf_return)
 {
 
-    char *token;
+    char token[TOKEN_SIZE];
 
     if(if_conf == NULL) {
         if_conf = calloc(1, sizeof(struct interface_conf));
@@ -517,7 +553,7 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
             c = skip_to_eol(c, gnc, closure);
             break;
         }
-        c = getword(c, &token, gnc, closure);
+        c = getword_buf(c, token, gnc, closure);
         if(c < -1)
             goto error;
 
@@ -539,6 +575,37 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
             if(c < -1 || interval <= 0 || interval > 10 * 0xFFFF)
                 goto error;
             if_conf->update_interval = interval;
+        } else if(strcmp(token, "adaptive-hello") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->adaptive_hello = v;
+        } else if(strcmp(token, "hello-interval-min") == 0) {
+            int interval;
+            c = getthousands(c, &interval, gnc, closure);
+            /* Intervals are sent in centiseconds, and 0 is special. */
+            if(c < -1 || interval < 10 || interval > 10 * 0xFFFF)
+                goto error;
+            if_conf->hello_interval_min = interval;
+        } else if(strcmp(token, "hello-interval-max") == 0) {
+            int interval;
+            c = getthousands(c, &interval, gnc, closure);
+            if(c < -1 || interval <= 0 || interval > 10 * 0xFFFF)
+                goto error;
+            if_conf->hello_interval_max = interval;
+        } else if(strcmp(token, "probe-interval") == 0) {
+            int interval;
+            c = getthousands(c, &interval, gnc, closure);
+            if(c < -1 || interval < 10 || interval > 10 * 0xFFFF)
+                goto error;
+            if_conf->probe_interval = interval;
+        } else if(strcmp(token, "probe-multiplier") == 0) {
+            int multiplier;
+            c = getint(c, &multiplier, gnc, closure);
+            if(c < -1 || multiplier <= 0 || multiplier > 16)
+                goto error;
+            if_conf->probe_multiplier = multiplier;
         } else if(strcmp(token, "type") == 0) {
             int type = IF_TYPE_DEFAULT;
             c = get_interface_type(c, &type, gnc, closure);
@@ -627,7 +694,6 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
         } else {
             goto error;
         }
-        free(token);
     }
 
     *if_conf_return = if_conf;
@@ -669,19 +735,90 @@ parse_ifconf(int c, gnc_t gnc, void *closure,
 }
 
 static void
-add_filter(struct filter *filter, struct filter **filters)
+add_filter(struct filter *filter, struct filter_chain *chain)
 {
-    if(*filters == NULL) {
-        filter->next = NULL;
-        *filters = filter;
+    filter->next = NULL;
+    filter->index = 0;
+    if(chain->filters == NULL) {
+        chain->filters = filter;
     } else {
-        struct filter *f;
-        f = *filters;
-        while(f->next)
-            f = f->next;
-        filter->next = NULL;
-        f->next = filter;
+        filter->index = chain->last->index + 1;
+        chain->last->next = filter;
+    }
+    chain->last = filter;
+    chain->compiled = 0;
+    filter_generation++;
+}
+
+static int
+bucket_add(struct filter_bucket *bucket, struct filter *filter)
+{
+    if(bucket->n >= bucket->max) {
+        int n = bucket->max < 1 ? 4 : 2 * bucket->max;
+        struct filter **new_filters =
+            realloc(bucket->filters, n * sizeof(struct filter*));
+        if(new_filters == NULL)
+            return -1;
+        bucket->filters = new_filters;
+        bucket->max = n;
     }
+    bucket->filters[bucket->n++] = filter;
+    return 1;
+}
+
+static void
+free_bucket(void *data)
+{
+    struct filter_bucket *bucket = data;
+    free(bucket->filters);
+    free(bucket);
+}
+
+static void
+uncompile_filters(struct filter_chain *chain)
+{
+    trie_flush(&chain->prefixes, free_bucket);
+    free(chain->wildcard.filters);
+    memset(&chain->wildcard, 0, sizeof(chain->wildcard));
+    chain->compiled = 0;
+}
+
+static int
+compile_filters(struct filter_chain *chain)
+{
+    struct filter *f;
+    int rc;
+
+    uncompile_filters(chain);
+
+    for(f = chain->filters; f; f = f->next) {
+        if(f->prefix) {
+            struct trie_node *node;
+            node = trie_get(&chain->prefixes, f->prefix, f->plen);
+            if(node == NULL)
+                goto fail;
+            if(node->data == NULL) {
+                node->data = calloc(1, sizeof(struct filter_bucket));
+                if(node->data == NULL) {
+                    trie_release(&chain->prefixes, node);
+                    goto fail;
+                }
+            }
+            rc = bucket_add(node->data, f);
+        } else {
+            rc = bucket_add(&chain->wildcard, f);
+        }
+        if(rc < 0)
+            goto fail;
+    }
+
+    chain->compiled = 1;
+    return 1;
+
+ fail:
+    fprintf(stderr, "Couldn't compile filters.\n");
+    uncompile_filters(chain);
+    return -1;
 }
 
 static void
@@ -711,6 +848,11 @@ merge_ifconf(struct interface_conf *dest,
     MERGE(rtt_min);
     MERGE(rtt_max);
     MERGE(max_rtt_penalty);
+    MERGE(adaptive_hello);
+    MERGE(hello_interval_min);
+    MERGE(hello_interval_max);
+    MERGE(probe_interval);
+    MERGE(probe_multiplier);
 
 #undef MERGE
 }
@@ -741,7 +883,7 @@ add_ifconf(struct interface_conf *if_conf, struct interface_conf **if_confs)
     }
 
  done:
-    if(config_finalised)
+    if(config_finalised && !config_reloading)
         add_interface(if_conf->ifname, if_conf);
 }
 
@@ -779,8 +921,20 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
            strcmp(token, "log-file") != 0 &&
            strcmp(token, "diversity") != 0 &&
            strcmp(token, "diversity-factor") != 0 &&
-           strcmp(token, "smoothing-half-life") != 0)
+           strcmp(token, "smoothing-half-life") != 0 &&
+           strcmp(token, "request-rate") != 0 &&
+           strcmp(token, "kernel-coalesce-window") != 0 &&
+           strcmp(token, "kernel-coalesce-max-delay") != 0 &&
+           strcmp(token, "kernel-simulator-latency") != 0 &&
+           strcmp(token, "kernel-simulator-failure-rate") != 0 &&
+           strcmp(token, "local-high-water-mark") != 0 &&
+           strcmp(token, "local-overflow") != 0) {
+            /* A reload only applies what can be changed at runtime;
+               the rest requires a restart. */
+            if(config_reloading)
+                return skip_to_eol(c, gnc, closure);
             goto error;
+        }
     }
 
     if(strcmp(token, "protocol-port") == 0 ||
@@ -884,6 +1038,12 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         if(c < -1 || d < 0)
             goto error;
         debug = d;
+    } else if(strcmp(token, "request-rate") == 0) {
+        int r;
+        c = getint(c, &r, gnc, closure);
+        if(c < -1 || r < 0)
+            goto error;
+        request_rate = r;
     } else if(strcmp(token, "diversity") == 0) {
         int d;
         c = skip_whitespace(c, gnc, closure);
@@ -905,22 +1065,107 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         if(c < -1 || f < 0 || f > 256)
             goto error;
         diversity_factor = f;
+    } else if(strcmp(token, "ecmp-tolerance") == 0) {
+        int t;
+        c = getint(c, &t, gnc, closure);
+        if(c < -1 || t < 0 || t >= INFINITY)
+            goto error;
+        ecmp_tolerance = t;
+    } else if(strcmp(token, "damping-half-life") == 0 ||
+              strcmp(token, "damping-penalty") == 0 ||
+              strcmp(token, "damping-suppress") == 0 ||
+              strcmp(token, "damping-reuse") == 0) {
+        int v;
+        c = getint(c, &v, gnc, closure);
+        if(c < -1 || v < 0)
+            goto error;
+        if(strcmp(token, "damping-half-life") == 0)
+            damping_half_life = v;
+        else if(v == 0)
+            goto error;
+        else if(strcmp(token, "damping-penalty") == 0)
+            damping_penalty = v;
+        else if(strcmp(token, "damping-suppress") == 0)
+            damping_suppress = v;
+        else
+            damping_reuse = v;
     } else if(strcmp(token, "smoothing-half-life") == 0) {
         int h;
         c = getint(c, &h, gnc, closure);
         if(c < -1 || h < 0)
             goto error;
         change_smoothing_half_life(h);
+    } else if(strcmp(token, "kernel-coalesce-window") == 0 ||
+              strcmp(token, "kernel-coalesce-max-delay") == 0) {
+        int v;
+        c = getthousands(c, &v, gnc, closure);
+        if(c < -1 || v < 0)
+            goto error;
+        if(strcmp(token, "kernel-coalesce-window") == 0)
+            kernel_coalesce_window = v;
+        else
+            kernel_coalesce_max_delay = v;
+    } else if(strcmp(token, "local-high-water-mark") == 0) {
+        int v;
+        c = getint(c, &v, gnc, closure);
+        if(c < -1 || v <= 0)
+            goto error;
+        local_high_water_mark = v;
+    } else if(strcmp(token, "local-overflow") == 0) {
+        char t[TOKEN_SIZE];
+        c = getword_buf(c, t, gnc, closure);
+        if(c < -1)
+            goto error;
+        if(strcmp(t, "disconnect") == 0)
+            local_overflow = LOCAL_OVERFLOW_DISCONNECT;
+        else if(strcmp(t, "coalesce") == 0)
+            local_overflow = LOCAL_OVERFLOW_COALESCE;
+        else
+            goto error;
+    } else if(strcmp(token, "kernel-backend") == 0) {
+        char *name;
+        int rc;
+        c = getword(c, &name, gnc, closure);
+        if(c < -1)
+            goto error;
+        rc = kernel_use_backend(name);
+        free(name);
+        if(rc < 0)
+            goto error;
+    } else if(strcmp(token, "kernel-simulator-latency") == 0) {
+        int l;
+        /* In milliseconds, with three decimals. */
+        c = getthousands(c, &l, gnc, closure);
+        if(c < -1 || l < 0)
+            goto error;
+        kernel_simulator_latency = l;
+    } else if(strcmp(token, "kernel-simulator-failure-rate") == 0) {
+        int r;
+        c = getint(c, &r, gnc, closure);
+        if(c < -1 || r < 0 || r > 100)
+            goto error;
+        kernel_simulator_failure_rate = r;
     } else if(strcmp(token, "first-table-number") == 0) {
         int n;
         c = getint(c, &n, gnc, closure);
-        if(c < -1 || n <= 0 || n + SRC_TABLE_NUM >= 254)
+        if(c < -1 || n <= 0 || n + MAX(src_table_num, 1) >= 254 ||
+           (src_table_num == 0 &&
+            src_table_prio + (253 - n) * SRC_RULE_GAP >= 32765))
             goto error;
         src_table_idx = n;
+    } else if(strcmp(token, "source-table-count") == 0) {
+        int n;
+        c = getint(c, &n, gnc, closure);
+        if(c < -1 || n < 0 || src_table_idx + n >= 254 ||
+           src_table_prio +
+           (n > 0 ? n : 253 - src_table_idx) * SRC_RULE_GAP >= 32765)
+            goto error;
+        src_table_num = n;
     } else if(strcmp(token, "first-rule-priority") == 0) {
         int n;
         c = getint(c, &n, gnc, closure);
-        if(c < -1 || n <= 0 || n + SRC_TABLE_NUM >= 32765)
+        if(c < -1 || n <= 0 ||
+           n + max_source_tables() * SRC_RULE_GAP >= 32765)
             goto error;
         src_table_prio = n;
     } else if(strcmp(token, "router-id") == 0) {
@@ -941,11 +1186,148 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
 
 }
 
+/* simulated-route {add|flush} prefix [from prefix] [metric n] [proto n]
+   [if name] */
+
+static int
+parse_simulated_route(int c, gnc_t gnc, void *closure, int *rc_return)
+{
+    char *token = NULL, *op = NULL;
+    unsigned char *prefix = NULL, *src_prefix = NULL;
+    unsigned char plen, src_plen = 0, src[16];
+    int af, src_af, metric = 0, proto = 4, ifindex = 0;
+
+    c = getword(c, &op, gnc, closure);
+    if(c < -1)
+        return c;
+    if(strcmp(op, "add") != 0 && strcmp(op, "flush") != 0)
+        goto error;
+
+    c = getnet(c, &prefix, &plen, &af, gnc, closure);
+    if(c < -1)
+        goto error;
+
+    while(1) {
+        c = skip_whitespace(c, gnc, closure);
+        if(c < 0 || c == '\n' || c == '#') {
+            c = skip_to_eol(c, gnc, closure);
+            break;
+        }
+        c = getword(c, &token, gnc, closure);
+        if(c < -1)
+            goto error;
+        if(strcmp(token, "from") == 0) {
+            free(src_prefix);
+            src_prefix = NULL;
+            c = getnet(c, &src_prefix, &src_plen, &src_af, gnc, closure);
+            if(c < -1 || src_af != af)
+                goto error;
+        } else if(strcmp(token, "metric") == 0) {
+            c = getint(c, &metric, gnc, closure);
+            if(c < -1 || metric < 0)
+                goto error;
+        } else if(strcmp(token, "proto") == 0) {
+            c = getint(c, &proto, gnc, closure);
+            if(c < -1 || proto <= 0 || proto > 255)
+                goto error;
+        } else if(strcmp(token, "if") == 0) {
+            char *ifname;
+            c = getstring(c, &ifname, gnc, closure);
+            if(c < -1)
+                goto error;
+            ifindex = if_nametoindex(ifname);
+            free(ifname);
+            if(ifindex <= 0)
+                goto error;
+        } else {
+            goto error;
+        }
+        free(token);
+        token = NULL;
+    }
+
+    if(src_prefix) {
+        memcpy(src, src_prefix, 16);
+    } else if(af == AF_INET) {
+        /* Same as what netlink reports for a route without RTA_SRC. */
+        v4tov6(src, zeroes);
+    } else {
+        memset(src, 0, 16);
+    }
+
+    *rc_return = kernel_simulator_route(strcmp(op, "add") == 0, prefix, plen,
+                                        src, src_plen, metric, ifindex, proto);
+
+    free(op);
+    free(prefix);
+    free(src_prefix);
+    return c;
+
+ error:
+    free(token);
+    free(op);
+    free(prefix);
+    free(src_prefix);
+    return -2;
+}
+
+/* dump|monitor [interface] [neighbour] [xroute] [route] [prefix prefix]
+   [interval seconds] */
+
+static int
+parse_monitor(int c, gnc_t gnc, void *closure, struct local_monitor *monitor)
+{
+    char token[TOKEN_SIZE];
+    int af, rc;
+
+    memset(monitor, 0, sizeof(struct local_monitor));
+
+    while(1) {
+        c = skip_whitespace(c, gnc, closure);
+        if(c < 0 || c == '\n' || c == '#') {
+            c = skip_to_eol(c, gnc, closure);
+            break;
+        }
+        c = getword_buf(c, token, gnc, closure);
+        if(c < -1)
+            return -2;
+
+        if(strcmp(token, "interface") == 0) {
+            monitor->classes |= LOCAL_INTERFACES;
+        } else if(strcmp(token, "neighbour") == 0) {
+            monitor->classes |= LOCAL_NEIGHBOURS;
+        } else if(strcmp(token, "xroute") == 0) {
+            monitor->classes |= LOCAL_XROUTES;
+        } else if(strcmp(token, "route") == 0) {
+            monitor->classes |= LOCAL_ROUTES;
+        } else if(strcmp(token, "prefix") == 0) {
+            c = getword_buf(c, token, gnc, closure);
+            if(c < -1)
+                return -2;
+            rc = parse_net(token, monitor->prefix, &monitor->plen, &af);
+            if(rc < 0)
+                return -2;
+        } else if(strcmp(token, "interval") == 0) {
+            c = getthousands(c, &monitor->interval, gnc, closure);
+            if(c < -1)
+                return -2;
+        } else {
+            return -2;
+        }
+    }
+
+    if(monitor->classes == 0)
+        monitor->classes = LOCAL_ALL;
+    return c;
+}
+
 static int
 parse_config_line(int c, gnc_t gnc, void *closure,
-                  int *action_return, const char **message_return)
+                  int *action_return, const char **message_return,
+                  struct local_monitor *monitor_return)
 {
-    char *token;
+    struct local_monitor monitor;
+    char token[TOKEN_SIZE];
     if(action_return)
         *action_return = CONFIG_ACTION_DONE;
     if(message_return)
@@ -955,7 +1337,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
     if(c < 0 || c == '\n' || c == '#')
         return skip_to_eol(c, gnc, closure);
 
-    c = getword(c, &token, gnc, closure);
+    c = getword_buf(c, token, gnc, closure);
     if(c < -1)
         return c;
 
@@ -966,21 +1348,25 @@ parse_config_line(int c, gnc_t gnc, void *closure,
             goto fail;
         *action_return = CONFIG_ACTION_QUIT;
     } else if(strcmp(token, "dump") == 0) {
-        c = skip_eol(c, gnc, closure);
+        c = parse_monitor(c, gnc, closure, &monitor);
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_DUMP;
+        if(monitor_return)
+            *monitor_return = monitor;
     } else if(strcmp(token, "monitor") == 0) {
-        c = skip_eol(c, gnc, closure);
+        c = parse_monitor(c, gnc, closure, &monitor);
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_MONITOR;
+        if(monitor_return)
+            *monitor_return = monitor;
     } else if(strcmp(token, "unmonitor") == 0) {
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_UNMONITOR;
-    } else if(config_finalised && !local_server_write) {
+    } else if(config_finalised && !config_reloading && !local_server_write) {
         /* The remaining directives are only allowed in read-write mode. */
         c = skip_to_eol(c, gnc, closure);
         if(c < -1 || !action_return)
@@ -990,7 +1376,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         goto fail;
     } else if(strcmp(token, "in") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -998,7 +1384,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &input_filters);
     } else if(strcmp(token, "out") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -1006,7 +1392,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &output_filters);
     } else if(strcmp(token, "redistribute") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -1014,27 +1400,30 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &redistribute_filters);
     } else if(strcmp(token, "install") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
             goto fail;
+        add_filter(filter, &install_filters);
     } else if(strcmp(token, "interface") == 0) {
         struct interface_conf *if_conf;
         c = parse_ifconf(c, gnc, closure, &if_conf);
         if(c < -1)
             goto fail;
-        add_ifconf(if_conf, &interface_confs);
+        add_ifconf(if_conf,
+                   config_reloading ? &reload_confs : &interface_confs);
     } else if(strcmp(token, "default") == 0) {
-        struct interface_conf *if_conf;
+        struct interface_conf *if_conf, **default_conf;
         c = parse_anonymous_ifconf(c, gnc, closure, NULL, &if_conf);
         if(c < -1)
             goto fail;
-        if(default_interface_conf == NULL)
-            default_interface_conf = if_conf;
+        default_conf =
+            config_reloading ? &reload_default : &default_interface_conf;
+        if(*default_conf == NULL)
+            *default_conf = if_conf;
         else {
-            merge_ifconf(default_interface_conf,
-                         if_conf, default_interface_conf);
+            merge_ifconf(*default_conf, if_conf, *default_conf);
             free(if_conf);
         }
     } else if(strcmp(token, "flush") == 0) {
@@ -1069,6 +1458,30 @@ parse_config_line(int c, gnc_t gnc, void *closure,
             free(token2);
             goto fail;
         }
+    } else if(strcmp(token, "simulated-route") == 0) {
+        int rc;
+        c = parse_simulated_route(c, gnc, closure, &rc);
+        if(c < -1)
+            goto fail;
+        if(rc < 0) {
+            if(action_return)
+                *action_return = CONFIG_ACTION_NO;
+            if(message_return)
+                *message_return = errno == ENOSYS ?
+                    "Kernel simulator not in use" :
+                    "Couldn't change simulated route";
+        }
+    } else if(strcmp(token, "reload") == 0) {
+        int rc;
+        c = skip_eol(c, gnc, closure);
+        if(c < -1 || !action_return || !config_finalised || config_reloading)
+            goto fail;
+        rc = reload_config();
+        if(rc < 0) {
+            *action_return = CONFIG_ACTION_NO;
+            if(message_return)
+                *message_return = "Couldn't reload configuration";
+        }
     } else if(strcmp(token, "reopen-logfile") == 0) {
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
@@ -1080,16 +1493,19 @@ parse_config_line(int c, gnc_t gnc, void *closure,
             goto fail;
     }
 
-    free(token);
     return c;
 
  fail:
-    free(token);
     return -2;
 }
 
+/* Configuration files are mapped into memory, or read in one go when
+   that is not possible, rather than read through stdio one character at
+   a time; large generated configurations load much faster that way. */
+
 struct file_state {
-    FILE *f;
+    const unsigned char *buf;
+    size_t i, n;
     int line;
 };
 
@@ -1097,40 +1513,104 @@ static int
 gnc_file(struct file_state *s)
 {
     int c;
-    c = fgetc(s->f);
+    if(s->i >= s->n)
+        return -1;
+    c = s->buf[s->i++];
     if(c == '\n')
         s->line++;
     return c;
 }
 
+static unsigned char *
+read_file(int fd, size_t *len_return)
+{
+    unsigned char *buf = NULL, *new_buf;
+    size_t len = 0, size = 0;
+    ssize_t rc;
+
+    while(1) {
+        if(len >= size) {
+            size = size < 4096 ? 4096 : 2 * size;
+            new_buf = realloc(buf, size);
+            if(new_buf == NULL)
+                goto fail;
+            buf = new_buf;
+        }
+        rc = read(fd, buf + len, size - len);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            goto fail;
+        }
+        if(rc == 0)
+            break;
+        len += rc;
+    }
+
+    *len_return = len;
+    return buf;
+
+ fail:
+    free(buf);
+    return NULL;
+}
+
 int
 parse_config_from_file(const char *filename, int *line_return)
 {
-    struct file_state s = { NULL, 1 };
-    int c;
-
-    s.f = fopen(filename, "r");
-    if(s.f == NULL) {
+    struct file_state s = { NULL, 0, 0, 1 };
+    struct stat st;
+    unsigned char *buf = NULL;
+    void *map = MAP_FAILED;
+    int fd, rc, c;
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
         *line_return = 0;
         return -1;
     }
 
+    rc = fstat(fd, &st);
+    if(rc >= 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map != MAP_FAILED) {
+        s.buf = map;
+        s.n = st.st_size;
+    } else {
+        buf = read_file(fd, &s.n);
+        if(buf == NULL) {
+            close(fd);
+            *line_return = 0;
+            return -1;
+        }
+        s.buf = buf;
+    }
+    close(fd);
+
+    rc = 1;
     c = gnc_file(&s);
-    if(c < 0)
-        return 0;
+    if(c < 0) {
+        rc = 0;
+        goto done;
+    }
 
     while(1) {
-        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL);
+        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL, NULL);
         if(c < -1) {
             *line_return = s.line;
-            return -1;
+            rc = -1;
+            goto done;
         }
         if(c == -1)
             break;
     }
-    fclose(s.f);
 
-    return 1;
+ done:
+    if(map != MAP_FAILED)
+        munmap(map, st.st_size);
+    else
+        free(buf);
+    return rc;
 }
 
 struct buf_state {
@@ -1148,7 +1628,8 @@ gnc_buf(struct buf_state *s)
 }
 
 int
-parse_config_from_string(char *string, int n, const char **message_return)
+parse_config_from_string(char *string, int n, const char **message_return,
+                         struct local_monitor *monitor_return)
 {
     int c, action;
     const char *message;
@@ -1158,7 +1639,8 @@ parse_config_from_string(char *string, int n, const char **message_return)
     if(c < 0)
         return -1;
 
-    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message);
+    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message,
+                          monitor_return);
     if(c == -1) {
         if(message_return)
             *message_return = message;
@@ -1167,23 +1649,33 @@ parse_config_from_string(char *string, int n, const char **message_return)
         return -1;
 }
 
-static void
+static int
 renumber_filter(struct filter *filter)
 {
+    int changed = 0;
     while(filter) {
-        if(filter->ifname)
-            filter->ifindex = if_nametoindex(filter->ifname);
+        if(filter->ifname) {
+            unsigned int ifindex = if_nametoindex(filter->ifname);
+            if(ifindex != filter->ifindex) {
+                filter->ifindex = ifindex;
+                changed = 1;
+            }
+        }
         filter = filter->next;
     }
+    return changed;
 }
 
 void
 renumber_filters()
 {
-    renumber_filter(input_filters);
-    renumber_filter(output_filters);
-    renumber_filter(redistribute_filters);
-    renumber_filter(install_filters);
+    int changed = 0;
+    changed |= renumber_filter(input_filters.filters);
+    changed |= renumber_filter(output_filters.filters);
+    changed |= renumber_filter(redistribute_filters.filters);
+    changed |= renumber_filter(install_filters.filters);
+    if(changed)
+        filter_generation++;
 }
 
 static int
@@ -1252,27 +1744,80 @@ filter_match(struct filter *f, const unsigned char *id,
     return 1;
 }
 
+struct filter_lookup {
+    const unsigned char *id;
+    const unsigned char *prefix;
+    unsigned short plen;
+    const unsigned char *src_prefix;
+    unsigned short src_plen;
+    const unsigned char *neigh;
+    unsigned int ifindex;
+    int proto;
+    struct filter *best;
+};
+
+/* Update lookup->best with the first filter of bucket that matches, if
+   it comes before. */
+static void
+bucket_match(struct filter_bucket *bucket, struct filter_lookup *lookup)
+{
+    int i;
+    for(i = 0; i < bucket->n; i++) {
+        struct filter *f = bucket->filters[i];
+        if(lookup->best && f->index >= lookup->best->index)
+            return;
+        if(filter_match(f, lookup->id, lookup->prefix, lookup->plen,
+                        lookup->src_prefix, lookup->src_plen,
+                        lookup->neigh, lookup->ifindex, lookup->proto)) {
+            lookup->best = f;
+            return;
+        }
+    }
+}
+
+static int
+prefix_bucket_match(struct trie_node *node, void *closure)
+{
+    bucket_match(node->data, closure);
+    return 0;
+}
+
 static int
-do_filter(struct filter *f, const unsigned char *id,
+do_filter(struct filter_chain *chain, const unsigned char *id,
           const unsigned char *prefix, unsigned short plen,
           const unsigned char *src_prefix, unsigned short src_plen,
           const unsigned char *neigh, unsigned int ifindex, int proto,
           struct filter_result *result)
 {
+    struct filter_lookup lookup = {
+        id, prefix, plen, src_prefix, src_plen, neigh, ifindex, proto, NULL
+    };
+    struct filter *f;
+
     if(result)
         memset(result, 0, sizeof(struct filter_result));
 
-    while(f) {
-        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
-                        neigh, ifindex, proto)) {
-            if(result)
-                memcpy(result, &f->action, sizeof(struct filter_result));
-            return f->action.add_metric;
-        }
-        f = f->next;
+    if(!chain->compiled)
+        compile_filters(chain);
+
+    if(chain->compiled) {
+        bucket_match(&chain->wildcard, &lookup);
+        if(prefix)
+            trie_covering(&chain->prefixes, prefix, plen,
+                          prefix_bucket_match, &lookup);
+        f = lookup.best;
+    } else {
+        f = chain->filters;
+        while(f && !filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                                 neigh, ifindex, proto))
+            f = f->next;
     }
 
-    return -1;
+    if(f == NULL)
+        return -1;
+    if(result)
+        memcpy(result, &f->action, sizeof(struct filter_result));
+    return f->action.add_metric;
 }
 
 int
@@ -1282,7 +1827,7 @@ input_filter(const unsigned char *id,
              const unsigned char *neigh, unsigned int ifindex)
 {
     int res;
-    res = do_filter(input_filters, id, prefix, plen,
+    res = do_filter(&input_filters, id, prefix, plen,
                     src_prefix, src_plen, neigh, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
@@ -1296,7 +1841,7 @@ output_filter(const unsigned char *id,
               unsigned int ifindex)
 {
     int res;
-    res = do_filter(output_filters, id, prefix, plen,
+    res = do_filter(&output_filters, id, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
@@ -1310,28 +1855,72 @@ redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     struct filter_result *result)
 {
     int res;
-    res = do_filter(redistribute_filters, NULL, prefix, plen,
+    res = do_filter(&redistribute_filters, NULL, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, proto, result);
     if(res < 0)
         res = INFINITY;
     return res;
 }
 
+/* Compute the set of kernel protocols that the redistribute filters may
+   allow, so that the kernel can drop uninteresting route notifications
+   early.  Returns the number of protocols stored in protos, or -1 if
+   any protocol may be redistributed.  *boot_r says whether boot routes,
+   which are not matched by a filter without a proto, may match. */
+
+int
+redistribute_protocols(int *protos, int max, int *boot_r)
+{
+    struct filter *f;
+    int i, n = 0, any = 0, boot = 0;
+
+    for(f = redistribute_filters.filters; f; f = f->next) {
+        if(f->proto == RTPROT_BABEL_LOCAL)
+            continue;
+        if(f->action.add_metric >= INFINITY)
+            continue;
+        if(f->proto == 0) {
+            any = 1;
+            continue;
+        }
+        if(f->proto < 0 || f->proto > 255)
+            continue;
+#ifdef __linux
+        if(f->proto == RTPROT_BOOT)
+            boot = 1;
+#endif
+        for(i = 0; i < n; i++)
+            if(protos[i] == f->proto)
+                break;
+        if(i < n)
+            continue;
+        if(n >= max)
+            any = 1;
+        else
+            protos[n++] = f->proto;
+    }
+
+    if(boot_r)
+        *boot_r = boot;
+    return any ? -1 : n;
+}
+
 int
 install_filter(const unsigned char *prefix, unsigned short plen,
                const unsigned char *src_prefix, unsigned short src_plen,
                struct filter_result *result)
 {
     int res;
-    res = do_filter(install_filters, NULL, prefix, plen,
+    res = do_filter(&install_filters, NULL, prefix, plen,
                     src_prefix, src_plen, NULL, 0, 0, result);
     if(res < 0)
         res = INFINITY;
     return res;
 }
 
-int
-finalise_config()
+/* Babel-local routes are never redistributed. */
+static int
+add_local_filter(struct filter_chain *chain)
 {
     struct filter *filter = calloc(1, sizeof(struct filter));
     if(filter == NULL)
@@ -1340,7 +1929,503 @@ finalise_config()
     filter->proto = RTPROT_BABEL_LOCAL;
     filter->plen_le = 128;
     filter->src_plen_le = 128;
-    add_filter(filter, &redistribute_filters);
+    add_filter(filter, chain);
+    return 1;
+}
+
+/* Configuration reload.  The configuration is parsed again from scratch
+   with the old filters set aside, and each new chain is compared with
+   the old one.  Since the first matching filter wins, a route can only
+   get a different verdict if it is matched by one of the filters that
+   are not in the common head or tail of both chains, so only those
+   routes are re-evaluated.  Interfaces whose configuration changed are
+   reconfigured in place, keeping their neighbours. */
+
+struct filter_diff {
+    struct filter *old, *new;
+    /* The filters with index in [start, old_end) in the old chain, and in
+       [start, new_end) in the new one, differ. */
+    int start, old_end, new_end;
+};
+
+static int
+same_bytes(const unsigned char *a, const unsigned char *b, int len)
+{
+    if(a == NULL || b == NULL)
+        return a == b;
+    return memcmp(a, b, len) == 0;
+}
+
+static int
+filter_equal(const struct filter *a, const struct filter *b)
+{
+    if(a->ifname == NULL || b->ifname == NULL) {
+        if(a->ifname != b->ifname)
+            return 0;
+    } else if(strcmp(a->ifname, b->ifname) != 0) {
+        return 0;
+    }
+
+    return a->af == b->af &&
+        same_bytes(a->id, b->id, 8) &&
+        same_bytes(a->prefix, b->prefix, 16) &&
+        a->plen == b->plen &&
+        a->plen_ge == b->plen_ge && a->plen_le == b->plen_le &&
+        same_bytes(a->src_prefix, b->src_prefix, 16) &&
+        a->src_plen == b->src_plen &&
+        a->src_plen_ge == b->src_plen_ge &&
+        a->src_plen_le == b->src_plen_le &&
+        same_bytes(a->neigh, b->neigh, 16) &&
+        a->proto == b->proto &&
+        a->action.add_metric == b->action.add_metric &&
+        same_bytes(a->action.src_prefix, b->action.src_prefix, 16) &&
+        a->action.src_plen == b->action.src_plen &&
+        a->action.table == b->action.table;
+}
+
+static int
+chain_length(struct filter *f)
+{
+    int n = 0;
+    while(f) {
+        n++;
+        f = f->next;
+    }
+    return n;
+}
+
+static void
+diff_chains(struct filter *old, struct filter *new, struct filter_diff *diff)
+{
+    int no = chain_length(old), nn = chain_length(new), run = 0;
+
+    diff->old = old;
+    diff->new = new;
+
+    diff->start = 0;
+    while(old && new && filter_equal(old, new)) {
+        diff->start++;
+        old = old->next;
+        new = new->next;
+    }
+
+    /* Align the tails, then find the longest run of equal filters
+       that reaches the end of both chains. */
+    while(no > nn && old) {
+        old = old->next;
+        no--;
+    }
+    while(nn > no && new) {
+        new = new->next;
+        nn--;
+    }
+    while(old && new) {
+        run = filter_equal(old, new) ? run + 1 : 0;
+        old = old->next;
+        new = new->next;
+    }
+
+    diff->old_end = chain_length(diff->old) - run;
+    diff->new_end = chain_length(diff->new) - run;
+}
+
+static int
+diff_empty(const struct filter_diff *diff)
+{
+    return diff->old_end <= diff->start && diff->new_end <= diff->start;
+}
+
+static int
+diff_match(const struct filter_diff *diff, const unsigned char *id,
+           const unsigned char *prefix, unsigned short plen,
+           const unsigned char *src_prefix, unsigned short src_plen,
+           const unsigned char *neigh, unsigned int ifindex)
+{
+    struct filter *f;
+
+    for(f = diff->old; f && f->index < diff->old_end; f = f->next) {
+        if(f->index >= diff->start &&
+           filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                        neigh, ifindex, 0))
+            return 1;
+    }
+    for(f = diff->new; f && f->index < diff->new_end; f = f->next) {
+        if(f->index >= diff->start &&
+           filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                        neigh, ifindex, 0))
+            return 1;
+    }
+    return 0;
+}
+
+/* Return the routes that are matched by a filter in diff.  Input filters
+   also depend on the originator and the neighbour. */
+static struct babel_route **
+diff_routes(const struct filter_diff *diff, int which, int input,
+            int *n_return)
+{
+    struct route_stream *stream;
+    struct babel_route *route, **routes = NULL;
+    int n = 0, max = 0;
+
+    stream = route_stream(which);
+    if(stream == NULL)
+        goto fail;
+
+    while(1) {
+        int match;
+        route = route_stream_next(stream);
+        if(route == NULL)
+            break;
+        if(input)
+            match = diff_match(diff, route->src->id,
+                               route->src->prefix, route->src->plen,
+                               route->src->src_prefix, route->src->src_plen,
+                               route->neigh->address,
+                               route->neigh->ifp->ifindex);
+        else
+            match = diff_match(diff, NULL,
+                               route->src->prefix, route->src->plen,
+                               route->src->src_prefix, route->src->src_plen,
+                               NULL, 0);
+        if(!match)
+            continue;
+        if(n >= max) {
+            struct babel_route **new_routes;
+            max = max < 1 ? 16 : 2 * max;
+            new_routes = realloc(routes, max * sizeof(struct babel_route*));
+            if(new_routes == NULL) {
+                route_stream_done(stream);
+                goto fail;
+            }
+            routes = new_routes;
+        }
+        routes[n++] = route;
+    }
+    route_stream_done(stream);
+
+    *n_return = n;
+    return routes;
+
+ fail:
+    fprintf(stderr, "Couldn't collect routes to re-evaluate.\n");
+    free(routes);
+    *n_return = 0;
+    return NULL;
+}
+
+/* Send updates for the routes whose output verdict may have changed. */
+static void
+reannounce_routes(const struct filter_diff *diff)
+{
+    struct interface *ifp;
+
+    FOR_ALL_INTERFACES(ifp) {
+        struct route_stream *routes;
+        struct xroute_stream *xroutes;
+
+        if(!if_up(ifp))
+            continue;
+
+        routes = route_stream(ROUTE_INSTALLED);
+        if(routes) {
+            while(1) {
+                struct babel_route *route = route_stream_next(routes);
+                if(route == NULL)
+                    break;
+                if(diff_match(diff, route->src->id,
+                              route->src->prefix, route->src->plen,
+                              route->src->src_prefix, route->src->src_plen,
+                              NULL, ifp->ifindex))
+                    send_update(ifp, 1, route->src->prefix, route->src->plen,
+                                route->src->src_prefix, route->src->src_plen);
+            }
+            route_stream_done(routes);
+        }
+
+        xroutes = xroute_stream();
+        if(xroutes) {
+            while(1) {
+                struct xroute *xroute = xroute_stream_next(xroutes);
+                if(xroute == NULL)
+                    break;
+                if(diff_match(diff, myid, xroute->prefix, xroute->plen,
+                              xroute->src_prefix, xroute->src_plen,
+                              NULL, ifp->ifindex))
+                    send_update(ifp, 1, xroute->prefix, xroute->plen,
+                                xroute->src_prefix, xroute->src_plen);
+            }
+            xroute_stream_done(xroutes);
+        }
+    }
+}
+
+static void
+free_chain(struct filter_chain *chain)
+{
+    struct filter *f = chain->filters;
+    uncompile_filters(chain);
+    while(f) {
+        struct filter *next = f->next;
+        free_filter(f);
+        f = next;
+    }
+    memset(chain, 0, sizeof(struct filter_chain));
+}
+
+static int
+chain_denies(struct filter_chain *chain)
+{
+    struct filter *f;
+    for(f = chain->filters; f; f = f->next)
+        if(f->action.add_metric >= INFINITY)
+            return 1;
+    return 0;
+}
+
+static int
+ifconf_equal(const struct interface_conf *a, const struct interface_conf *b)
+{
+    static const struct interface_conf zero;
+
+    if(a == NULL)
+        a = &zero;
+    if(b == NULL)
+        b = &zero;
+
+#define SAME(field) (a->field == b->field)
+
+    return SAME(hello_interval) && SAME(update_interval) && SAME(cost) &&
+        SAME(type) && SAME(split_horizon) && SAME(lq) && SAME(faraway) &&
+        SAME(channel) && SAME(enable_timestamps) && SAME(rtt_decay) &&
+        SAME(rtt_min) && SAME(rtt_max) && SAME(max_rtt_penalty) &&
+        SAME(adaptive_hello) && SAME(hello_interval_min) &&
+        SAME(hello_interval_max) && SAME(probe_interval) &&
+        SAME(probe_multiplier);
+
+#undef SAME
+}
+
+/* Free an interface configuration that is no longer referenced by its
+   interface, whether or not it was added at runtime. */
+static void
+release_ifconf(struct interface_conf *if_conf)
+{
+    struct interface_conf **p;
+    for(p = &interface_confs; *p; p = &(*p)->next) {
+        if(*p == if_conf) {
+            *p = if_conf->next;
+            break;
+        }
+    }
+    free(if_conf->ifname);
+    free(if_conf);
+}
+
+static void
+free_ifconfs(struct interface_conf *if_conf)
+{
+    while(if_conf) {
+        struct interface_conf *next = if_conf->next;
+        free(if_conf->ifname);
+        free(if_conf);
+        if_conf = next;
+    }
+}
+
+static void
+reload_interfaces(void)
+{
+    struct interface_conf *old_default = default_interface_conf;
+    struct interface *ifp;
+
+    if(ifconf_equal(reload_default, old_default)) {
+        free(reload_default);
+        reload_default = old_default;
+    }
+    default_interface_conf = reload_default;
+    reload_default = NULL;
+
+    FOR_ALL_INTERFACES(ifp) {
+        struct interface_conf *old = ifp->conf, *if_conf, **p;
+        int changed;
+
+        if_conf = default_interface_conf;
+        for(p = &reload_confs; *p; p = &(*p)->next) {
+            if(strcmp((*p)->ifname, ifp->name) == 0) {
+                if_conf = *p;
+                *p = if_conf->next;
+                if_conf->next = NULL;
+                if(default_interface_conf)
+                    merge_ifconf(if_conf, if_conf, default_interface_conf);
+                break;
+            }
+        }
+
+        if(if_conf == old)
+            continue;
+
+        changed = !ifconf_equal(old, if_conf);
+        ifp->conf = if_conf;
+        if(old && old != old_default)
+            release_ifconf(old);
+        if(changed) {
+            debugf("Configuration of interface %s changed.\n", ifp->name);
+            reconfigure_interface(ifp);
+        }
+    }
+
+    if(old_default && old_default != default_interface_conf)
+        free(old_default);
+
+    /* The remaining ones are for new interfaces. */
+    while(reload_confs) {
+        struct interface_conf *if_conf = reload_confs;
+        reload_confs = reload_confs->next;
+        if_conf->next = NULL;
+        if(default_interface_conf)
+            merge_ifconf(if_conf, if_conf, default_interface_conf);
+        if(add_interface(if_conf->ifname, if_conf) == NULL) {
+            fprintf(stderr, "Couldn't add interface %s.\n", if_conf->ifname);
+            free(if_conf->ifname);
+            free(if_conf);
+        }
+    }
+}
+
+int
+begin_reload(void)
+{
+    int i;
+
+    if(!config_finalised || config_reloading)
+        return -1;
+
+    for(i = 0; i < 4; i++) {
+        saved_chains[i] = *chains[i];
+        memset(chains[i], 0, sizeof(struct filter_chain));
+    }
+    saved_generation = filter_generation;
+    config_reloading = 1;
+    return 1;
+}
+
+/* Complete a reload started with begin_reload.  If ok is false, the new
+   configuration is discarded and the old one is left untouched. */
+
+int
+finish_reload(int ok)
+{
+    struct filter_chain new_chains[4];
+    struct filter_diff diffs[4];
+    int changed[4];
+    struct babel_route **reinstall = NULL;
+    int i, n = 0, any = 0;
+
+    assert(config_reloading);
+
+    if(ok && add_local_filter(&redistribute_filters) < 0)
+        ok = 0;
+
+    config_reloading = 0;
+    for(i = 0; i < 4; i++) {
+        new_chains[i] = *chains[i];
+        *chains[i] = saved_chains[i];
+    }
+    filter_generation = saved_generation;
+
+    if(!ok) {
+        for(i = 0; i < 4; i++)
+            free_chain(&new_chains[i]);
+        free_ifconfs(reload_confs);
+        free(reload_default);
+        reload_confs = reload_default = NULL;
+        return -1;
+    }
+
+    for(i = 0; i < 4; i++) {
+        diff_chains(chains[i]->filters, new_chains[i].filters, &diffs[i]);
+        changed[i] = !diff_empty(&diffs[i]);
+        if(!changed[i])
+            free_chain(&new_chains[i]);
+        any |= changed[i];
+    }
+
+    if(any)
+        filter_generation++;
+
+    /* Routes must be removed from the table chosen by the old install
+       filters. */
+    if(changed[3]) {
+        reinstall = diff_routes(&diffs[3], ROUTE_INSTALLED, 0, &n);
+        for(i = 0; i < n; i++)
+            uninstall_route(reinstall[i]);
+    }
+
+    /* Swap in the new chains, keeping the old ones in new_chains until the
+       differences have been applied. */
+    for(i = 0; i < 4; i++) {
+        if(changed[i]) {
+            struct filter_chain old = *chains[i];
+            *chains[i] = new_chains[i];
+            new_chains[i] = old;
+            compile_filters(chains[i]);
+        }
+    }
+
+    for(i = 0; i < n; i++)
+        install_route(reinstall[i]);
+    free(reinstall);
+
+    if(changed[0]) {
+        struct babel_route **routes;
+        routes = diff_routes(&diffs[0], ROUTE_ALL, 1, &n);
+        for(i = 0; i < n; i++)
+            update_route_metric(routes[i]);
+        free(routes);
+        /* Routes that were denied have not been kept, so ask our
+           neighbours for them again. */
+        if(chain_denies(&new_chains[0]))
+            send_request(NULL, NULL, 0, NULL, 0);
+    }
+
+    if(changed[1])
+        reannounce_routes(&diffs[1]);
+
+    if(changed[2]) {
+        /* The kernel may be dropping notifications for routes that are
+           now redistributed; the full check below catches up with those
+           that were lost. */
+        kernel_update_filter();
+        check_xroutes(1);
+    }
+
+    for(i = 0; i < 4; i++) {
+        if(changed[i]) {
+            debugf("Reloaded %s filters (%d replaced with %d).\n",
+                   i == 0 ? "input" : i == 1 ? "output" :
+                   i == 2 ? "redistribute" : "install",
+                   MAX(diffs[i].old_end - diffs[i].start, 0),
+                   MAX(diffs[i].new_end - diffs[i].start, 0));
+            free_chain(&new_chains[i]);
+        }
+    }
+
+    reload_interfaces();
+
+    return 1;
+}
+
+int
+finalise_config()
+{
+    if(add_local_filter(&redistribute_filters) < 0)
+        return -1;
+
+    compile_filters(&input_filters);
+    compile_filters(&output_filters);
+    compile_filters(&redistribute_filters);
+    compile_filters(&install_filters);
 
     while(interface_confs) {
         struct interface_conf *if_conf;
@@ -29,6 +29,8 @@ THE SOFTWARE.
 #define CONFIG_ACTION_UNMONITOR 4
 #define CONFIG_ACTION_NO 5
 
+struct local_monitor;
+
 struct filter_result {
     unsigned int add_metric; /* allow = 0, deny = INF, metric = <0..INF> */
     unsigned char *src_prefix;
@@ -50,15 +52,19 @@ struct filter {
     unsigned char *neigh;
     int proto;                  /* May be negative */
     struct filter_result action;
+    int index;                  /* position in its chain */
     struct filter *next;
 };
 
 extern struct interface_conf *default_interface_conf;
+/* Incremented whenever the result of filtering may change. */
+extern unsigned int filter_generation;
 
 void flush_ifconf(struct interface_conf *if_conf);
 
 int parse_config_from_file(const char *filename, int *line_return);
-int parse_config_from_string(char *string, int n, const char **message_return);
+int parse_config_from_string(char *string, int n, const char **message_return,
+                             struct local_monitor *monitor_return);
 void renumber_filters(void);
 
 int input_filter(const unsigned char *id,
@@ -73,7 +79,10 @@ int redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     const unsigned char *src_prefix, unsigned short src_plen,
                     unsigned int ifindex, int proto,
                     struct filter_result *result);
+int redistribute_protocols(int *protos, int max, int *boot_r);
 int install_filter(const unsigned char *prefix, unsigned short plen,
                    const unsigned char *src_prefix, unsigned short src_plen,
                    struct filter_result *result);
+int begin_reload(void);
+int finish_reload(int ok);
 int finalise_config(void);
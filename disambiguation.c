@@ -35,6 +35,7 @@ THE SOFTWARE.
 #include "source.h"
 #include "neighbour.h"
 #include "rule.h"
+#include "trie.h"
 #include "disambiguation.h"
 
 struct zone {
@@ -139,76 +140,287 @@ zone_equal(const struct zone *z1, const struct zone *z2)
         memcmp(z1->src_prefix, z2->src_prefix, 16) == 0;
 }
 
+/* The installed routes, indexed by destination and then by source: the
+   data of a node of installed_routes is a trie of sources, the data of
+   whose nodes is the installed route. */
+
+static struct trie installed_routes;
+
+static struct trie *
+source_trie(const unsigned char *prefix, unsigned char plen)
+{
+    struct trie_node *node = trie_find(&installed_routes, prefix, plen);
+    return node ? node->data : NULL;
+}
+
 static const struct babel_route *
-min_conflict(const struct zone *zone, const struct babel_route *rt)
+index_find(const unsigned char *prefix, unsigned char plen,
+           const unsigned char *src_prefix, unsigned char src_plen)
 {
-    struct babel_route *rt1 = NULL;
-    const struct babel_route *min = NULL;
-    struct route_stream *stream = NULL;
-    struct zone curr_zone;
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
+    struct trie *sources = source_trie(prefix, plen);
+    struct trie_node *node;
+    if(sources == NULL)
         return NULL;
+    node = trie_find(sources, src_prefix, src_plen);
+    return node ? node->data : NULL;
+}
+
+static int
+index_route(const struct babel_route *route)
+{
+    const struct source *src = route->src;
+    struct trie_node *dst_node, *src_node;
+    struct trie *sources;
+
+    dst_node = trie_get(&installed_routes, src->prefix, src->plen);
+    if(dst_node == NULL)
+        return -1;
+    if(dst_node->data == NULL) {
+        dst_node->data = calloc(1, sizeof(struct trie));
+        if(dst_node->data == NULL) {
+            trie_release(&installed_routes, dst_node);
+            return -1;
+        }
     }
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
-        if(!(conflicts(rt, rt1) &&
-             zone_equal(inter(rt, rt1, &curr_zone), zone)))
-            continue;
-        min = min_route(rt1, min);
+    sources = dst_node->data;
+    src_node = trie_get(sources, src->src_prefix, src->src_plen);
+    if(src_node == NULL) {
+        if(sources->root == NULL) {
+            free(sources);
+            dst_node->data = NULL;
+            trie_release(&installed_routes, dst_node);
+        }
+        return -1;
+    }
+    src_node->data = (void*)route;
+    return 0;
+}
+
+static void
+unindex_route(const struct babel_route *route)
+{
+    const struct source *src = route->src;
+    struct trie_node *dst_node, *src_node;
+    struct trie *sources;
+
+    dst_node = trie_find(&installed_routes, src->prefix, src->plen);
+    if(dst_node == NULL)
+        return;
+    sources = dst_node->data;
+    src_node = trie_find(sources, src->src_prefix, src->src_plen);
+    if(src_node == NULL || src_node->data != route)
+        return;
+    src_node->data = NULL;
+    trie_release(sources, src_node);
+    if(sources->root == NULL) {
+        free(sources);
+        dst_node->data = NULL;
+        trie_release(&installed_routes, dst_node);
+    }
+}
+
+static void
+index_failed(void)
+{
+    fprintf(stderr, "Couldn't index installed route.\n");
+}
+
+/* Walking the routes that conflict with a given route.  A route rt1
+   conflicts with rt if it has a less specific destination and a more
+   specific source, or the other way around; we walk the destinations
+   that cover rt's (resp. are covered by rt's), and for each of them the
+   sources that are covered by rt's (resp. cover rt's). */
+
+struct conflict_walk {
+    const struct babel_route *route;
+    const struct babel_route **routes;
+    int n, max;
+};
+
+static int
+collect_conflict(struct trie_node *node, void *closure)
+{
+    struct conflict_walk *walk = closure;
+    const struct babel_route *rt1 = node->data;
+    if(!conflicts(walk->route, rt1))
+        return 0;
+    if(walk->n >= walk->max) {
+        const struct babel_route **new_routes;
+        int n = walk->max < 1 ? 8 : 2 * walk->max;
+        new_routes = realloc(walk->routes, n * sizeof(struct babel_route*));
+        if(new_routes == NULL)
+            return -1;
+        walk->routes = new_routes;
+        walk->max = n;
     }
-    route_stream_done(stream);
-    return min;
+    walk->routes[walk->n++] = rt1;
+    return 0;
+}
+
+static int
+conflicts_less_specific(struct trie_node *node, void *closure)
+{
+    struct conflict_walk *walk = closure;
+    const struct source *src = walk->route->src;
+    if(node->plen >= src->plen)
+        return 0;
+    return trie_covered(node->data, src->src_prefix, src->src_plen,
+                        collect_conflict, closure);
+}
+
+static int
+conflicts_more_specific(struct trie_node *node, void *closure)
+{
+    struct conflict_walk *walk = closure;
+    const struct source *src = walk->route->src;
+    if(node->plen <= src->plen)
+        return 0;
+    return trie_covering(node->data, src->src_prefix, src->src_plen,
+                         collect_conflict, closure);
 }
 
+/* Stores the installed routes that conflict with rt into the shared
+   buffer conflict_buf; returns their number, or -1 on failure. */
+
+static struct conflict_walk conflict_buf;
+
+static int
+find_conflicts(const struct babel_route *rt)
+{
+    const struct source *src = rt->src;
+    int rc;
+
+    conflict_buf.route = rt;
+    conflict_buf.n = 0;
+    rc = trie_covering(&installed_routes, src->prefix, src->plen,
+                       conflicts_less_specific, &conflict_buf);
+    if(rc == 0)
+        rc = trie_covered(&installed_routes, src->prefix, src->plen,
+                          conflicts_more_specific, &conflict_buf);
+    if(rc != 0) {
+        fprintf(stderr, "Couldn't allocate conflict list.\n");
+        return -1;
+    }
+    return conflict_buf.n;
+}
+
+struct zone_walk {
+    const struct zone *zone;
+    const struct babel_route *route;
+    const struct babel_route *min;
+};
+
+static int
+min_conflict_source(struct trie_node *node, void *closure)
+{
+    struct zone_walk *walk = closure;
+    struct trie_node *src_node;
+    const struct babel_route *rt1;
+    struct zone curr_zone;
+
+    src_node = trie_find(node->data,
+                         walk->zone->src_prefix, walk->zone->src_plen);
+    if(src_node == NULL)
+        return 0;
+    rt1 = src_node->data;
+    if(conflicts(walk->route, rt1) &&
+       zone_equal(inter(walk->route, rt1, &curr_zone), walk->zone))
+        walk->min = min_route(rt1, walk->min);
+    return 0;
+}
+
+static int
+min_conflict_destination(struct trie_node *node, void *closure)
+{
+    struct zone_walk *walk = closure;
+    const struct babel_route *rt1 = node->data;
+    struct zone curr_zone;
+
+    if(conflicts(walk->route, rt1) &&
+       zone_equal(inter(walk->route, rt1, &curr_zone), walk->zone))
+        walk->min = min_route(rt1, walk->min);
+    return 0;
+}
+
+/* The intersection of rt with a conflicting route rt1 is made of the
+   destination of one and the source of the other, so that the routes
+   that conflict with rt within zone have either zone's source and a
+   destination covering rt's, or zone's destination and a source
+   covering rt's. */
+
+static const struct babel_route *
+min_conflict(const struct zone *zone, const struct babel_route *rt)
+{
+    const struct source *src = rt->src;
+    struct zone_walk walk = {zone, rt, NULL};
+    struct trie *sources;
+
+    if(zone->dst_plen == src->plen &&
+       memcmp(zone->dst_prefix, src->prefix, 16) == 0)
+        trie_covering(&installed_routes, src->prefix, src->plen,
+                      min_conflict_source, &walk);
+    if(zone->src_plen == src->src_plen &&
+       memcmp(zone->src_prefix, src->src_prefix, 16) == 0) {
+        sources = source_trie(zone->dst_prefix, zone->dst_plen);
+        if(sources)
+            trie_covering(sources, src->src_prefix, src->src_plen,
+                          min_conflict_destination, &walk);
+    }
+    return walk.min;
+}
+
+static int
+has_source(struct trie_node *node, void *closure)
+{
+    const struct zone *zone = closure;
+    if(node->plen >= zone->dst_plen)
+        return 0;
+    return trie_find(node->data, zone->src_prefix, zone->src_plen) != NULL;
+}
+
+static int
+min_solution(struct trie_node *node, void *closure)
+{
+    struct zone_walk *walk = closure;
+    const struct babel_route *rt1 = node->data;
+    if(node->plen >= walk->zone->src_plen ||
+       is_default(rt1->src->src_prefix, rt1->src->src_plen))
+        return 0;
+    walk->min = min_route(rt1, walk->min);
+    return 0;
+}
+
+/* A source-specific route rt1 solves the conflict in rt's zone if some
+   installed rt2 conflicts with it, with the intersection being that
+   zone and rt1 being the more specific.  Then rt1 has rt's destination
+   and a less specific source, and rt2 has rt's source and a less
+   specific destination; the two conditions are independent. */
+
 static const struct babel_route *
 conflict_solution(const struct babel_route *rt)
 {
-    const struct babel_route *rt1 = NULL, *rt2 = NULL;
-    struct route_stream *stream1 = NULL;
-    struct route_stream *stream2 = NULL;
-    const struct babel_route *min = NULL; /* == solution */
     struct zone zone;
-    struct zone tmp;
-    /* Having a conflict requires at least one specific route. */
-    stream1 = route_stream(ROUTE_SS_INSTALLED);
-    if(!stream1) {
-        return NULL;
-    }
-    while(1) {
-        rt1 = route_stream_next(stream1);
-        if(rt1 == NULL) break;
-
-        stream2 = route_stream(ROUTE_INSTALLED);
-        if(!stream2) {
-            route_stream_done(stream1);
-            fprintf(stderr, "Couldn't allocate route stream.\n");
-            return NULL;
-        }
+    struct zone_walk walk = {&zone, rt, NULL};
+    struct trie *sources;
 
-        while(1) {
-            rt2 = route_stream_next(stream2);
-            if(rt2 == NULL) break;
-            if(!(conflicts(rt1, rt2) &&
-                 zone_equal(inter(rt1, rt2, &tmp), to_zone(rt, &zone)) &&
-                 rt_cmp(rt1, rt2) < 0))
-                continue;
-            min = min_route(rt1, min);
-        }
-        route_stream_done(stream2);
-    }
-    route_stream_done(stream1);
-    return min;
+    to_zone(rt, &zone);
+    sources = source_trie(zone.dst_prefix, zone.dst_plen);
+    if(sources == NULL)
+        return NULL;
+    if(!trie_covering(&installed_routes, zone.dst_prefix, zone.dst_plen,
+                      has_source, &zone))
+        return NULL;
+    trie_covering(sources, zone.src_prefix, zone.src_plen,
+                  min_solution, &walk);
+    return walk.min;
 }
 
 static int
 is_installed(struct zone *zone)
 {
     return zone != NULL &&
-        find_installed_route(zone->dst_prefix, zone->dst_plen,
-                             zone->src_prefix, zone->src_plen) != NULL;
+        index_find(zone->dst_prefix, zone->dst_plen,
+                   zone->src_prefix, zone->src_plen) != NULL;
 }
 
 static int
@@ -266,11 +478,10 @@ chg_route_metric(const struct zone *zone, const struct babel_route *route,
 int
 kinstall_route(const struct babel_route *route)
 {
-    int rc;
+    int rc, i, n;
     struct zone zone;
     const struct babel_route *rt1 = NULL;
     const struct babel_route *rt2 = NULL;
-    struct route_stream *stream = NULL;
     int v4 = v4mapped(route->nexthop);
 
     debugf("install_route(%s from %s)\n",
@@ -283,19 +494,15 @@ kinstall_route(const struct babel_route *route)
         goto end;
     }
 
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
+    n = find_conflicts(route);
+    if(n < 0)
         return -1;
-    }
     /* Install source-specific conflicting routes */
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
+    for(i = 0; i < n; i++) {
+        rt1 = conflict_buf.routes[i];
 
         inter(route, rt1, &zone);
-        if(!(conflicts(route, rt1) &&
-             !is_installed(&zone) &&
+        if(!(!is_installed(&zone) &&
              rt_cmp(rt1, min_conflict(&zone, route)) == 0))
             continue;
         rt2 = min_conflict(&zone, rt1);
@@ -304,7 +511,6 @@ kinstall_route(const struct babel_route *route)
         else if(rt_cmp(route, rt2) < 0 && rt_cmp(route, rt1) < 0)
             chg_route(&zone, rt2, route);
     }
-    route_stream_done(stream);
 
     /* Non conflicting case */
     to_zone(route, &zone);
@@ -320,21 +526,23 @@ kinstall_route(const struct babel_route *route)
         if(save != EEXIST)
             return -1;
     }
+    if(index_route(route) < 0)
+        index_failed();
     return 0;
 }
 
 int
 kuninstall_route(const struct babel_route *route)
 {
-    int rc;
+    int rc, i, n;
     struct zone zone;
     const struct babel_route *rt1 = NULL, *rt2 = NULL;
-    struct route_stream *stream = NULL;
     int v4 = v4mapped(route->nexthop);
 
     debugf("uninstall_route(%s from %s)\n",
            format_prefix(route->src->prefix, route->src->plen),
            format_prefix(route->src->src_prefix, route->src->src_plen));
+    unindex_route(route);
     to_zone(route, &zone);
     if(kernel_disambiguate(v4)) {
         rc = del_route(&zone, route);
@@ -352,18 +560,14 @@ kuninstall_route(const struct babel_route *route)
         perror("kernel_route(FLUSH)");
 
     /* Remove source-specific conflicting routes */
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
+    n = find_conflicts(route);
+    if(n < 0)
         return -1;
-    }
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
+    for(i = 0; i < n; i++) {
+        rt1 = conflict_buf.routes[i];
 
         inter(route, rt1, &zone);
-        if(!(conflicts(route, rt1) &&
-             !is_installed(&zone) &&
+        if(!(!is_installed(&zone) &&
              rt_cmp(rt1, min_conflict(&zone, route)) == 0))
             continue;
         rt2 = min_conflict(&zone, rt1);
@@ -372,7 +576,6 @@ kuninstall_route(const struct babel_route *route)
         else if(rt_cmp(route, rt2) < 0 && rt_cmp(route, rt1) < 0)
             chg_route(&zone, route, rt2);
     }
-    route_stream_done(stream);
 
     return rc;
 }
@@ -380,10 +583,9 @@ kuninstall_route(const struct babel_route *route)
 int
 kswitch_routes(const struct babel_route *old, const struct babel_route *new)
 {
-    int rc;
+    int rc, i, n;
     struct zone zone;
-    struct babel_route *rt1 = NULL;
-    struct route_stream *stream = NULL;
+    const struct babel_route *rt1 = NULL;
 
     debugf("switch_routes(%s from %s)\n",
            format_prefix(old->src->prefix, old->src->plen),
@@ -397,27 +599,25 @@ kswitch_routes(const struct babel_route *old, const struct babel_route *new)
 
     /* Remove source-specific conflicting routes */
     if(!kernel_disambiguate(v4mapped(old->nexthop))) {
-        stream = route_stream(ROUTE_INSTALLED);
-        if(!stream) {
-            fprintf(stderr, "Couldn't allocate route stream.\n");
+        n = find_conflicts(old);
+        if(n < 0)
             return -1;
-        }
-        while(1) {
-            rt1 = route_stream_next(stream);
-            if(rt1 == NULL) break;
+        for(i = 0; i < n; i++) {
+            rt1 = conflict_buf.routes[i];
 
             inter(old, rt1, &zone);
-            if(!(conflicts(old, rt1) &&
-                 !is_installed(&zone) &&
+            if(!(!is_installed(&zone) &&
                  rt_cmp(rt1, min_conflict(&zone, old)) == 0 &&
                  rt_cmp(old, rt1) < 0 &&
                  rt_cmp(old, min_conflict(&zone, rt1)) == 0))
                 continue;
             chg_route(&zone, old, new);
         }
-        route_stream_done(stream);
     }
 
+    unindex_route(old);
+    if(index_route(new) < 0)
+        index_failed();
     return rc;
 }
 
@@ -427,9 +627,8 @@ kchange_route_metric(const struct babel_route *route,
 {
     int old_metric = metric_to_kernel(route_metric(route));
     int new_metric = metric_to_kernel(MIN(refmetric + cost + add, INFINITY));
-    int rc;
-    struct babel_route *rt1 = NULL;
-    struct route_stream *stream = NULL;
+    int rc, i, n;
+    const struct babel_route *rt1 = NULL;
     struct zone zone;
 
     debugf("change_route_metric(%s from %s, %d -> %d)\n",
@@ -444,27 +643,56 @@ kchange_route_metric(const struct babel_route *route,
     }
 
     if(!kernel_disambiguate(v4mapped(route->nexthop))) {
-        stream = route_stream(ROUTE_INSTALLED);
-        if(!stream) {
-            fprintf(stderr, "Couldn't allocate route stream.\n");
+        n = find_conflicts(route);
+        if(n < 0)
             return -1;
-        }
-
-        while(1) {
-            rt1 = route_stream_next(stream);
-            if(rt1 == NULL) break;
+        for(i = 0; i < n; i++) {
+            rt1 = conflict_buf.routes[i];
 
             inter(route, rt1, &zone);
-            if(!(conflicts(route, rt1) &&
-                 !is_installed(&zone) &&
+            if(!(!is_installed(&zone) &&
                  rt_cmp(rt1, min_conflict(&zone, route)) == 0 &&
                  rt_cmp(route, rt1) < 0 &&
                  rt_cmp(route, min_conflict(&zone, rt1)) == 0))
                 continue;
             chg_route_metric(&zone, route, old_metric, new_metric);
         }
-        route_stream_done(stream);
     }
 
     return rc;
 }
+
+/* Make the kernel route of an installed route use the nexthops of the n
+   routes in others in addition to its own.  This is only done for routes
+   that are not source-specific, so there are no conflicts to consider. */
+int
+kchange_route_nexthops(const struct babel_route *route,
+                       struct babel_route * const *others, int n)
+{
+    struct kernel_nexthop nexthops[KERNEL_MAX_NEXTHOPS];
+    int i, rc, table;
+
+    debugf("change_route_nexthops(%s, %d nexthops)\n",
+           format_prefix(route->src->prefix, route->src->plen), n + 1);
+
+    n = MIN(n, KERNEL_MAX_NEXTHOPS - 1);
+    memcpy(nexthops[0].gw, route->nexthop, 16);
+    nexthops[0].ifindex = route->neigh->ifp->ifindex;
+    for(i = 0; i < n; i++) {
+        memcpy(nexthops[i + 1].gw, others[i]->nexthop, 16);
+        nexthops[i + 1].ifindex = others[i]->neigh->ifp->ifindex;
+    }
+
+    table = find_table(route->src->prefix, route->src->plen,
+                       route->src->src_prefix, route->src->src_plen);
+    rc = kernel_route_multipath(table, route->src->prefix, route->src->plen,
+                                route->src->src_prefix, route->src->src_plen,
+                                nexthops, n + 1,
+                                metric_to_kernel(route_metric(route)));
+    if(rc < 0) {
+        int save = errno;
+        perror("kernel_route(MULTIPATH)");
+        errno = save;
+    }
+    return rc;
+}
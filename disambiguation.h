@@ -25,3 +25,5 @@ int kuninstall_route(const struct babel_route *route);
 int kswitch_routes(const struct babel_route *old, const struct babel_route *new);
 int kchange_route_metric(const struct babel_route *route,
                          unsigned refmetric, unsigned cost, unsigned add);
+int kchange_route_nexthops(const struct babel_route *route,
+                           struct babel_route * const *others, int n);
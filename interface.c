@@ -129,6 +129,83 @@ flush_interface(char *ifname)
     return 1;
 }
 
+/* Whether the link to a neighbour shows loss or jitter.  Only the hellos
+   received since we last shortened the interval because of this
+   neighbour are considered, so that a single loss is acted upon once. */
+static int
+neighbour_unstable(struct neighbour *neigh)
+{
+    unsigned short reach = neigh->hello.reach, mask;
+    int n = 8;
+
+    /* Only hellos and RTT samples received since the last decrease
+       count, so that a single event halves the interval once. */
+    if(neigh->hello_adapt_seqno >= 0)
+        n = neigh->hello.seqno < 0 ? 0 :
+            MIN(n, seqno_minus(neigh->hello.seqno, neigh->hello_adapt_seqno));
+
+    /* A hole among the last n hellos, ignoring new neighbours. */
+    if(n > 0) {
+        mask = 0xFFFF << (16 - n);
+        if((reach & mask) != mask && (reach & 0x00FF) != 0)
+            return 1;
+    }
+
+    if(valid_rtt(neigh) &&
+       timeval_compare(&neigh->rtt_time, &neigh->hello_adapt_rtt_time) > 0 &&
+       neigh->rtt_var >= 1000 && neigh->rtt_var > neigh->rtt / 4)
+        return 1;
+
+    return 0;
+}
+
+/* Called just before a scheduled hello, so that the hello carries the
+   new interval.  The interval is halved as soon as a neighbour shows
+   loss or RTT jitter, and grows by half after 8 hellos during which
+   every neighbour was received perfectly. */
+void
+adapt_hello_interval(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    unsigned interval = ifp->hello_interval;
+    int unstable = 0, perfect = 0, n = 0;
+
+    if(!(ifp->flags & IF_ADAPTIVE_HELLO))
+        return;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        if(neighbour_unstable(neigh)) {
+            unstable = 1;
+            break;
+        }
+        n++;
+        if(neigh->hello.reach == 0xFFFF)
+            perfect++;
+    }
+
+    if(unstable) {
+        neigh->hello_adapt_seqno = neigh->hello.seqno;
+        neigh->hello_adapt_rtt_time = neigh->rtt_time;
+        ifp->hello_stable = 0;
+        interval = MAX(interval / 2, ifp->hello_interval_min);
+    } else if(n > 0 && perfect == n) {
+        if(++ifp->hello_stable >= 8) {
+            ifp->hello_stable = 0;
+            interval = MIN(interval + interval / 2, ifp->hello_interval_max);
+        }
+    } else {
+        ifp->hello_stable = 0;
+    }
+
+    if(interval != ifp->hello_interval) {
+        debugf("Hello interval on %s: %u -> %u.\n",
+               ifp->name, ifp->hello_interval, interval);
+        ifp->hello_interval = interval;
+    }
+}
+
 /* This should be no more than half the hello interval, so that hellos
    aren't sent late.  The result is in milliseconds. */
 unsigned
@@ -274,10 +351,145 @@ check_link_local_addresses(struct interface *ifp)
     return 0;
 }
 
+/* Compute the parameters of an interface that derive from its
+   configuration. */
+static void
+apply_interface_conf(struct interface *ifp)
+{
+    int rc, type;
+
+    type = IF_CONF(ifp, type);
+    if(type == IF_TYPE_DEFAULT) {
+        if(all_wireless) {
+            type = IF_TYPE_WIRELESS;
+        } else {
+            rc = kernel_interface_wireless(ifp->name, ifp->ifindex);
+            if(rc < 0) {
+                fprintf(stderr,
+                        "Warning: couldn't determine whether %s (%d) "
+                        "is a wireless interface.\n",
+                        ifp->name, ifp->ifindex);
+            } else if(rc) {
+                type = IF_TYPE_WIRELESS;
+            }
+        }
+    }
+
+    /* Type is CONFIG_TYPE_AUTO if interface is not known to be
+       wireless, so provide sane defaults for that case. */
+
+    if(type == IF_TYPE_WIRELESS)
+        ifp->flags |= IF_WIRELESS;
+    else
+        ifp->flags &= ~IF_WIRELESS;
+
+    ifp->cost = IF_CONF(ifp, cost);
+    if(ifp->cost <= 0)
+        ifp->cost = type == IF_TYPE_WIRELESS ? 256 : 96;
+
+    if(IF_CONF(ifp, split_horizon) == CONFIG_YES)
+        ifp->flags |= IF_SPLIT_HORIZON;
+    else if(IF_CONF(ifp, split_horizon) == CONFIG_NO)
+        ifp->flags &= ~IF_SPLIT_HORIZON;
+    else if(type == IF_TYPE_WIRED)
+        ifp->flags |= IF_SPLIT_HORIZON;
+    else
+        ifp->flags &= ~IF_SPLIT_HORIZON;
+
+    if(IF_CONF(ifp, lq) == CONFIG_YES)
+        ifp->flags |= IF_LQ;
+    else if(IF_CONF(ifp, lq) == CONFIG_NO)
+        ifp->flags &= ~IF_LQ;
+    else if(type == IF_TYPE_WIRELESS)
+        ifp->flags |= IF_LQ;
+    else
+        ifp->flags &= ~IF_LQ;
+
+    if(IF_CONF(ifp, faraway) == CONFIG_YES)
+        ifp->flags |= IF_FARAWAY;
+    else
+        ifp->flags &= ~IF_FARAWAY;
+
+    if(IF_CONF(ifp, hello_interval) > 0)
+        ifp->hello_interval = IF_CONF(ifp, hello_interval);
+    else if(type == IF_TYPE_WIRELESS)
+        ifp->hello_interval = default_wireless_hello_interval;
+    else
+        ifp->hello_interval = default_wired_hello_interval;
+
+    ifp->update_interval =
+        IF_CONF(ifp, update_interval) > 0 ?
+        IF_CONF(ifp, update_interval) :
+        ifp->hello_interval * 4;
+
+    if(IF_CONF(ifp, adaptive_hello) == CONFIG_YES)
+        ifp->flags |= IF_ADAPTIVE_HELLO;
+    else
+        ifp->flags &= ~IF_ADAPTIVE_HELLO;
+
+    ifp->hello_interval_min =
+        IF_CONF(ifp, hello_interval_min) > 0 ?
+        IF_CONF(ifp, hello_interval_min) :
+        MAX(ifp->hello_interval / 4, 10);
+    ifp->hello_interval_max =
+        IF_CONF(ifp, hello_interval_max) > 0 ?
+        IF_CONF(ifp, hello_interval_max) :
+        MIN(ifp->hello_interval * 4, 10 * 0xFFFF);
+    if(ifp->hello_interval_max < ifp->hello_interval_min) {
+        fprintf(stderr,
+                "Uh, hello-interval-max is less than hello-interval-min "
+                "(%u < %u). Setting it to %u.\n",
+                ifp->hello_interval_max, ifp->hello_interval_min,
+                ifp->hello_interval_min);
+        ifp->hello_interval_max = ifp->hello_interval_min;
+    }
+    ifp->hello_stable = 0;
+
+    ifp->probe_interval = IF_CONF(ifp, probe_interval);
+    ifp->probe_multiplier =
+        IF_CONF(ifp, probe_multiplier) > 0 ?
+        IF_CONF(ifp, probe_multiplier) : 3;
+
+    ifp->rtt_decay =
+        IF_CONF(ifp, rtt_decay) > 0 ?
+        IF_CONF(ifp, rtt_decay) : 42;
+
+    ifp->rtt_min =
+        IF_CONF(ifp, rtt_min) > 0 ?
+        IF_CONF(ifp, rtt_min) : 10000;
+    ifp->rtt_max =
+        IF_CONF(ifp, rtt_max) > 0 ?
+        IF_CONF(ifp, rtt_max) : 120000;
+    if(ifp->rtt_max <= ifp->rtt_min) {
+        fprintf(stderr,
+                "Uh, rtt-max is less than or equal to rtt-min (%d <= %d). "
+                "Setting it to %d.\n", ifp->rtt_max, ifp->rtt_min,
+                ifp->rtt_min + 10000);
+        ifp->rtt_max = ifp->rtt_min + 10000;
+    }
+    ifp->max_rtt_penalty = IF_CONF(ifp, max_rtt_penalty);
+    if(ifp->max_rtt_penalty == 0 && type == IF_TYPE_TUNNEL)
+        ifp->max_rtt_penalty = 96;
+
+    if(IF_CONF(ifp, enable_timestamps) == CONFIG_YES)
+        ifp->flags |= IF_TIMESTAMPS;
+    else if(IF_CONF(ifp, enable_timestamps) == CONFIG_NO)
+        ifp->flags &= ~IF_TIMESTAMPS;
+    else if(type == IF_TYPE_TUNNEL)
+        ifp->flags |= IF_TIMESTAMPS;
+    else
+        ifp->flags &= ~IF_TIMESTAMPS;
+    if(ifp->max_rtt_penalty > 0 && !(ifp->flags & IF_TIMESTAMPS))
+        fprintf(stderr,
+                "Warning: max_rtt_penalty is set "
+                "but timestamps are disabled on interface %s.\n",
+                ifp->name);
+}
+
 int
 interface_up(struct interface *ifp, int up)
 {
-    int mtu, rc, type;
+    int mtu, rc;
     struct ipv6_mreq mreq;
 
     if((!!up) == if_up(ifp))
@@ -337,102 +549,7 @@ interface_up(struct interface *ifp, int up)
                     "receive buffer for interface %s (%d) (%d bytes).\n",
                     ifp->name, ifp->ifindex, mtu);
 
-        type = IF_CONF(ifp, type);
-        if(type == IF_TYPE_DEFAULT) {
-            if(all_wireless) {
-                type = IF_TYPE_WIRELESS;
-            } else {
-                rc = kernel_interface_wireless(ifp->name, ifp->ifindex);
-                if(rc < 0) {
-                    fprintf(stderr,
-                            "Warning: couldn't determine whether %s (%d) "
-                            "is a wireless interface.\n",
-                            ifp->name, ifp->ifindex);
-                } else if(rc) {
-                    type = IF_TYPE_WIRELESS;
-                }
-            }
-        }
-
-        /* Type is CONFIG_TYPE_AUTO if interface is not known to be
-           wireless, so provide sane defaults for that case. */
-
-        if(type == IF_TYPE_WIRELESS)
-            ifp->flags |= IF_WIRELESS;
-        else
-            ifp->flags &= ~IF_WIRELESS;
-
-        ifp->cost = IF_CONF(ifp, cost);
-        if(ifp->cost <= 0)
-            ifp->cost = type == IF_TYPE_WIRELESS ? 256 : 96;
-
-        if(IF_CONF(ifp, split_horizon) == CONFIG_YES)
-            ifp->flags |= IF_SPLIT_HORIZON;
-        else if(IF_CONF(ifp, split_horizon) == CONFIG_NO)
-            ifp->flags &= ~IF_SPLIT_HORIZON;
-        else if(type == IF_TYPE_WIRED)
-            ifp->flags |= IF_SPLIT_HORIZON;
-        else
-            ifp->flags &= ~IF_SPLIT_HORIZON;
-
-        if(IF_CONF(ifp, lq) == CONFIG_YES)
-            ifp->flags |= IF_LQ;
-        else if(IF_CONF(ifp, lq) == CONFIG_NO)
-            ifp->flags &= ~IF_LQ;
-        else if(type == IF_TYPE_WIRELESS)
-            ifp->flags |= IF_LQ;
-        else
-            ifp->flags &= ~IF_LQ;
-
-        if(IF_CONF(ifp, faraway) == CONFIG_YES)
-            ifp->flags |= IF_FARAWAY;
-
-        if(IF_CONF(ifp, hello_interval) > 0)
-            ifp->hello_interval = IF_CONF(ifp, hello_interval);
-        else if(type == IF_TYPE_WIRELESS)
-            ifp->hello_interval = default_wireless_hello_interval;
-        else
-            ifp->hello_interval = default_wired_hello_interval;
-
-        ifp->update_interval =
-            IF_CONF(ifp, update_interval) > 0 ?
-            IF_CONF(ifp, update_interval) :
-            ifp->hello_interval * 4;
-
-        ifp->rtt_decay =
-            IF_CONF(ifp, rtt_decay) > 0 ?
-            IF_CONF(ifp, rtt_decay) : 42;
-
-        ifp->rtt_min =
-            IF_CONF(ifp, rtt_min) > 0 ?
-            IF_CONF(ifp, rtt_min) : 10000;
-        ifp->rtt_max =
-            IF_CONF(ifp, rtt_max) > 0 ?
-            IF_CONF(ifp, rtt_max) : 120000;
-        if(ifp->rtt_max <= ifp->rtt_min) {
-            fprintf(stderr,
-                    "Uh, rtt-max is less than or equal to rtt-min (%d <= %d). "
-                    "Setting it to %d.\n", ifp->rtt_max, ifp->rtt_min,
-                    ifp->rtt_min + 10000);
-            ifp->rtt_max = ifp->rtt_min + 10000;
-        }
-        ifp->max_rtt_penalty = IF_CONF(ifp, max_rtt_penalty);
-        if(ifp->max_rtt_penalty == 0 && type == IF_TYPE_TUNNEL)
-            ifp->max_rtt_penalty = 96;
-
-        if(IF_CONF(ifp, enable_timestamps) == CONFIG_YES)
-            ifp->flags |= IF_TIMESTAMPS;
-        else if(IF_CONF(ifp, enable_timestamps) == CONFIG_NO)
-            ifp->flags &= ~IF_TIMESTAMPS;
-        else if(type == IF_TYPE_TUNNEL)
-            ifp->flags |= IF_TIMESTAMPS;
-        else
-            ifp->flags &= ~IF_TIMESTAMPS;
-        if(ifp->max_rtt_penalty > 0 && !(ifp->flags & IF_TIMESTAMPS))
-            fprintf(stderr,
-                    "Warning: max_rtt_penalty is set "
-                    "but timestamps are disabled on interface %s.\n",
-                    ifp->name);
+        apply_interface_conf(ifp);
 
         rc = check_link_local_addresses(ifp);
         if(rc < 0) {
@@ -464,11 +581,14 @@ interface_up(struct interface *ifp, int up)
 
         set_timeout(&ifp->hello_timeout, ifp->hello_interval);
         set_timeout(&ifp->update_timeout, ifp->update_interval);
+        if(ifp->probe_interval > 0)
+            set_timeout(&ifp->probe_timeout, ifp->probe_interval);
         send_hello(ifp);
         if(rc > 0)
             send_update(ifp, 0, NULL, 0, NULL, 0);
     } else {
         flush_interface_routes(ifp, 0);
+        update_interface_metric(ifp);
         ifp->buffered = 0;
         ifp->bufsize = 0;
         free(ifp->sendbuf);
@@ -505,6 +625,47 @@ interface_up(struct interface *ifp, int up)
     return -1;
 }
 
+/* Called when the configuration of an interface has changed at runtime.
+   Unlike bringing the interface down and up again, this keeps the
+   neighbours and the routes learnt through them. */
+void
+reconfigure_interface(struct interface *ifp)
+{
+    int cost, hello_interval, update_interval, probe_interval;
+
+    if(!if_up(ifp))
+        return;
+
+    cost = ifp->cost;
+    hello_interval = ifp->hello_interval;
+    update_interval = ifp->update_interval;
+    probe_interval = ifp->probe_interval;
+
+    apply_interface_conf(ifp);
+    if(check_interface_channel(ifp) < 0)
+        fprintf(stderr,
+                "Warning: couldn't determine channel of interface %s.\n",
+                ifp->name);
+    update_interface_metric(ifp);
+
+    debugf("Reconfigured interface %s (cost=%d, channel=%d).\n",
+           ifp->name, ifp->cost, ifp->channel);
+
+    if(ifp->hello_interval != hello_interval) {
+        set_timeout(&ifp->hello_timeout, ifp->hello_interval);
+        send_hello(ifp);
+    }
+    /* Our neighbours learn our cost from IHUs. */
+    if(ifp->cost != cost)
+        send_ihu(NULL, ifp);
+    if(ifp->update_interval != update_interval)
+        set_timeout(&ifp->update_timeout, ifp->update_interval);
+    if(ifp->probe_interval > 0 && ifp->probe_interval != probe_interval)
+        set_timeout(&ifp->probe_timeout, ifp->probe_interval);
+
+    local_notify_interface(ifp, LOCAL_CHANGE);
+}
+
 int
 interface_ll_address(struct interface *ifp, const unsigned char *address)
 {
@@ -520,44 +681,73 @@ interface_ll_address(struct interface *ifp, const unsigned char *address)
     return 0;
 }
 
-void
-check_interfaces(void)
+static int
+check_interface(struct interface *ifp)
 {
-    struct interface *ifp;
     int rc, ifindex_changed = 0;
     unsigned int ifindex;
 
-    FOR_ALL_INTERFACES(ifp) {
-        ifindex = if_nametoindex(ifp->name);
-        if(ifindex != ifp->ifindex) {
-            debugf("Noticed ifindex change for %s.\n", ifp->name);
-            ifp->ifindex = 0;
-            interface_up(ifp, 0);
-            ifp->ifindex = ifindex;
-            ifindex_changed = 1;
-        }
+    ifp->flags &= ~IF_CHANGED;
 
-        if(ifp->ifindex > 0)
-            rc = kernel_interface_operational(ifp->name, ifp->ifindex);
-        else
-            rc = 0;
-        if((rc > 0) != if_up(ifp)) {
-            debugf("Noticed status change for %s.\n", ifp->name);
-            interface_up(ifp, rc > 0);
-        }
+    ifindex = if_nametoindex(ifp->name);
+    if(ifindex != ifp->ifindex) {
+        debugf("Noticed ifindex change for %s.\n", ifp->name);
+        ifp->ifindex = 0;
+        interface_up(ifp, 0);
+        ifp->ifindex = ifindex;
+        ifindex_changed = 1;
+    }
 
-        if(if_up(ifp)) {
-            /* Bother, said Pooh.  We should probably check for a change
-               in IPv4 addresses at this point. */
-            check_link_local_addresses(ifp);
-            check_interface_channel(ifp);
-            rc = check_interface_ipv4(ifp);
-            if(rc > 0) {
-                send_update(ifp, 0, NULL, 0, NULL, 0);
-            }
+    if(ifp->ifindex > 0)
+        rc = kernel_interface_operational(ifp->name, ifp->ifindex);
+    else
+        rc = 0;
+    if((rc > 0) != if_up(ifp)) {
+        debugf("Noticed status change for %s.\n", ifp->name);
+        interface_up(ifp, rc > 0);
+    }
+
+    if(if_up(ifp)) {
+        /* Bother, said Pooh.  We should probably check for a change
+           in IPv4 addresses at this point. */
+        check_link_local_addresses(ifp);
+        check_interface_channel(ifp);
+        rc = check_interface_ipv4(ifp);
+        if(rc > 0) {
+            send_update(ifp, 0, NULL, 0, NULL, 0);
         }
     }
 
+    return ifindex_changed;
+}
+
+void
+check_interfaces(void)
+{
+    struct interface *ifp;
+    int ifindex_changed = 0;
+
+    FOR_ALL_INTERFACES(ifp)
+        ifindex_changed |= check_interface(ifp);
+
+    if(ifindex_changed)
+        renumber_filters();
+}
+
+/* Like check_interfaces, but only for the interfaces that the kernel
+   told us about since they were last checked. */
+
+void
+check_changed_interfaces(void)
+{
+    struct interface *ifp;
+    int ifindex_changed = 0;
+
+    FOR_ALL_INTERFACES(ifp) {
+        if((ifp->flags & IF_CHANGED))
+            ifindex_changed |= check_interface(ifp);
+    }
+
     if(ifindex_changed)
         renumber_filters();
 }
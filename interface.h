@@ -51,6 +51,11 @@ struct interface_conf {
     unsigned int rtt_min;
     unsigned int rtt_max;
     unsigned int max_rtt_penalty;
+    char adaptive_hello;
+    unsigned hello_interval_min;
+    unsigned hello_interval_max;
+    unsigned probe_interval;
+    unsigned probe_multiplier;
     struct interface_conf *next;
 };
 
@@ -70,6 +75,10 @@ struct interface_conf {
 #define IF_FARAWAY (1 << 4)
 /* Send timestamps in Hello and IHU. */
 #define IF_TIMESTAMPS (1 << 5)
+/* The kernel notified us of a change, the interface needs checking. */
+#define IF_CHANGED (1 << 6)
+/* Adapt the hello interval to the stability of the link. */
+#define IF_ADAPTIVE_HELLO (1 << 7)
 
 /* Only INTERFERING can appear on the wire. */
 #define IF_CHANNEL_UNKNOWN 0
@@ -87,6 +96,7 @@ struct interface {
     struct timeval update_timeout;
     struct timeval flush_timeout;
     struct timeval update_flush_timeout;
+    struct timeval probe_timeout;
     char name[IF_NAMESIZE];
     unsigned char *ipv4;
     int numll;
@@ -113,6 +123,15 @@ struct interface {
     unsigned short hello_seqno;
     unsigned hello_interval;
     unsigned update_interval;
+    /* Bounds of the hello interval in adaptive mode, and the number of
+       consecutive scheduled hellos sent while the link was stable. */
+    unsigned hello_interval_min;
+    unsigned hello_interval_max;
+    int hello_stable;
+    /* Unicast hellos sent to each neighbour for fast failure detection,
+       0 if disabled, and the number of them that may be missed. */
+    unsigned probe_interval;
+    unsigned probe_multiplier;
     /* A higher value means we forget old RTT samples faster. Must be
        between 1 and 256, inclusive. */
     unsigned int rtt_decay;
@@ -137,9 +156,12 @@ if_up(struct interface *ifp)
 
 struct interface *add_interface(char *ifname, struct interface_conf *if_conf);
 int flush_interface(char *ifname);
+void adapt_hello_interval(struct interface *ifp);
 unsigned jitter(struct interface *ifp, int urgent);
 unsigned update_jitter(struct interface *ifp, int urgent);
 void set_timeout(struct timeval *timeout, int msecs);
 int interface_up(struct interface *ifp, int up);
+void reconfigure_interface(struct interface *ifp);
 int interface_ll_address(struct interface *ifp, const unsigned char *address);
 void check_interfaces(void);
+void check_changed_interfaces(void);
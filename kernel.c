@@ -33,6 +33,175 @@ THE SOFTWARE.
 #include "kernel_socket.c"
 #endif
 
+/* Number of times the kernel socket overflowed and we had to resync. */
+unsigned int kernel_socket_overflows = 0;
+
+static struct kernel_backend system_kernel_backend = {
+    "system",
+    sys_kernel_setup,
+    sys_kernel_setup_socket,
+    sys_kernel_setup_interface,
+    sys_kernel_interface_operational,
+    sys_kernel_interface_ipv4,
+    sys_kernel_interface_mtu,
+    sys_kernel_interface_wireless,
+    sys_kernel_interface_channel,
+    sys_kernel_disambiguate,
+    sys_kernel_has_ipv6_subtrees,
+    sys_kernel_route,
+    sys_kernel_route_multipath,
+    sys_kernel_dump,
+    sys_kernel_callback,
+    sys_add_rule,
+    sys_flush_rule,
+    sys_change_rule,
+    sys_kernel_batch,
+    sys_kernel_update_filter,
+};
+
+struct kernel_backend *kernel_backend = &system_kernel_backend;
+
+/* Select the kernel backend by name.  This must happen before
+   kernel_setup is called. */
+int
+kernel_use_backend(const char *name)
+{
+    if(strcmp(name, system_kernel_backend.name) == 0)
+        kernel_backend = &system_kernel_backend;
+    else if(strcmp(name, simulator_kernel_backend.name) == 0)
+        kernel_backend = &simulator_kernel_backend;
+    else
+        return -1;
+    return 1;
+}
+
+int
+kernel_setup(int setup)
+{
+    return kernel_backend->setup(setup);
+}
+
+int
+kernel_setup_socket(int setup)
+{
+    return kernel_backend->setup_socket(setup);
+}
+
+int
+kernel_setup_interface(int setup, const char *ifname, int ifindex)
+{
+    return kernel_backend->setup_interface(setup, ifname, ifindex);
+}
+
+int
+kernel_interface_operational(const char *ifname, int ifindex)
+{
+    return kernel_backend->interface_operational(ifname, ifindex);
+}
+
+int
+kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
+{
+    return kernel_backend->interface_ipv4(ifname, ifindex, addr_r);
+}
+
+int
+kernel_interface_mtu(const char *ifname, int ifindex)
+{
+    return kernel_backend->interface_mtu(ifname, ifindex);
+}
+
+int
+kernel_interface_wireless(const char *ifname, int ifindex)
+{
+    return kernel_backend->interface_wireless(ifname, ifindex);
+}
+
+int
+kernel_interface_channel(const char *ifname, int ifindex)
+{
+    return kernel_backend->interface_channel(ifname, ifindex);
+}
+
+int
+kernel_disambiguate(int v4)
+{
+    return kernel_backend->disambiguate(v4);
+}
+
+int
+kernel_has_ipv6_subtrees(void)
+{
+    return kernel_backend->has_ipv6_subtrees();
+}
+
+int
+kernel_route(int operation, int table,
+             const unsigned char *dest, unsigned short plen,
+             const unsigned char *src, unsigned short src_plen,
+             const unsigned char *gate, int ifindex, unsigned int metric,
+             const unsigned char *newgate, int newifindex,
+             unsigned int newmetric, int newtable)
+{
+    return kernel_backend->route(operation, table, dest, plen, src, src_plen,
+                                 gate, ifindex, metric,
+                                 newgate, newifindex, newmetric, newtable);
+}
+
+int
+kernel_route_multipath(int table,
+                       const unsigned char *dest, unsigned short plen,
+                       const unsigned char *src, unsigned short src_plen,
+                       const struct kernel_nexthop *nexthops, int n,
+                       unsigned int metric)
+{
+    return kernel_backend->route_multipath(table, dest, plen, src, src_plen,
+                                           nexthops, n, metric);
+}
+
+int
+kernel_dump(int operation, struct kernel_filter *filter)
+{
+    return kernel_backend->dump(operation, filter);
+}
+
+int
+kernel_callback(struct kernel_filter *filter)
+{
+    return kernel_backend->callback(filter);
+}
+
+int
+add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
+{
+    return kernel_backend->add_rule(prio, src_prefix, src_plen, table);
+}
+
+int
+flush_rule(int prio, int family)
+{
+    return kernel_backend->flush_rule(prio, family);
+}
+
+int
+change_rule(int new_prio, int old_prio,
+            const unsigned char *src, int plen, int table)
+{
+    return kernel_backend->change_rule(new_prio, old_prio, src, plen, table);
+}
+
+int
+kernel_batch(int batch)
+{
+    return kernel_backend->batch(batch);
+}
+
+int
+kernel_update_filter(void)
+{
+    return kernel_backend->update_filter();
+}
+
 /* Like gettimeofday, but returns monotonic time.  If POSIX clocks are not
    available, falls back to gettimeofday but enforces monotonicity. */
 int
@@ -36,6 +36,16 @@ struct kernel_route {
     unsigned char gw[16];
 };
 
+/* One of the nexthops of a multipath route. */
+struct kernel_nexthop {
+    unsigned char gw[16];
+    int ifindex;
+};
+
+#ifndef KERNEL_MAX_NEXTHOPS
+#define KERNEL_MAX_NEXTHOPS 16
+#endif
+
 struct kernel_addr {
     struct in6_addr addr;
     unsigned int ifindex;
@@ -78,6 +88,60 @@ struct kernel_filter {
 #endif
 
 extern int export_table, import_tables[MAX_IMPORT_TABLES], import_table_count;
+extern unsigned int kernel_socket_overflows;
+
+/* The interface to the kernel's routing tables.  The system backend is
+   either netlink or routing sockets; the simulator keeps an in-memory
+   FIB and needs no privileges. */
+
+struct kernel_backend {
+    const char *name;
+    int (*setup)(int setup);
+    int (*setup_socket)(int setup);
+    int (*setup_interface)(int setup, const char *ifname, int ifindex);
+    int (*interface_operational)(const char *ifname, int ifindex);
+    int (*interface_ipv4)(const char *ifname, int ifindex,
+                          unsigned char *addr_r);
+    int (*interface_mtu)(const char *ifname, int ifindex);
+    int (*interface_wireless)(const char *ifname, int ifindex);
+    int (*interface_channel)(const char *ifname, int ifindex);
+    int (*disambiguate)(int v4);
+    int (*has_ipv6_subtrees)(void);
+    int (*route)(int operation, int table,
+                 const unsigned char *dest, unsigned short plen,
+                 const unsigned char *src, unsigned short src_plen,
+                 const unsigned char *gate, int ifindex, unsigned int metric,
+                 const unsigned char *newgate, int newifindex,
+                 unsigned int newmetric, int newtable);
+    int (*route_multipath)(int table,
+                           const unsigned char *dest, unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           const struct kernel_nexthop *nexthops, int n,
+                           unsigned int metric);
+    int (*dump)(int operation, struct kernel_filter *filter);
+    int (*callback)(struct kernel_filter *filter);
+    int (*add_rule)(int prio, const unsigned char *src_prefix, int src_plen,
+                    int table);
+    int (*flush_rule)(int prio, int family);
+    int (*change_rule)(int new_prio, int old_prio,
+                       const unsigned char *src, int plen, int table);
+    int (*batch)(int batch);
+    int (*update_filter)(void);
+};
+
+extern struct kernel_backend *kernel_backend;
+extern struct kernel_backend simulator_kernel_backend;
+
+extern int kernel_simulator_latency, kernel_simulator_failure_rate;
+extern unsigned int kernel_simulator_operations, kernel_simulator_failures;
+
+int kernel_use_backend(const char *name);
+int kernel_simulator_route(int add, const unsigned char *prefix,
+                           unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           unsigned int metric, int ifindex, int proto);
+int kernel_simulator_routes(void);
+int kernel_simulator_nexthops(void);
 
 int add_import_table(int table);
 
@@ -97,7 +161,15 @@ int kernel_route(int operation, int table,
                  const unsigned char *gate, int ifindex, unsigned int metric,
                  const unsigned char *newgate, int newifindex,
                  unsigned int newmetric, int newtable);
+/* Replace the route to dest by one through the n nexthops, or add it. */
+int kernel_route_multipath(int table,
+                           const unsigned char *dest, unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           const struct kernel_nexthop *nexthops, int n,
+                           unsigned int metric);
 int kernel_dump(int operation, struct kernel_filter *filter);
+/* Returns a set of CHANGE_* flags for the tables that must be rescanned
+   because notifications were lost. */
 int kernel_callback(struct kernel_filter *filter);
 int if_eui64(char *ifname, int ifindex, unsigned char *eui);
 int gettime(struct timeval *tv);
@@ -109,3 +181,9 @@ int add_rule(int prio, const unsigned char *src_prefix, int src_plen,
 int flush_rule(int prio, int family);
 int change_rule(int new_prio, int old_prio, const unsigned char *src, int plen,
                 int table);
+/* Between kernel_batch(1) and kernel_batch(0), rule changes may be queued
+   and sent together; kernel_batch(0) returns -1 if any of them failed. */
+int kernel_batch(int batch);
+/* Called when the set of routes we are interested in has changed, so
+   that the backend can update its notification filter. */
+int kernel_update_filter(void);
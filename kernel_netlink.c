@@ -109,6 +109,8 @@ static int dgram_socket = -1;
 #endif
 
 static int filter_netlink(struct nlmsghdr *nh, struct kernel_filter *filter);
+static void update_link_state(struct nlmsghdr *nh);
+static void flush_link_states(void);
 
 
 /* Determine an interface's hardware address, in modified EUI-64 format */
@@ -234,11 +236,38 @@ static struct netlink nl_command = { 0, -1, {0}, 0 };
 static struct netlink nl_listen = { 0, -1, {0}, 0 };
 static int nl_setup = 0;
 
+/* Initial and maximal receive buffer sizes for netlink sockets.  The
+   listening socket's buffer is doubled every time it overflows. */
+#define NETLINK_RCVBUF (512 * 1024)
+#define NETLINK_RCVBUF_MAX (16 * 1024 * 1024)
+
+static int listen_rcvsize = NETLINK_RCVBUF;
+
+static int
+netlink_set_rcvbuf(int sock, int rcvsize)
+{
+    int rc;
+
+#ifdef SO_RCVBUFFORCE
+    rc = setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE,
+                    &rcvsize, sizeof(rcvsize));
+#else
+    rc = -1;
+#endif
+    if(rc < 0) {
+        rc = setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                        &rcvsize, sizeof(rcvsize));
+        if(rc < 0) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+    }
+    return rc;
+}
+
 static int
 netlink_socket(struct netlink *nl, uint32_t groups)
 {
     int rc;
-    int rcvsize = 512 * 1024;
 
     nl->sock = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
     if(nl->sock < 0)
@@ -259,19 +288,8 @@ netlink_socket(struct netlink *nl, uint32_t groups)
     if(rc < 0)
         goto fail;
 
-#ifdef SO_RCVBUFFORCE
-    rc = setsockopt(nl->sock, SOL_SOCKET, SO_RCVBUFFORCE,
-                    &rcvsize, sizeof(rcvsize));
-#else
-    rc = -1;
-#endif
-    if(rc < 0) {
-        rc = setsockopt(nl->sock, SOL_SOCKET, SO_RCVBUF,
-                        &rcvsize, sizeof(rcvsize));
-        if(rc < 0) {
-            perror("setsockopt(SO_RCVBUF)");
-        }
-    }
+    netlink_set_rcvbuf(nl->sock,
+                       nl == &nl_listen ? listen_rcvsize : NETLINK_RCVBUF);
 
     rc = bind(nl->sock, (struct sockaddr *)&nl->sockaddr, nl->socklen);
     if(rc < 0)
@@ -345,7 +363,13 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
         }
 
         if(len < 0) {
-            perror("netlink_read: recvmsg()");
+            /* ENOBUFS means that the kernel dropped messages; our caller
+               deals with it. */
+            if(errno != ENOBUFS) {
+                int saved_errno = errno;
+                perror("netlink_read: recvmsg()");
+                errno = saved_errno;
+            }
             return -1;
         } else if(len == 0) {
             fprintf(stderr, "netlink_read: EOF\n");
@@ -393,12 +417,12 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
                     errno = -err->error;
                     return -1;
                 }
-            } else if(nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK ) {
-                kdebugf("detected an interface change via netlink - triggering babeld interface check\n");
-                check_interfaces();
             } else if(skip) {
                 kdebugf("(skip)");
-            } if(filter) {
+            }
+            if(nl == &nl_listen)
+                update_link_state(nh);
+            if(filter) {
                 kdebugf("(msg -> \"");
                 err = filter_netlink(nh, filter);
                 kdebugf("\" %d), ", err);
@@ -423,6 +447,148 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
     return -1;
 }
 
+/* While batching, netlink_talk queues requests into nl_batch instead of
+   sending them; they are sent in a single datagram by netlink_flush. */
+
+#define NETLINK_BATCH_SIZE 8192
+
+static struct {
+    int active;
+    int len;
+    int count;
+    unsigned short first_seqno;
+    char buf[NETLINK_BATCH_SIZE];
+} nl_batch;
+
+static int netlink_flush(void);
+
+static int
+netlink_queue(struct nlmsghdr *nh)
+{
+    int rc;
+
+    if(nl_batch.len + NLMSG_ALIGN(nh->nlmsg_len) > NETLINK_BATCH_SIZE) {
+        rc = netlink_flush();
+        if(rc < 0)
+            return rc;
+    }
+
+    nh->nlmsg_flags |= NLM_F_ACK;
+    nh->nlmsg_seq = ++nl_command.seqno;
+    if(nl_batch.count == 0)
+        nl_batch.first_seqno = nl_command.seqno;
+    memcpy(nl_batch.buf + nl_batch.len, nh, nh->nlmsg_len);
+    nl_batch.len += NLMSG_ALIGN(nh->nlmsg_len);
+    nl_batch.count++;
+    return 0;
+}
+
+/* Send the queued requests, and wait for all of their acknowledgements.
+   Returns -1 with errno set to the first error if any request failed. */
+
+static int
+netlink_flush(void)
+{
+    int rc, len, acked = 0, error = 0;
+    struct sockaddr_nl nladdr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct nlmsghdr *nh;
+    char buf[8192];
+
+    if(nl_batch.count == 0)
+        return 0;
+
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &nladdr;
+    msg.msg_namelen = sizeof(nladdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    iov.iov_base = nl_batch.buf;
+    iov.iov_len = nl_batch.len;
+
+    kdebugf("Sending %d requests from seqno %d (batch)\n",
+            nl_batch.count, nl_batch.first_seqno);
+
+    rc = sendmsg(nl_command.sock, &msg, 0);
+    if(rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        rc = wait_for_fd(1, nl_command.sock, 100);
+        if(rc <= 0) {
+            if(rc == 0)
+                errno = EAGAIN;
+        } else {
+            rc = sendmsg(nl_command.sock, &msg, 0);
+        }
+    }
+
+    if(rc < nl_batch.len) {
+        int saved_errno = errno;
+        perror("sendmsg");
+        nl_batch.len = nl_batch.count = 0;
+        errno = saved_errno;
+        return -1;
+    }
+
+    iov.iov_base = buf;
+    while(acked < nl_batch.count) {
+        iov.iov_len = sizeof(buf);
+        len = recvmsg(nl_command.sock, &msg, 0);
+        if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            rc = wait_for_fd(0, nl_command.sock, 100);
+            if(rc <= 0) {
+                if(rc == 0)
+                    errno = EAGAIN;
+                break;
+            }
+            continue;
+        }
+        if(len <= 0)
+            break;
+
+        for(nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+            struct nlmsgerr *err;
+            if(nh->nlmsg_type != NLMSG_ERROR ||
+               nh->nlmsg_pid != nl_command.sockaddr.nl_pid ||
+               (unsigned short)(nh->nlmsg_seq - nl_batch.first_seqno) >=
+               nl_batch.count)
+                continue;
+            err = (struct nlmsgerr *)NLMSG_DATA(nh);
+            if(err->error != 0) {
+                kdebugf("netlink_flush: seqno %d: %s\n",
+                        nh->nlmsg_seq, strerror(-err->error));
+                if(error == 0)
+                    error = -err->error;
+            }
+            acked++;
+        }
+    }
+
+    if(acked < nl_batch.count && error == 0)
+        error = errno ? errno : EIO;
+    nl_batch.len = nl_batch.count = 0;
+    if(error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+sys_kernel_batch(int batch)
+{
+    if(batch) {
+        nl_batch.active = 1;
+        return 0;
+    }
+    nl_batch.active = 0;
+    return netlink_flush();
+}
+
 static int
 netlink_talk(struct nlmsghdr *nh)
 {
@@ -432,6 +598,9 @@ netlink_talk(struct nlmsghdr *nh)
     struct msghdr msg;
     struct iovec iov;
 
+    if(nl_batch.active)
+        return netlink_queue(nh);
+
     memset(&nladdr, 0, sizeof(nladdr));
     nladdr.nl_family = AF_NETLINK;
     nladdr.nl_pid = 0;
@@ -532,8 +701,8 @@ netlink_send_dump(int type, void *data, int len) {
 }
 
 
-int
-kernel_setup(int setup)
+static int
+sys_kernel_setup(int setup)
 {
     struct sysctl_setting *s;
     int i, rc;
@@ -607,42 +776,115 @@ rtnlgrp_to_mask(unsigned int grp)
     return grp ? 1 << (grp - 1) : 0;
 }
 
-#define array_size(ar) (sizeof(ar) / sizeof(ar[0]))
-/* Filter out messages from self that occur on listener socket,
-   caused by our actions on the command socket
- */
+#define MAX_FILTER_PROTOS 16
+
+/* Helpers for building BPF programs.  Jump targets are absolute
+   instruction numbers, -1 means fall through. */
 
-static void netlink_install_filter (int sock, __u32 pid)
+static int
+bpf_stmt(struct sock_filter *filter, int n, __u16 code, __u32 k)
 {
-  struct sock_filter filter[] = {
-    /* 0: ldh [4]                 */
-    BPF_STMT(BPF_LD|BPF_ABS|BPF_H, offsetof(struct nlmsghdr, nlmsg_type)),
-    /* 1: jeq 0x18 jt 3 jf 6  */
-    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_NEWROUTE), 1, 0),
-    /* 2: jeq 0x19 jt 3 jf 6  */
-    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_DELROUTE), 0, 3),
-    /* 3: ldw [12]                */
-    BPF_STMT(BPF_LD|BPF_ABS|BPF_W, offsetof(struct nlmsghdr, nlmsg_pid)),
-    /* 4: jeq XX  jt 5 jf 6   */
-    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, htonl(pid), 0, 1),
-    /* 5: ret 0    (skip)     */
-    BPF_STMT(BPF_RET|BPF_K, 0),
-    /* 6: ret 0xffff (keep)   */
-    BPF_STMT(BPF_RET|BPF_K, 0xffff),
-  };
-
-  struct sock_fprog prog = {
-    .len = array_size(filter),
-    .filter = filter,
-  };
-
-  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
-      fprintf(stderr,"Can't install socket filter for some reason - will see messages from self: %s\n",
-	      strerror(errno));
+    struct sock_filter insn = BPF_STMT(code, k);
+    filter[n] = insn;
+    return n + 1;
 }
 
-int
-kernel_setup_socket(int setup)
+static int
+bpf_jump(struct sock_filter *filter, int n, __u16 code, __u32 k,
+         int jt, int jf)
+{
+    struct sock_filter insn =
+        BPF_JUMP(code, k, jt < 0 ? 0 : jt - n - 1, jf < 0 ? 0 : jf - n - 1);
+    filter[n] = insn;
+    return n + 1;
+}
+
+/* Build and attach a classic BPF program to the listening socket.  Route
+   messages caused by our actions on the command socket are dropped, as
+   are our own routes, cached routes, and routes that live in a table we
+   don't import or carry a protocol that no redistribute filter can match.
+   This saves us a wakeup for every uninteresting route change.  Tables
+   above 255 are only known from RTA_TABLE, so RT_TABLE_COMPAT is passed
+   through and left to parse_kernel_route_rta. */
+
+static void
+netlink_install_filter(int sock, __u32 pid)
+{
+    struct sock_filter filter[14 + MAX_FILTER_PROTOS + MAX_IMPORT_TABLES];
+    struct sock_fprog prog;
+    int protos[MAX_FILTER_PROTOS], tables[MAX_IMPORT_TABLES + 1];
+    int nprotos, ntables = 0, boot, compat = 0;
+    int i, n, table, accept, drop;
+
+    nprotos = redistribute_protocols(protos, MAX_FILTER_PROTOS, &boot);
+
+    for(i = 0; i < import_table_count; i++) {
+        if(import_tables[i] > 255 || import_tables[i] == RT_TABLE_COMPAT)
+            compat = 1;
+        else
+            tables[ntables++] = import_tables[i];
+    }
+    if(compat)
+        tables[ntables++] = RT_TABLE_COMPAT;
+
+    /* 10 fixed instructions, the protocol checks, then the table checks
+       followed by accept and drop. */
+    if(nprotos < 0)
+        table = 10 + !boot;
+    else
+        table = 10 + MAX(nprotos, 1);
+    accept = table + 1 + ntables;
+    drop = accept + 1;
+
+    n = bpf_stmt(filter, 0, BPF_LD|BPF_ABS|BPF_H,
+                 offsetof(struct nlmsghdr, nlmsg_type));
+    n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_NEWROUTE), 4, -1);
+    n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, htons(RTM_DELROUTE), 4, -1);
+    n = bpf_stmt(filter, n, BPF_RET|BPF_K, 0xffff);
+    n = bpf_stmt(filter, n, BPF_LD|BPF_ABS|BPF_W,
+                 offsetof(struct nlmsghdr, nlmsg_pid));
+    n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, htonl(pid), drop, -1);
+    n = bpf_stmt(filter, n, BPF_LD|BPF_ABS|BPF_W,
+                 NLMSG_HDRLEN + offsetof(struct rtmsg, rtm_flags));
+    n = bpf_jump(filter, n, BPF_JMP|BPF_JSET|BPF_K, htonl(RTM_F_CLONED),
+                 drop, -1);
+    n = bpf_stmt(filter, n, BPF_LD|BPF_ABS|BPF_B,
+                 NLMSG_HDRLEN + offsetof(struct rtmsg, rtm_protocol));
+    n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, RTPROT_BABEL, drop, -1);
+
+    if(nprotos < 0) {
+        if(!boot)
+            n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, RTPROT_BOOT,
+                         drop, -1);
+    } else if(nprotos == 0) {
+        /* Only local addresses are redistributed. */
+        n = bpf_stmt(filter, n, BPF_RET|BPF_K, 0);
+    } else {
+        for(i = 0; i < nprotos; i++)
+            n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, protos[i],
+                         table, i == nprotos - 1 ? drop : -1);
+    }
+
+    n = bpf_stmt(filter, n, BPF_LD|BPF_ABS|BPF_B,
+                 NLMSG_HDRLEN + offsetof(struct rtmsg, rtm_table));
+    for(i = 0; i < ntables; i++)
+        n = bpf_jump(filter, n, BPF_JMP|BPF_JEQ|BPF_K, tables[i],
+                     accept, i == ntables - 1 ? drop : -1);
+    n = bpf_stmt(filter, n, BPF_RET|BPF_K, 0xffff);
+    n = bpf_stmt(filter, n, BPF_RET|BPF_K, 0);
+
+    prog.len = n;
+    prog.filter = filter;
+
+    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+        fprintf(stderr,
+                "Can't install socket filter for some reason - "
+                "will see messages from self: %s\n",
+                strerror(errno));
+}
+
+static int
+sys_kernel_setup_socket(int setup)
 {
     int rc;
 
@@ -663,6 +905,7 @@ kernel_setup_socket(int setup)
             return -1;
         }
 
+        flush_link_states();
 	netlink_install_filter(nl_listen.sock,getpid());
         kernel_socket = nl_listen.sock;
 
@@ -673,12 +916,25 @@ kernel_setup_socket(int setup)
         close(nl_listen.sock);
         nl_listen.sock = -1;
         kernel_socket = -1;
+        flush_link_states();
 
         return 1;
 
     }
 }
 
+/* The filter depends on the redistribute filters and import tables,
+   which may change when the configuration is reloaded.  Attaching a new
+   program atomically replaces the old one. */
+static int
+sys_kernel_update_filter(void)
+{
+    if(nl_listen.sock < 0)
+        return 0;
+    netlink_install_filter(nl_listen.sock, getpid());
+    return 1;
+}
+
 static int
 get_old_if(const char *ifname)
 {
@@ -695,8 +951,8 @@ get_old_if(const char *ifname)
     return num_old_if++;
 }
 
-int
-kernel_setup_interface(int setup, const char *ifname, int ifindex)
+static int
+sys_kernel_setup_interface(int setup, const char *ifname, int ifindex)
 {
     char buf[100];
     int i, rc;
@@ -734,50 +990,208 @@ kernel_setup_interface(int setup, const char *ifname, int ifindex)
     return 1;
 }
 
-int
-kernel_interface_operational(const char *ifname, int ifindex)
+/* Per-interface kernel state, kept up to date from the notifications
+   received on the listening socket so that periodic interface checks
+   don't need to query the kernel.  Link flags and MTU are carried by
+   RTM_NEWLINK; an address change only invalidates the cached IPv4
+   address, which is then fetched again on the next check.  The cache is
+   only used while the listening socket is open, and is flushed whenever
+   we may have missed notifications. */
+
+struct link_state {
+    unsigned int ifindex;
+    int have_flags;
+    unsigned int flags;
+    int mtu;                    /* -1 if unknown */
+    int ipv4_state;             /* 1 = known, 0 = no address, -1 unknown */
+    unsigned char ipv4[4];
+    int wireless;               /* -2 if unknown */
+};
+
+static struct link_state *link_states = NULL;
+static int num_link_states = 0, max_link_states = 0;
+
+static struct link_state *
+find_link_state(int ifindex, int create)
+{
+    int i;
+
+    if(ifindex <= 0 || nl_listen.sock < 0)
+        return NULL;
+
+    for(i = 0; i < num_link_states; i++)
+        if(link_states[i].ifindex == ifindex)
+            return &link_states[i];
+
+    if(!create)
+        return NULL;
+
+    if(num_link_states >= max_link_states) {
+        struct link_state *new_states;
+        int n = max_link_states < 1 ? 8 : 2 * max_link_states;
+        new_states = realloc(link_states, n * sizeof(struct link_state));
+        if(new_states == NULL)
+            return NULL;
+        link_states = new_states;
+        max_link_states = n;
+    }
+
+    memset(&link_states[num_link_states], 0, sizeof(struct link_state));
+    link_states[num_link_states].ifindex = ifindex;
+    link_states[num_link_states].mtu = -1;
+    link_states[num_link_states].ipv4_state = -1;
+    link_states[num_link_states].wireless = -2;
+    return &link_states[num_link_states++];
+}
+
+static void
+flush_link_state(int ifindex)
+{
+    int i;
+
+    for(i = 0; i < num_link_states; i++) {
+        if(link_states[i].ifindex == ifindex) {
+            if(i < num_link_states - 1)
+                link_states[i] = link_states[num_link_states - 1];
+            num_link_states--;
+            return;
+        }
+    }
+}
+
+static void
+flush_link_states(void)
+{
+    num_link_states = 0;
+}
+
+static void
+update_link_state(struct nlmsghdr *nh)
+{
+    struct link_state *ls;
+    int len;
+
+    switch(nh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK: {
+        struct ifinfomsg *info = (struct ifinfomsg*)NLMSG_DATA(nh);
+        struct rtattr *rta;
+
+        if(nh->nlmsg_type == RTM_DELLINK) {
+            flush_link_state(info->ifi_index);
+            return;
+        }
+        ls = find_link_state(info->ifi_index, 1);
+        if(ls == NULL)
+            return;
+        ls->flags = info->ifi_flags;
+        ls->have_flags = 1;
+        len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*info));
+        for(rta = IFLA_RTA(info); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+            if(rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) >= 4)
+                ls->mtu = *(unsigned int*)RTA_DATA(rta);
+        break;
+    }
+    case RTM_NEWADDR:
+    case RTM_DELADDR: {
+        struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(nh);
+        if(ifa->ifa_family != AF_INET)
+            return;
+        ls = find_link_state(ifa->ifa_index, 0);
+        if(ls)
+            ls->ipv4_state = -1;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static int
+sys_kernel_interface_operational(const char *ifname, int ifindex)
 {
     struct ifreq req;
+    struct link_state *ls;
     int rc;
     int flags = link_detect ? (IFF_UP | IFF_RUNNING) : IFF_UP;
 
+    ls = find_link_state(ifindex, 0);
+    if(ls && ls->have_flags)
+        return ((ls->flags & flags) == flags);
+
     memset(&req, 0, sizeof(req));
     strncpy(req.ifr_name, ifname, sizeof(req.ifr_name));
     rc = ioctl(dgram_socket, SIOCGIFFLAGS, &req);
     if(rc < 0)
         return -1;
+
+    ls = find_link_state(ifindex, 1);
+    if(ls) {
+        ls->flags = (unsigned short)req.ifr_flags;
+        ls->have_flags = 1;
+    }
     return ((req.ifr_flags & flags) == flags);
 }
 
-int
-kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
+static int
+sys_kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
 {
     struct ifreq req;
+    struct link_state *ls;
     int rc;
 
+    ls = find_link_state(ifindex, 0);
+    if(ls && ls->ipv4_state == 1) {
+        memcpy(addr_r, ls->ipv4, 4);
+        return 1;
+    } else if(ls && ls->ipv4_state == 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+
     memset(&req, 0, sizeof(req));
     strncpy(req.ifr_name, ifname, sizeof(req.ifr_name));
     req.ifr_addr.sa_family = AF_INET;
     rc = ioctl(dgram_socket, SIOCGIFADDR, &req);
-    if(rc < 0)
+    if(rc < 0) {
+        if(errno == EADDRNOTAVAIL) {
+            ls = find_link_state(ifindex, 1);
+            if(ls)
+                ls->ipv4_state = 0;
+            errno = EADDRNOTAVAIL;
+        }
         return -1;
+    }
 
     memcpy(addr_r, &((struct sockaddr_in*)&req.ifr_addr)->sin_addr, 4);
+    ls = find_link_state(ifindex, 1);
+    if(ls) {
+        memcpy(ls->ipv4, addr_r, 4);
+        ls->ipv4_state = 1;
+    }
     return 1;
 }
 
-int
-kernel_interface_mtu(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_mtu(const char *ifname, int ifindex)
 {
     struct ifreq req;
+    struct link_state *ls;
     int rc;
 
+    ls = find_link_state(ifindex, 0);
+    if(ls && ls->mtu >= 0)
+        return ls->mtu;
+
     memset(&req, 0, sizeof(req));
     strncpy(req.ifr_name, ifname, sizeof(req.ifr_name));
     rc = ioctl(dgram_socket, SIOCGIFMTU, &req);
     if(rc < 0)
         return -1;
 
+    ls = find_link_state(ifindex, 1);
+    if(ls)
+        ls->mtu = req.ifr_mtu;
     return req.ifr_mtu;
 }
 
@@ -845,17 +1259,24 @@ isbatman(const char *ifname, int ifindex)
     return 0;
 }
 
-int
-kernel_interface_wireless(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_wireless(const char *ifname, int ifindex)
 {
 #ifndef SIOCGIWNAME
 #define SIOCGIWNAME 0x8B01
 #endif
     struct ifreq req;
+    struct link_state *ls;
     int rc;
 
-    if(isbridge(ifname, ifindex) != 0 || isbatman(ifname, ifindex) != 0)
-        return -1;
+    ls = find_link_state(ifindex, 0);
+    if(ls && ls->wireless > -2)
+        return ls->wireless;
+
+    if(isbridge(ifname, ifindex) != 0 || isbatman(ifname, ifindex) != 0) {
+        rc = -1;
+        goto done;
+    }
 
     memset(&req, 0, sizeof(req));
     strncpy(req.ifr_name, ifname, sizeof(req.ifr_name));
@@ -865,11 +1286,16 @@ kernel_interface_wireless(const char *ifname, int ifindex)
             rc = 0;
         else {
             perror("ioctl(SIOCGIWNAME)");
-            rc = -1;
+            return -1;
         }
     } else {
         rc = 1;
     }
+
+ done:
+    ls = find_link_state(ifindex, 1);
+    if(ls)
+        ls->wireless = rc;
     return rc;
 }
 
@@ -932,12 +1358,20 @@ freq_to_chan(struct iw_freq *freq)
     return -1;
 }
 
-int
-kernel_interface_channel(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_channel(const char *ifname, int ifindex)
 {
     struct iwreq_subset iwreq;
+    struct link_state *ls;
     int rc;
 
+    /* Don't bother asking for the frequency of a wired interface. */
+    ls = find_link_state(ifindex, 0);
+    if(ls && ls->wireless == 0) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
     memset(&iwreq, 0, sizeof(iwreq));
     strncpy(iwreq.ifr_ifrn.ifrn_name, ifname, IFNAMSIZ);
 
@@ -950,14 +1384,14 @@ kernel_interface_channel(const char *ifname, int ifindex)
 
 /* Return true if we cannot handle disambiguation ourselves. */
 
-int
-kernel_disambiguate(int v4)
+static int
+sys_kernel_disambiguate(int v4)
 {
     return !v4 && has_ipv6_subtrees;
 }
 
-int
-kernel_has_ipv6_subtrees(void)
+static int
+sys_kernel_has_ipv6_subtrees(void)
 {
     return (kernel_older_than("Linux", 3, 11) == 0);
 }
@@ -968,13 +1402,13 @@ kernel_has_ipv6_subtrees(void)
 static int ipv4_metric = 0;
 static int ipv6_metric = 1024;
 
-int
-kernel_route(int operation, int table,
-             const unsigned char *dest, unsigned short plen,
-             const unsigned char *src, unsigned short src_plen,
-             const unsigned char *gate, int ifindex, unsigned int metric,
-             const unsigned char *newgate, int newifindex,
-             unsigned int newmetric, int newtable)
+static int
+sys_kernel_route(int operation, int table,
+                 const unsigned char *dest, unsigned short plen,
+                 const unsigned char *src, unsigned short src_plen,
+                 const unsigned char *gate, int ifindex, unsigned int metric,
+                 const unsigned char *newgate, int newifindex,
+                 unsigned int newmetric, int newtable)
 {
     union { char raw[1024]; struct nlmsghdr nh; } buf;
     struct rtmsg *rtm;
@@ -1024,14 +1458,14 @@ kernel_route(int operation, int table,
            silently fail the request, causing "stuck" routes.  Let's
            stick with the naive approach, and hope that the window is
            small enough to be negligible. */
-        kernel_route(ROUTE_FLUSH, table, dest, plen,
-                     src, src_plen,
-                     gate, ifindex, metric,
-                     NULL, 0, 0, 0);
-        rc = kernel_route(ROUTE_ADD, newtable, dest, plen,
-                          src, src_plen,
-                          newgate, newifindex, newmetric,
-                          NULL, 0, 0, 0);
+        sys_kernel_route(ROUTE_FLUSH, table, dest, plen,
+                         src, src_plen,
+                         gate, ifindex, metric,
+                         NULL, 0, 0, 0);
+        rc = sys_kernel_route(ROUTE_ADD, newtable, dest, plen,
+                              src, src_plen,
+                              newgate, newifindex, newmetric,
+                              NULL, 0, 0, 0);
         if(rc < 0) {
             if(errno == EEXIST)
                 rc = 1;
@@ -1043,7 +1477,7 @@ kernel_route(int operation, int table,
 
 
     ipv4 = v4mapped(gate);
-    use_src = (!is_default(src, src_plen) && kernel_disambiguate(ipv4));
+    use_src = (!is_default(src, src_plen) && sys_kernel_disambiguate(ipv4));
 
     kdebugf("kernel_route: %s %s from %s "
             "table %d metric %d dev %d nexthop %s\n",
@@ -1131,6 +1565,118 @@ kernel_route(int operation, int table,
     return netlink_talk(&buf.nh);
 }
 
+static int
+sys_kernel_route_multipath(int table,
+                           const unsigned char *dest, unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           const struct kernel_nexthop *nexthops, int n,
+                           unsigned int metric)
+{
+    union { char raw[1024]; struct nlmsghdr nh; } buf;
+    struct rtmsg *rtm;
+    struct rtattr *rta;
+    int len = sizeof(buf.raw);
+    int i, rc, ipv4, alen;
+
+    if(!nl_setup) {
+        fprintf(stderr,"kernel_route: netlink not initialized.\n");
+        errno = EIO;
+        return -1;
+    }
+
+    if(nl_command.sock < 0) {
+        rc = netlink_socket(&nl_command, 0);
+        if(rc < 0) {
+            int olderrno = errno;
+            perror("kernel_route: netlink_socket()");
+            errno = olderrno;
+            return -1;
+        }
+    }
+
+    ipv4 = plen >= 96 && v4mapped(dest);
+    alen = ipv4 ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+    /* Source-specific multipath routes are not supported. */
+    if(n < 1 || n > KERNEL_MAX_NEXTHOPS || metric >= KERNEL_INFINITY ||
+       !is_default(src, src_plen)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        if(v4mapped(nexthops[i].gw) != ipv4) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    kdebugf("kernel_route: multipath %s table %d metric %d, %d nexthops\n",
+            format_prefix(dest, plen), table, metric, n);
+
+    memset(buf.raw, 0, sizeof(buf.raw));
+    buf.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+    buf.nh.nlmsg_type = RTM_NEWROUTE;
+
+    rtm = NLMSG_DATA(&buf.nh);
+    rtm->rtm_family = ipv4 ? AF_INET : AF_INET6;
+    rtm->rtm_dst_len = ipv4 ? plen - 96 : plen;
+    rtm->rtm_table = table;
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type = RTN_UNICAST;
+    rtm->rtm_protocol = RTPROT_BABEL;
+    if(n == 1)
+        rtm->rtm_flags |= RTNH_F_ONLINK;
+
+    rta = RTM_RTA(rtm);
+
+    rta = RTA_NEXT(rta, len);
+    rta->rta_len = RTA_LENGTH(alen);
+    rta->rta_type = RTA_DST;
+    memcpy(RTA_DATA(rta), ipv4 ? dest + 12 : dest, alen);
+
+    rta = RTA_NEXT(rta, len);
+    rta->rta_len = RTA_LENGTH(sizeof(int));
+    rta->rta_type = RTA_PRIORITY;
+    *(int*)RTA_DATA(rta) = ipv4 ? ipv4_metric : ipv6_metric;
+
+    if(n == 1) {
+        rta = RTA_NEXT(rta, len);
+        rta->rta_len = RTA_LENGTH(sizeof(int));
+        rta->rta_type = RTA_OIF;
+        *(int*)RTA_DATA(rta) = nexthops[0].ifindex;
+
+        rta = RTA_NEXT(rta, len);
+        rta->rta_len = RTA_LENGTH(alen);
+        rta->rta_type = RTA_GATEWAY;
+        memcpy(RTA_DATA(rta), ipv4 ? nexthops[0].gw + 12 : nexthops[0].gw,
+               alen);
+    } else {
+        struct rtnexthop *rtnh;
+        struct rtattr *gw;
+
+        rta = RTA_NEXT(rta, len);
+        rta->rta_type = RTA_MULTIPATH;
+        rta->rta_len = RTA_LENGTH(0);
+        rtnh = RTA_DATA(rta);
+        for(i = 0; i < n; i++) {
+            memset(rtnh, 0, sizeof(*rtnh));
+            rtnh->rtnh_len = RTNH_LENGTH(RTA_LENGTH(alen));
+            rtnh->rtnh_flags = RTNH_F_ONLINK;
+            rtnh->rtnh_ifindex = nexthops[i].ifindex;
+            gw = RTNH_DATA(rtnh);
+            gw->rta_len = RTA_LENGTH(alen);
+            gw->rta_type = RTA_GATEWAY;
+            memcpy(RTA_DATA(gw),
+                   ipv4 ? nexthops[i].gw + 12 : nexthops[i].gw, alen);
+            rta->rta_len += rtnh->rtnh_len;
+            rtnh = RTNH_NEXT(rtnh);
+        }
+    }
+    buf.nh.nlmsg_len = (char*)rta + rta->rta_len - buf.raw;
+
+    return netlink_talk(&buf.nh);
+}
+
 static int
 parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
 {
@@ -1270,8 +1816,8 @@ filter_kernel_routes(struct nlmsghdr *nh, struct kernel_route *route)
 }
 
 /* This function should not return routes installed by us. */
-int
-kernel_dump(int operation, struct kernel_filter *filter)
+static int
+sys_kernel_dump(int operation, struct kernel_filter *filter)
 {
     int i, rc;
     int families[2] = { AF_INET6, AF_INET };
@@ -1557,24 +2103,40 @@ filter_netlink(struct nlmsghdr *nh, struct kernel_filter *filter)
     return 0;
 }
 
-int
-kernel_callback(struct kernel_filter *filter)
+static int
+sys_kernel_callback(struct kernel_filter *filter)
 {
     int rc;
 
     kdebugf("\nReceived changes in kernel tables.\n");
 
     if(nl_listen.sock < 0) {
-        rc = kernel_setup_socket(1);
+        rc = sys_kernel_setup_socket(1);
         if(rc < 0) {
-            perror("kernel_callback: kernel_setup_socket(1)");
+            perror("kernel_callback: sys_kernel_setup_socket(1)");
             return -1;
         }
     }
     rc = netlink_read(&nl_listen, &nl_command, 0, filter);
 
+    if(rc < 0 && errno == ENOBUFS) {
+        /* The listening socket overflowed, and we have lost an unknown
+           number of notifications.  Grow the receive buffer, and ask our
+           caller to resynchronise with the kernel. */
+        kernel_socket_overflows++;
+        flush_link_states();
+        if(listen_rcvsize < NETLINK_RCVBUF_MAX) {
+            listen_rcvsize = MIN(2 * listen_rcvsize, NETLINK_RCVBUF_MAX);
+            netlink_set_rcvbuf(nl_listen.sock, listen_rcvsize);
+        }
+        fprintf(stderr,
+                "Netlink socket overflow, resynchronising "
+                "(receive buffer now %d bytes).\n", listen_rcvsize);
+        return CHANGE_LINK | CHANGE_ADDR | CHANGE_ROUTE | CHANGE_RULE;
+    }
+
     if(rc < 0 && nl_listen.sock < 0)
-        kernel_setup_socket(1);
+        sys_kernel_setup_socket(1);
 
     return 0;
 }
@@ -1582,8 +2144,8 @@ kernel_callback(struct kernel_filter *filter)
 
 /* Routing table's rules */
 
-int
-add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
+static int
+sys_add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
     char buffer[64] = {0}; /* 56 needed */
     struct nlmsghdr *message_header = (void*)buffer;
@@ -1654,8 +2216,8 @@ add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
     return netlink_talk(message_header);
 }
 
-int
-flush_rule(int prio, int family)
+static int
+sys_flush_rule(int prio, int family)
 {
     char buffer[64] = {0}; /* 36 needed */
     struct nlmsghdr *message_header = (void*)buffer;
@@ -1707,15 +2269,15 @@ flush_rule(int prio, int family)
     return netlink_talk(message_header);
 }
 
-int
-change_rule(int new_prio, int old_prio,
-            const unsigned char *src, int plen, int table)
+static int
+sys_change_rule(int new_prio, int old_prio,
+                const unsigned char *src, int plen, int table)
 {
     int rc;
     kdebugf("/Swap: ");
-    rc = add_rule(new_prio, src, plen, table);
+    rc = sys_add_rule(new_prio, src, plen, table);
     if(rc < 0)
         return rc;
     kdebugf("\\Swap: ");
-    return flush_rule(old_prio, v4mapped(src) ? AF_INET : AF_INET6);
+    return sys_flush_rule(old_prio, v4mapped(src) ? AF_INET : AF_INET6);
 }
@@ -0,0 +1,678 @@
+/*
+Copyright (c) 2026 by the babeld authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* A simulated kernel.  Routes and rules are kept in memory, interfaces
+   and addresses are those of the host, read without privileges.  Route
+   operations can be made slow or unreliable, and routes installed by
+   third parties can be injected with the simulated-route directive,
+   which causes a synthetic notification to be delivered through the
+   kernel socket.  Like on Linux, no notifications are generated for our
+   own routes. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+
+#include "babeld.h"
+#include "kernel.h"
+#include "util.h"
+
+struct sim_route {
+    struct kernel_route route;
+    int table;
+    int nexthops;               /* route.gw is the first one */
+};
+
+struct sim_rule {
+    int priority;
+    int table;
+    unsigned char src[16];
+    unsigned char src_plen;
+};
+
+/* In microseconds. */
+int kernel_simulator_latency = 0;
+/* In percent. */
+int kernel_simulator_failure_rate = 0;
+
+unsigned int kernel_simulator_operations = 0;
+unsigned int kernel_simulator_failures = 0;
+
+static struct sim_route *sim_routes = NULL;
+static int num_sim_routes = 0, max_sim_routes = 0;
+
+static struct sim_rule *sim_rules = NULL;
+static int num_sim_rules = 0, max_sim_rules = 0;
+
+/* Notifications not yet delivered, and the pipe used to wake up the
+   main loop. */
+static struct kernel_route *sim_notifications = NULL;
+static int num_sim_notifications = 0, max_sim_notifications = 0;
+static int sim_pipe[2] = {-1, -1};
+
+/* Same as RT_TABLE_MAIN. */
+#define SIM_TABLE_MAIN 254
+
+static int
+sim_setup(int setup)
+{
+    if(setup) {
+        if(export_table < 0)
+            export_table = SIM_TABLE_MAIN;
+        if(import_table_count < 1)
+            import_tables[import_table_count++] = SIM_TABLE_MAIN;
+    }
+    return 1;
+}
+
+static int
+sim_setup_socket(int setup)
+{
+    int rc;
+
+    if(setup) {
+        if(sim_pipe[0] < 0) {
+            rc = pipe(sim_pipe);
+            if(rc < 0)
+                return -1;
+            rc = fcntl(sim_pipe[0], F_GETFL, 0);
+            if(rc >= 0)
+                rc = fcntl(sim_pipe[0], F_SETFL, rc | O_NONBLOCK);
+            if(rc >= 0)
+                rc = fcntl(sim_pipe[1], F_GETFL, 0);
+            if(rc >= 0)
+                rc = fcntl(sim_pipe[1], F_SETFL, rc | O_NONBLOCK);
+            if(rc < 0) {
+                int saved_errno = errno;
+                close(sim_pipe[0]);
+                close(sim_pipe[1]);
+                sim_pipe[0] = sim_pipe[1] = -1;
+                errno = saved_errno;
+                return -1;
+            }
+        }
+        kernel_socket = sim_pipe[0];
+        /* Pending notifications need a wakeup on the new descriptor. */
+        if(num_sim_notifications > 0)
+            write(sim_pipe[1], "", 1);
+        return 1;
+    } else {
+        if(sim_pipe[0] >= 0) {
+            close(sim_pipe[0]);
+            close(sim_pipe[1]);
+            sim_pipe[0] = sim_pipe[1] = -1;
+        }
+        kernel_socket = -1;
+        return 1;
+    }
+}
+
+static int
+sim_setup_interface(int setup, const char *ifname, int ifindex)
+{
+    return 1;
+}
+
+/* Look up an interface of the host.  If addr_r is not NULL, also look
+   for its first IPv4 address. */
+static int
+sim_find_interface(const char *ifname, unsigned int *flags_r,
+                   unsigned char *addr_r)
+{
+    struct ifaddrs *ifa, *ifap;
+    int found = 0;
+    int rc;
+
+    rc = getifaddrs(&ifa);
+    if(rc < 0)
+        return -1;
+
+    for(ifap = ifa; ifap != NULL; ifap = ifap->ifa_next) {
+        if(strcmp(ifap->ifa_name, ifname) != 0)
+            continue;
+        if(!found) {
+            if(flags_r)
+                *flags_r = ifap->ifa_flags;
+            found = 1;
+            if(addr_r == NULL)
+                break;
+        }
+        if(addr_r && ifap->ifa_addr &&
+           ifap->ifa_addr->sa_family == AF_INET) {
+            memcpy(addr_r, &((struct sockaddr_in*)ifap->ifa_addr)->sin_addr,
+                   4);
+            found = 2;
+            break;
+        }
+    }
+
+    freeifaddrs(ifa);
+    return found;
+}
+
+static int
+sim_interface_operational(const char *ifname, int ifindex)
+{
+    unsigned int flags = 0;
+    unsigned int want = link_detect ? (IFF_UP | IFF_RUNNING) : IFF_UP;
+    int rc;
+
+    rc = sim_find_interface(ifname, &flags, NULL);
+    if(rc <= 0)
+        return rc;
+    return (flags & want) == want;
+}
+
+static int
+sim_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
+{
+    int rc;
+
+    rc = sim_find_interface(ifname, NULL, addr_r);
+    if(rc < 2) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    return 1;
+}
+
+static int
+sim_interface_mtu(const char *ifname, int ifindex)
+{
+    return 1500;
+}
+
+static int
+sim_interface_wireless(const char *ifname, int ifindex)
+{
+    return 0;
+}
+
+static int
+sim_interface_channel(const char *ifname, int ifindex)
+{
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+static int
+sim_disambiguate(int v4)
+{
+    return !v4 && has_ipv6_subtrees;
+}
+
+static int
+sim_has_ipv6_subtrees(void)
+{
+    return 1;
+}
+
+static int
+sim_notify(const struct kernel_route *route)
+{
+    if(num_sim_notifications >= max_sim_notifications) {
+        struct kernel_route *new_notifications;
+        int n = max_sim_notifications < 1 ? 16 : 2 * max_sim_notifications;
+        new_notifications = realloc(sim_notifications,
+                                    n * sizeof(struct kernel_route));
+        if(new_notifications == NULL)
+            return -1;
+        sim_notifications = new_notifications;
+        max_sim_notifications = n;
+    }
+    sim_notifications[num_sim_notifications++] = *route;
+    if(sim_pipe[1] >= 0)
+        write(sim_pipe[1], "", 1);
+    return 1;
+}
+
+static int
+sim_find_route(int table, const unsigned char *dest, unsigned short plen,
+               const unsigned char *src, unsigned short src_plen,
+               unsigned int metric)
+{
+    int i;
+    for(i = 0; i < num_sim_routes; i++) {
+        struct sim_route *r = &sim_routes[i];
+        if(r->table == table && r->route.plen == plen &&
+           r->route.src_plen == src_plen && r->route.metric == metric &&
+           memcmp(r->route.prefix, dest, 16) == 0 &&
+           memcmp(r->route.src_prefix, src, 16) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+sim_add_route(int table, const unsigned char *dest, unsigned short plen,
+              const unsigned char *src, unsigned short src_plen,
+              const unsigned char *gate, int ifindex, unsigned int metric,
+              int proto)
+{
+    struct sim_route *r;
+
+    if(sim_find_route(table, dest, plen, src, src_plen, metric) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if(num_sim_routes >= max_sim_routes) {
+        struct sim_route *new_routes;
+        int n = max_sim_routes < 1 ? 16 : 2 * max_sim_routes;
+        new_routes = realloc(sim_routes, n * sizeof(struct sim_route));
+        if(new_routes == NULL)
+            return -1;
+        sim_routes = new_routes;
+        max_sim_routes = n;
+    }
+
+    r = &sim_routes[num_sim_routes++];
+    memset(r, 0, sizeof(*r));
+    memcpy(r->route.prefix, dest, 16);
+    r->route.plen = plen;
+    memcpy(r->route.src_prefix, src, 16);
+    r->route.src_plen = src_plen;
+    r->route.metric = metric;
+    r->route.ifindex = ifindex;
+    r->route.proto = proto;
+    if(gate)
+        memcpy(r->route.gw, gate, 16);
+    r->table = table;
+    r->nexthops = 1;
+
+    if(proto != RTPROT_BABEL)
+        sim_notify(&r->route);
+    return 1;
+}
+
+static int
+sim_flush_route(int table, const unsigned char *dest, unsigned short plen,
+                const unsigned char *src, unsigned short src_plen,
+                unsigned int metric)
+{
+    struct kernel_route route;
+    int i;
+
+    i = sim_find_route(table, dest, plen, src, src_plen, metric);
+    if(i < 0) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    route = sim_routes[i].route;
+    if(i < num_sim_routes - 1)
+        sim_routes[i] = sim_routes[num_sim_routes - 1];
+    num_sim_routes--;
+
+    if(route.proto != RTPROT_BABEL)
+        sim_notify(&route);
+    return 1;
+}
+
+/* Same as the netlink backend, which ignores such routes. */
+static int
+sim_ignored(const unsigned char *dest, unsigned short plen,
+            unsigned int metric)
+{
+    return metric >= KERNEL_INFINITY &&
+        (plen == 0 || (v4mapped(dest) && plen == 96));
+}
+
+static int
+sim_route(int operation, int table,
+          const unsigned char *dest, unsigned short plen,
+          const unsigned char *src, unsigned short src_plen,
+          const unsigned char *gate, int ifindex, unsigned int metric,
+          const unsigned char *newgate, int newifindex,
+          unsigned int newmetric, int newtable)
+{
+    int rc;
+
+    if(operation == ROUTE_MODIFY) {
+        if(newmetric == metric && memcmp(newgate, gate, 16) == 0 &&
+           newifindex == ifindex)
+            return 0;
+        if(sim_ignored(dest, plen, metric) &&
+           sim_ignored(dest, plen, newmetric))
+            return 0;
+    } else if(sim_ignored(dest, plen, metric)) {
+        return 0;
+    }
+
+    /* A modification counts as a single operation, which either fails
+       as a whole or succeeds as a whole. */
+    kernel_simulator_operations++;
+
+    if(kernel_simulator_latency > 0)
+        usleep(kernel_simulator_latency);
+
+    if(kernel_simulator_failure_rate > 0 &&
+       random() % 100 < kernel_simulator_failure_rate) {
+        kernel_simulator_failures++;
+        errno = EIO;
+        return -1;
+    }
+
+    if(operation == ROUTE_MODIFY) {
+        if(!sim_ignored(dest, plen, metric)) {
+            rc = sim_flush_route(table, dest, plen, src, src_plen, metric);
+            if(rc < 0)
+                return rc;
+        }
+        if(sim_ignored(dest, plen, newmetric))
+            return 1;
+        return sim_add_route(newtable, dest, plen, src, src_plen,
+                             newgate, newifindex, newmetric, RTPROT_BABEL);
+    } else if(operation == ROUTE_ADD) {
+        return sim_add_route(table, dest, plen, src, src_plen,
+                             gate, ifindex, metric, RTPROT_BABEL);
+    } else {
+        return sim_flush_route(table, dest, plen, src, src_plen, metric);
+    }
+}
+
+static int
+sim_route_multipath(int table,
+                    const unsigned char *dest, unsigned short plen,
+                    const unsigned char *src, unsigned short src_plen,
+                    const struct kernel_nexthop *nexthops, int n,
+                    unsigned int metric)
+{
+    int i, rc;
+
+    if(n < 1 || n > KERNEL_MAX_NEXTHOPS || metric >= KERNEL_INFINITY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    kernel_simulator_operations++;
+
+    if(kernel_simulator_latency > 0)
+        usleep(kernel_simulator_latency);
+
+    if(kernel_simulator_failure_rate > 0 &&
+       random() % 100 < kernel_simulator_failure_rate) {
+        kernel_simulator_failures++;
+        errno = EIO;
+        return -1;
+    }
+
+    i = sim_find_route(table, dest, plen, src, src_plen, metric);
+    if(i < 0) {
+        rc = sim_add_route(table, dest, plen, src, src_plen,
+                           nexthops[0].gw, nexthops[0].ifindex, metric,
+                           RTPROT_BABEL);
+        if(rc < 0)
+            return rc;
+        i = num_sim_routes - 1;
+    }
+
+    memcpy(sim_routes[i].route.gw, nexthops[0].gw, 16);
+    sim_routes[i].route.ifindex = nexthops[0].ifindex;
+    sim_routes[i].nexthops = n;
+    return 1;
+}
+
+static int
+sim_imported(int table)
+{
+    int i;
+    for(i = 0; i < import_table_count; i++)
+        if(import_tables[i] == table)
+            return 1;
+    return 0;
+}
+
+static int
+sim_dump_addresses(struct kernel_filter *filter)
+{
+    struct ifaddrs *ifa, *ifap;
+    int rc;
+
+    rc = getifaddrs(&ifa);
+    if(rc < 0)
+        return -1;
+
+    for(ifap = ifa; ifap != NULL; ifap = ifap->ifa_next) {
+        struct kernel_addr addr;
+        if(ifap->ifa_addr == NULL)
+            continue;
+        addr.ifindex = if_nametoindex(ifap->ifa_name);
+        if(!addr.ifindex)
+            continue;
+        if(ifap->ifa_addr->sa_family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ifap->ifa_addr;
+            memcpy(&addr.addr, &sin6->sin6_addr, 16);
+        } else if(ifap->ifa_addr->sa_family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in*)ifap->ifa_addr;
+            v4tov6((void*)&addr.addr, (void*)&sin->sin_addr);
+        } else {
+            continue;
+        }
+        filter->addr(&addr, filter->addr_closure);
+    }
+
+    freeifaddrs(ifa);
+    return 0;
+}
+
+static int
+sim_dump(int operation, struct kernel_filter *filter)
+{
+    int i;
+
+    if((operation & CHANGE_ROUTE) && filter->route) {
+        for(i = 0; i < num_sim_routes; i++) {
+            struct sim_route *r = &sim_routes[i];
+            if(r->route.proto == RTPROT_BABEL || !sim_imported(r->table))
+                continue;
+            filter->route(&r->route, filter->route_closure);
+        }
+    }
+
+    if((operation & CHANGE_RULE) && filter->rule) {
+        for(i = 0; i < num_sim_rules; i++) {
+            struct kernel_rule rule;
+            rule.priority = sim_rules[i].priority;
+            rule.table = sim_rules[i].table;
+            memcpy(rule.src, sim_rules[i].src, 16);
+            rule.src_plen = sim_rules[i].src_plen;
+            filter->rule(&rule, filter->rule_closure);
+        }
+    }
+
+    if((operation & CHANGE_ADDR) && filter->addr)
+        return sim_dump_addresses(filter);
+
+    return 0;
+}
+
+static int
+sim_callback(struct kernel_filter *filter)
+{
+    char buf[256];
+    int i, rc, n;
+
+    do {
+        rc = read(sim_pipe[0], buf, sizeof(buf));
+    } while(rc > 0);
+
+    /* The callbacks may cause new notifications to be queued; these will
+       be delivered next time around. */
+    n = num_sim_notifications;
+    for(i = 0; i < n; i++) {
+        if(filter->route)
+            filter->route(&sim_notifications[i], filter->route_closure);
+    }
+    if(n < num_sim_notifications) {
+        memmove(sim_notifications, sim_notifications + n,
+                (num_sim_notifications - n) * sizeof(struct kernel_route));
+        if(sim_pipe[1] >= 0)
+            write(sim_pipe[1], "", 1);
+    }
+    num_sim_notifications -= n;
+
+    return 0;
+}
+
+static int
+sim_add_rule(int prio, const unsigned char *src_prefix, int src_plen,
+             int table)
+{
+    int i;
+
+    for(i = 0; i < num_sim_rules; i++) {
+        if(sim_rules[i].priority == prio &&
+           v4mapped(sim_rules[i].src) == v4mapped(src_prefix)) {
+            errno = EEXIST;
+            return -1;
+        }
+    }
+
+    if(num_sim_rules >= max_sim_rules) {
+        struct sim_rule *new_rules;
+        int n = max_sim_rules < 1 ? 8 : 2 * max_sim_rules;
+        new_rules = realloc(sim_rules, n * sizeof(struct sim_rule));
+        if(new_rules == NULL)
+            return -1;
+        sim_rules = new_rules;
+        max_sim_rules = n;
+    }
+
+    sim_rules[num_sim_rules].priority = prio;
+    sim_rules[num_sim_rules].table = table;
+    memcpy(sim_rules[num_sim_rules].src, src_prefix, 16);
+    sim_rules[num_sim_rules].src_plen = src_plen;
+    num_sim_rules++;
+    kernel_simulator_operations++;
+    return 0;
+}
+
+static int
+sim_flush_rule(int prio, int family)
+{
+    int i;
+
+    for(i = 0; i < num_sim_rules; i++) {
+        if(sim_rules[i].priority == prio &&
+           v4mapped(sim_rules[i].src) == (family == AF_INET)) {
+            if(i < num_sim_rules - 1)
+                sim_rules[i] = sim_rules[num_sim_rules - 1];
+            num_sim_rules--;
+            kernel_simulator_operations++;
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+static int
+sim_change_rule(int new_prio, int old_prio,
+                const unsigned char *src, int plen, int table)
+{
+    int rc;
+    rc = sim_add_rule(new_prio, src, plen, table);
+    if(rc < 0)
+        return rc;
+    return sim_flush_rule(old_prio, v4mapped(src) ? AF_INET : AF_INET6);
+}
+
+static int
+sim_batch(int batch)
+{
+    return 0;
+}
+
+static int
+sim_update_filter(void)
+{
+    return 0;
+}
+
+/* Add or remove a route installed by a third party. */
+int
+kernel_simulator_route(int add, const unsigned char *prefix,
+                       unsigned short plen,
+                       const unsigned char *src, unsigned short src_plen,
+                       unsigned int metric, int ifindex, int proto)
+{
+    int table = import_table_count > 0 ? import_tables[0] : 0;
+
+    if(kernel_backend != &simulator_kernel_backend) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if(add)
+        return sim_add_route(table, prefix, plen, src, src_plen,
+                             NULL, ifindex, metric, proto);
+    else
+        return sim_flush_route(table, prefix, plen, src, src_plen, metric);
+}
+
+int
+kernel_simulator_routes(void)
+{
+    return num_sim_routes;
+}
+
+int
+kernel_simulator_nexthops(void)
+{
+    int i, n = 0;
+    for(i = 0; i < num_sim_routes; i++)
+        n += sim_routes[i].nexthops;
+    return n;
+}
+
+struct kernel_backend simulator_kernel_backend = {
+    "simulator",
+    sim_setup,
+    sim_setup_socket,
+    sim_setup_interface,
+    sim_interface_operational,
+    sim_interface_ipv4,
+    sim_interface_mtu,
+    sim_interface_wireless,
+    sim_interface_channel,
+    sim_disambiguate,
+    sim_has_ipv6_subtrees,
+    sim_route,
+    sim_route_multipath,
+    sim_dump,
+    sim_callback,
+    sim_add_rule,
+    sim_flush_rule,
+    sim_change_rule,
+    sim_batch,
+    sim_update_filter,
+};
@@ -205,8 +205,8 @@ plen2mask(int n, struct in6_addr *dest)
     return;
 }
 
-int
-kernel_setup(int setup)
+static int
+sys_kernel_setup(int setup)
 {
     int rc = 0;
     int forwarding = 1;
@@ -262,8 +262,8 @@ kernel_setup(int setup)
     return 1;
 }
 
-int
-kernel_setup_socket(int setup)
+static int
+sys_kernel_setup_socket(int setup)
 {
     int rc;
     int zero = 0;
@@ -294,14 +294,14 @@ kernel_setup_socket(int setup)
     }
 }
 
-int
-kernel_setup_interface(int setup, const char *ifname, int ifindex)
+static int
+sys_kernel_setup_interface(int setup, const char *ifname, int ifindex)
 {
     return 1;
 }
 
-int
-kernel_interface_operational(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_operational(const char *ifname, int ifindex)
 {
     struct ifreq req;
     int s, rc;
@@ -320,8 +320,8 @@ kernel_interface_operational(const char *ifname, int ifindex)
     return ((req.ifr_flags & flags) == flags);
 }
 
-int
-kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
+static int
+sys_kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
 {
     struct ifreq req;
     int s, rc;
@@ -343,8 +343,8 @@ kernel_interface_ipv4(const char *ifname, int ifindex, unsigned char *addr_r)
     return 1;
 }
 
-int
-kernel_interface_mtu(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_mtu(const char *ifname, int ifindex)
 {
     struct ifreq req;
     int s, rc;
@@ -364,8 +364,8 @@ kernel_interface_mtu(const char *ifname, int ifindex)
     return req.ifr_mtu;
 }
 
-int
-kernel_interface_wireless(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_wireless(const char *ifname, int ifindex)
 {
     struct ifmediareq ifmr;
     int s, rc;
@@ -383,32 +383,32 @@ kernel_interface_wireless(const char *ifname, int ifindex)
         return 0;
 }
 
-int
-kernel_interface_channel(const char *ifname, int ifindex)
+static int
+sys_kernel_interface_channel(const char *ifname, int ifindex)
 {
     errno = ENOSYS;
     return -1;
 }
 
-int
-kernel_disambiguate(int v4)
+static int
+sys_kernel_disambiguate(int v4)
 {
     return 0;
 }
 
-int
-kernel_has_ipv6_subtrees(void)
+static int
+sys_kernel_has_ipv6_subtrees(void)
 {
     return 0;
 }
 
-int
-kernel_route(int operation, int table,
-             const unsigned char *dest, unsigned short plen,
-             const unsigned char *src, unsigned short src_plen,
-             const unsigned char *gate, int ifindex, unsigned int metric,
-             const unsigned char *newgate, int newifindex,
-             unsigned int newmetric, int newtable)
+static int
+sys_kernel_route(int operation, int table,
+                 const unsigned char *dest, unsigned short plen,
+                 const unsigned char *src, unsigned short src_plen,
+                 const unsigned char *gate, int ifindex, unsigned int metric,
+                 const unsigned char *newgate, int newifindex,
+                 unsigned int newmetric, int newtable)
 {
     struct {
         struct rt_msghdr m_rtm;
@@ -451,14 +451,14 @@ kernel_route(int operation, int table,
     if(operation == ROUTE_MODIFY) {
 
         /* Avoid atomic route changes that is buggy on OS X. */
-        kernel_route(ROUTE_FLUSH, table, dest, plen,
-                     src, src_plen,
-                     gate, ifindex, metric,
-                     NULL, 0, 0, 0);
-        return kernel_route(ROUTE_ADD, table, dest, plen,
-                            src, src_plen,
-                            newgate, newifindex, newmetric,
-                            NULL, 0, 0, 0);
+        sys_kernel_route(ROUTE_FLUSH, table, dest, plen,
+                         src, src_plen,
+                         gate, ifindex, metric,
+                         NULL, 0, 0, 0);
+        return sys_kernel_route(ROUTE_ADD, table, dest, plen,
+                                src, src_plen,
+                                newgate, newifindex, newmetric,
+                                NULL, 0, 0, 0);
 
     }
 
@@ -468,7 +468,7 @@ kernel_route(int operation, int table,
             format_address(dest), plen, metric, ifindex,
             format_address(gate));
 
-    if(kernel_socket < 0) kernel_setup_socket(1);
+    if(kernel_socket < 0) sys_kernel_setup_socket(1);
 
     memset(&msg, 0, sizeof(msg));
     msg.m_rtm.rtm_version = RTM_VERSION;
@@ -577,6 +577,18 @@ kernel_route(int operation, int table,
     return 1;
 }
 
+static int
+sys_kernel_route_multipath(int table,
+                           const unsigned char *dest, unsigned short plen,
+                           const unsigned char *src, unsigned short src_plen,
+                           const struct kernel_nexthop *nexthops, int n,
+                           unsigned int metric)
+{
+    /* Multipath routes are not implemented for BSD. */
+    errno = ENOSYS;
+    return -1;
+}
+
 static void
 print_kernel_route(int add, struct kernel_route *route)
 {
@@ -754,6 +766,8 @@ socket_read(int sock, struct kernel_filter *filter)
     } buf;
 
     rc = read(sock, &buf, sizeof(buf));
+    if(rc < 0 && errno == ENOBUFS)
+        return -1;
     if(rc <= 0) {
         perror("kernel_callback(read)");
         return 0;
@@ -827,8 +841,8 @@ kernel_addresses(struct kernel_filter *filter)
     return 0;
 }
 
-int
-kernel_dump(int operation, struct kernel_filter *filter)
+static int
+sys_kernel_dump(int operation, struct kernel_filter *filter)
 {
     switch(operation) {
     case CHANGE_ROUTE: return kernel_routes(filter);
@@ -839,40 +853,61 @@ kernel_dump(int operation, struct kernel_filter *filter)
     return -1;
 }
 
-int
-kernel_callback(struct kernel_filter *filter)
+static int
+sys_kernel_callback(struct kernel_filter *filter)
 {
-    if(kernel_socket < 0) kernel_setup_socket(1);
+    int rc;
+
+    if(kernel_socket < 0) sys_kernel_setup_socket(1);
 
     kdebugf("Reading kernel table modification.");
-    socket_read(kernel_socket, filter);
+    errno = 0;
+    rc = socket_read(kernel_socket, filter);
+    if(rc < 0 && errno == ENOBUFS) {
+        /* The routing socket overflowed, notifications were lost. */
+        kernel_socket_overflows++;
+        fprintf(stderr, "Routing socket overflow, resynchronising.\n");
+        return CHANGE_LINK | CHANGE_ADDR | CHANGE_ROUTE;
+    }
 
     return 0;
 
 }
 
-int
-add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
+static int
+sys_add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
     errno = ENOSYS;
     return -1;
 }
 
-int
-flush_rule(int prio, int family)
+static int
+sys_flush_rule(int prio, int family)
 {
     errno = ENOSYS;
     return -1;
 }
 
-int
-change_rule(int new_prio, int old_prio,
-            const unsigned char *src, int plen, int table)
+static int
+sys_change_rule(int new_prio, int old_prio,
+                const unsigned char *src, int plen, int table)
 {
     errno = ENOSYS;
     return -1;
 }
 
+static int
+sys_kernel_batch(int batch)
+{
+    return 0;
+}
+
+static int
+sys_kernel_update_filter(void)
+{
+    return 0;
+}
+
 
 /* Local Variables:      */
 /* c-basic-offset: 4     */
@@ -47,35 +47,333 @@ int local_server_port = -1;
 char *local_server_path;
 int local_server_write = 0;
 
+int local_high_water_mark = 65536;
+int local_overflow = LOCAL_OVERFLOW_DISCONNECT;
+
+static void local_dump_start(struct local_socket *s,
+                             struct local_monitor *scope, int reply);
+static int local_process(struct local_socket *s);
+
+/* Output to local clients never blocks.  Whatever cannot be written
+   immediately is queued in the client's ring buffer, and written out by
+   local_flush once the socket becomes writable.  Replies to requests are
+   always queued.  Monitor events that would take the queue beyond the
+   high-water mark either cause the client to be disconnected, or are
+   dropped and replaced with a fresh dump once the client has caught up;
+   since a dump cannot convey that something went away, flush events are
+   still queued, up to a hard limit. */
+
+static void local_pending_clear(struct local_socket *s);
+
+static void
+local_disconnect(struct local_socket *s)
+{
+    s->out_start = s->out_len = 0;
+    s->monitor = 0;
+    local_pending_clear(s);
+    s->overflow = 0;
+    s->dump = LOCAL_DUMP_NONE;
+    shutdown(s->fd, 2);
+}
+
 static int
-write_timeout(int fd, const void *buf, int len)
+local_reserve(struct local_socket *s, int len)
 {
-    int n = 0, rc = 0;
-    const char *b = buf;
+    char *out;
+    int size, n;
+
+    if(s->out_len + len <= s->out_size)
+        return 1;
+
+    size = MAX(s->out_size, LOCAL_BUFSIZE);
+    while(size < s->out_len + len)
+        size *= 2;
+
+    out = malloc(size);
+    if(out == NULL)
+        return -1;
 
-    while(n < len) {
-        rc = write(fd, b + n, len - n);
+    if(s->out_len > 0) {
+        n = MIN(s->out_len, s->out_size - s->out_start);
+        memcpy(out, s->out + s->out_start, n);
+        memcpy(out + n, s->out, s->out_len - n);
+    }
+    free(s->out);
+    s->out = out;
+    s->out_size = size;
+    s->out_start = 0;
+    return 1;
+}
+
+/* Event is true for monitor events, false for replies to a request. */
+static int
+local_output(struct local_socket *s, const char *buf, int len,
+             int event, int kind)
+{
+    int rc, end, n;
+
+    if(event) {
+        if(s->overflow && kind != LOCAL_FLUSH)
+            return 0;
+        if(s->out_len + len > local_high_water_mark) {
+            if(local_overflow == LOCAL_OVERFLOW_DISCONNECT ||
+               s->out_len + len > 4 * local_high_water_mark)
+                goto fail;
+            s->overflow = 1;
+            if(kind != LOCAL_FLUSH)
+                return 0;
+        }
+    }
+
+    if(s->out_len == 0) {
+        rc = write(s->fd, buf, len);
         if(rc < 0) {
-            if(errno == EAGAIN || errno == EINTR) {
-                rc = wait_for_fd(1, fd, 100);
-                if(rc > 0) {
-                    rc = write(fd, b + n, len - n);
-                }
-            }
+            if(errno != EAGAIN && errno != EINTR)
+                goto fail;
+            rc = 0;
         }
-        if(rc > 0)
-            n += rc;
-        else
-            break;
+        if(rc >= len)
+            return 1;
+        buf += rc;
+        len -= rc;
+    }
+
+    rc = local_reserve(s, len);
+    if(rc < 0)
+        goto fail;
+
+    end = (s->out_start + s->out_len) % s->out_size;
+    n = MIN(len, s->out_size - end);
+    memcpy(s->out + end, buf, n);
+    memcpy(s->out, buf + n, len - n);
+    s->out_len += len;
+    return 1;
+
+ fail:
+    local_disconnect(s);
+    return -1;
+}
+
+/* Called when the socket is writable. */
+int
+local_flush(struct local_socket *s)
+{
+    int rc;
+
+    while(s->out_len > 0) {
+        rc = write(s->fd, s->out + s->out_start,
+                   MIN(s->out_len, s->out_size - s->out_start));
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        s->out_start = (s->out_start + rc) % s->out_size;
+        s->out_len -= rc;
+    }
+
+    free(s->out);
+    s->out = NULL;
+    s->out_start = s->out_size = 0;
+
+    if(s->quit) {
+        shutdown(s->fd, 1);
+        return 1;
+    }
+
+    if(s->overflow) {
+        s->overflow = 0;
+        if(s->monitor)
+            local_dump_start(s, &s->scope,
+                             s->dump != LOCAL_DUMP_NONE && s->dump_reply);
+    }
+
+    return 1;
+}
+
+/* A dump is sent out a slice at a time, interleaved with monitor events.
+   Both the route table and the xroute table are walked in an order that
+   survives modification, and events about objects that the dump has not
+   reached yet are not sent, since the dump will pick up their current
+   state.  The client therefore sees a snapshot of each object followed
+   by the changes to it. */
+
+static int
+local_in_scope(struct local_monitor *scope, int class,
+               const unsigned char *prefix, unsigned char plen)
+{
+    enum prefix_status st;
+
+    if(!(scope->classes & class))
+        return 0;
+    if(prefix == NULL || scope->plen == 0)
+        return 1;
+    st = prefix_cmp(prefix, plen, scope->prefix, scope->plen);
+    return st == PST_EQUALS || st == PST_MORE_SPECIFIC;
+}
+
+static int
+local_dumped_route(struct local_socket *s, struct babel_route *route)
+{
+    if(s->dump == LOCAL_DUMP_NONE ||
+       !local_in_scope(&s->dump_scope, LOCAL_ROUTES,
+                       route->src->prefix, route->src->plen))
+        return 1;
+    if(s->dump == LOCAL_DUMP_XROUTES || !s->dump_routes)
+        return 0;
+    return route_compare(s->dump_prefix, s->dump_plen,
+                         s->dump_src_prefix, s->dump_src_plen, route) >= 0;
+}
+
+static int
+local_dumped_xroute(struct local_socket *s, struct xroute *xroute)
+{
+    if(s->dump != LOCAL_DUMP_XROUTES ||
+       !local_in_scope(&s->dump_scope, LOCAL_XROUTES,
+                       xroute->prefix, xroute->plen))
+        return 1;
+    return xroute_index(xroute) < s->dump_index;
+}
+
+/* A client that asked for an interval only gets the latest state of each
+   object once per interval.  Events are merged in a hash table, keyed by
+   address, except for xroutes which move around in memory and are keyed
+   by destination.  Flush events are sent right away, since there is no
+   state to wait for, and cancel an add that hasn't been sent yet. */
+
+#define LOCAL_NONE (-1)
+
+struct local_pending {
+    int class;                  /* 0 if this entry is free */
+    int kind;                   /* LOCAL_NONE if nothing is pending */
+    void *object;
+    unsigned char prefix[16], src_prefix[16];
+    unsigned char plen, src_plen;
+};
+
+static unsigned int
+local_pending_hash(const struct local_pending *key)
+{
+    const unsigned char *p;
+    unsigned int h = 2166136261U;
+    int i, n;
+
+    if(key->object) {
+        p = (const unsigned char*)&key->object;
+        n = sizeof(key->object);
+    } else {
+        p = key->prefix;
+        n = 16;
+        h = (h ^ key->plen) * 16777619U;
+        for(i = 0; i < 16; i++)
+            h = (h ^ key->src_prefix[i]) * 16777619U;
+        h = (h ^ key->src_plen) * 16777619U;
     }
+    for(i = 0; i < n; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h ^ key->class;
+}
 
-    if(n >= len)
+static int
+local_pending_equal(const struct local_pending *a,
+                    const struct local_pending *b)
+{
+    if(a->class != b->class || a->object != b->object)
+        return 0;
+    if(a->object)
         return 1;
-    else {
-        if(rc >= 0)
-            errno = EAGAIN;
+    return a->plen == b->plen && a->src_plen == b->src_plen &&
+        memcmp(a->prefix, b->prefix, 16) == 0 &&
+        memcmp(a->src_prefix, b->src_prefix, 16) == 0;
+}
+
+static struct local_pending *
+local_pending_slot(struct local_pending *table, int size,
+                   const struct local_pending *key)
+{
+    unsigned int i = local_pending_hash(key) & (size - 1);
+
+    while(table[i].class != 0 && !local_pending_equal(&table[i], key))
+        i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static int
+local_pending_resize(struct local_socket *s, int size)
+{
+    struct local_pending *table, *p;
+    int i;
+
+    table = calloc(size, sizeof(struct local_pending));
+    if(table == NULL)
         return -1;
+
+    for(i = 0; i < s->maxpending; i++) {
+        if(s->pending[i].class != 0) {
+            p = local_pending_slot(table, size, &s->pending[i]);
+            *p = s->pending[i];
+        }
     }
+    free(s->pending);
+    s->pending = table;
+    s->maxpending = size;
+    return 1;
+}
+
+static void
+local_pending_clear(struct local_socket *s)
+{
+    free(s->pending);
+    s->pending = NULL;
+    s->numpending = s->maxpending = 0;
+    s->pending_time.tv_sec = s->pending_time.tv_usec = 0;
+}
+
+/* Returns true if the event should be sent right away. */
+static int
+local_pending_event(struct local_socket *s, const struct local_pending *key,
+                    int kind)
+{
+    struct local_pending *p;
+    int rc;
+
+    if(s->scope.interval <= 0)
+        return 1;
+
+    if(kind == LOCAL_FLUSH) {
+        if(s->numpending == 0)
+            return 1;
+        p = local_pending_slot(s->pending, s->maxpending, key);
+        if(p->class == 0 || p->kind != LOCAL_ADD) {
+            if(p->class != 0)
+                p->kind = LOCAL_NONE;
+            return 1;
+        }
+        p->kind = LOCAL_NONE;
+        return 0;
+    }
+
+    if(2 * (s->numpending + 1) > s->maxpending) {
+        rc = local_pending_resize(s, s->maxpending < 1 ?
+                                  64 : 2 * s->maxpending);
+        if(rc < 0)
+            return 1;
+    }
+
+    p = local_pending_slot(s->pending, s->maxpending, key);
+    if(p->class == 0) {
+        *p = *key;
+        p->kind = LOCAL_NONE;
+        s->numpending++;
+    }
+    if(p->kind == LOCAL_NONE || kind == LOCAL_ADD)
+        p->kind = kind;
+
+    if(s->pending_time.tv_sec == 0)
+        timeval_add_msec(&s->pending_time, &now, s->scope.interval);
+    return 0;
 }
 
 static const char *
@@ -91,7 +389,7 @@ local_kind(int kind)
 
 static void
 local_notify_interface_1(struct local_socket *s,
-                         struct interface *ifp, int kind)
+                         struct interface *ifp, int kind, int event)
 {
     char buf[512], v4[INET_ADDRSTRLEN];
     int rc;
@@ -116,9 +414,7 @@ local_notify_interface_1(struct local_socket *s,
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_output(s, buf, rc, event, kind);
     return;
 
  fail:
@@ -129,16 +425,24 @@ local_notify_interface_1(struct local_socket *s,
 void
 local_notify_interface(struct interface *ifp, int kind)
 {
+    struct local_socket *s;
+    struct local_pending key = {0};
     int i;
+
+    key.class = LOCAL_INTERFACES;
+    key.object = ifp;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_interface_1(&local_sockets[i], ifp, kind);
+        s = &local_sockets[i];
+        if(s->monitor &&
+           local_in_scope(&s->scope, LOCAL_INTERFACES, NULL, 0) &&
+           local_pending_event(s, &key, kind))
+            local_notify_interface_1(s, ifp, kind, 1);
     }
 }
 
 static void
 local_notify_neighbour_1(struct local_socket *s,
-                         struct neighbour *neigh, int kind)
+                         struct neighbour *neigh, int kind, int event)
 {
     char buf[512], rttbuf[64];
     int rc;
@@ -154,7 +458,9 @@ local_notify_neighbour_1(struct local_socket *s,
     rc = snprintf(buf, 512,
                   "%s neighbour %lx address %s "
                   "if %s reach %04x ureach %04x "
-                  "rxcost %d txcost %d%s cost %d\n",
+                  "rxcost %d txcost %d%s cost %d "
+                  "requests-received %u requests-sent %u "
+                  "requests-limited %u\n",
                   local_kind(kind),
                   /* Neighbours never move around in memory , so we can use the
                      address as a unique identifier. */
@@ -166,14 +472,14 @@ local_notify_neighbour_1(struct local_socket *s,
                   neighbour_rxcost(neigh),
                   neighbour_txcost(neigh),
                   rttbuf,
-                  neighbour_cost(neigh));
+                  neighbour_cost(neigh),
+                  neigh->requests_received, neigh->requests_sent,
+                  neigh->requests_limited);
 
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_output(s, buf, rc, event, kind);
     return;
 
  fail:
@@ -184,15 +490,24 @@ local_notify_neighbour_1(struct local_socket *s,
 void
 local_notify_neighbour(struct neighbour *neigh, int kind)
 {
+    struct local_socket *s;
+    struct local_pending key = {0};
     int i;
+
+    key.class = LOCAL_NEIGHBOURS;
+    key.object = neigh;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_neighbour_1(&local_sockets[i], neigh, kind);
+        s = &local_sockets[i];
+        if(s->monitor &&
+           local_in_scope(&s->scope, LOCAL_NEIGHBOURS, NULL, 0) &&
+           local_pending_event(s, &key, kind))
+            local_notify_neighbour_1(s, neigh, kind, 1);
     }
 }
 
 static void
-local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
+local_notify_xroute_1(struct local_socket *s, struct xroute *xroute,
+                      int kind, int event)
 {
     char buf[512];
     int rc;
@@ -208,9 +523,7 @@ local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_output(s, buf, rc, event, kind);
     return;
 
  fail:
@@ -221,18 +534,42 @@ local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
 void
 local_notify_xroute(struct xroute *xroute, int kind)
 {
+    struct local_socket *s;
+    struct local_pending key = {0};
+    struct xroute *last;
     int i;
+
+    key.class = LOCAL_XROUTES;
+    memcpy(key.prefix, xroute->prefix, 16);
+    key.plen = xroute->plen;
+    memcpy(key.src_prefix, xroute->src_prefix, 16);
+    key.src_plen = xroute->src_plen;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_xroute_1(&local_sockets[i], xroute, kind);
+        s = &local_sockets[i];
+        if(kind == LOCAL_FLUSH && s->dump == LOCAL_DUMP_XROUTES &&
+           local_dumped_xroute(s, xroute)) {
+            /* flush_xroute is about to move the last xroute into this
+               slot, where the dump would miss it. */
+            last = xroute_at(xroutes_estimate() - 1);
+            if(last != xroute && !local_dumped_xroute(s, last))
+                local_notify_xroute_1(s, last, LOCAL_ADD, 0);
+        }
+        if(s->monitor &&
+           local_in_scope(&s->scope, LOCAL_XROUTES,
+                          xroute->prefix, xroute->plen) &&
+           local_dumped_xroute(s, xroute) &&
+           local_pending_event(s, &key, kind))
+            local_notify_xroute_1(s, xroute, kind, 1);
     }
 }
 
 static void
-local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind)
+local_notify_route_1(struct local_socket *s, struct babel_route *route,
+                     int kind, int event)
 {
     char buf[512];
-    int rc;
+    int rc, n, suppressed;
+    unsigned int penalty;
     const char *dst_prefix = format_prefix(route->src->prefix,
                                            route->src->plen);
     const char *src_prefix = format_prefix(route->src->src_prefix,
@@ -240,7 +577,7 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
 
     rc = snprintf(buf, 512,
                   "%s route %lx prefix %s from %s installed %s "
-                  "id %s metric %d refmetric %d via %s if %s\n",
+                  "id %s metric %d refmetric %d via %s if %s",
                   local_kind(kind),
                   (unsigned long)route,
                   dst_prefix, src_prefix,
@@ -252,10 +589,23 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
 
     if(rc < 0 || rc >= 512)
         goto fail;
+    n = rc;
+
+    suppressed = route_damping(route->src, &penalty);
+    if(suppressed >= 0) {
+        rc = snprintf(buf + n, 512 - n, " penalty %u suppressed %s",
+                      penalty, suppressed ? "yes" : "no");
+        if(rc < 0 || rc >= 512 - n)
+            goto fail;
+        n += rc;
+    }
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
+    rc = snprintf(buf + n, 512 - n, "\n");
+    if(rc < 0 || rc >= 512 - n)
         goto fail;
+    rc += n;
+
+    local_output(s, buf, rc, event, kind);
     return;
 
  fail:
@@ -265,61 +615,193 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
 
 void
 local_notify_route(struct babel_route *route, int kind)
+{
+    struct local_socket *s;
+    struct local_pending key = {0};
+    int i;
+
+    key.class = LOCAL_ROUTES;
+    key.object = route;
+    for(i = 0; i < num_local_sockets; i++) {
+        s = &local_sockets[i];
+        if(s->monitor &&
+           local_in_scope(&s->scope, LOCAL_ROUTES,
+                          route->src->prefix, route->src->plen) &&
+           local_dumped_route(s, route) &&
+           local_pending_event(s, &key, kind))
+            local_notify_route_1(s, route, kind, 1);
+    }
+}
+
+static void
+local_send_pending_1(struct local_socket *s)
+{
+    struct local_pending *pending = s->pending;
+    struct xroute *xroute;
+    int i, n = s->maxpending;
+
+    /* Sending may disconnect the client, which clears the table. */
+    s->pending = NULL;
+    local_pending_clear(s);
+
+    for(i = 0; i < n && s->monitor; i++) {
+        if(pending[i].class == 0 || pending[i].kind == LOCAL_NONE)
+            continue;
+        switch(pending[i].class) {
+        case LOCAL_INTERFACES:
+            local_notify_interface_1(s, pending[i].object,
+                                     pending[i].kind, 1);
+            break;
+        case LOCAL_NEIGHBOURS:
+            local_notify_neighbour_1(s, pending[i].object,
+                                     pending[i].kind, 1);
+            break;
+        case LOCAL_XROUTES:
+            xroute = find_xroute(pending[i].prefix, pending[i].plen,
+                                 pending[i].src_prefix, pending[i].src_plen);
+            if(xroute)
+                local_notify_xroute_1(s, xroute, pending[i].kind, 1);
+            break;
+        case LOCAL_ROUTES:
+            local_notify_route_1(s, pending[i].object, pending[i].kind, 1);
+            break;
+        }
+    }
+    free(pending);
+}
+
+void
+local_send_pending()
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_route_1(&local_sockets[i], route, kind);
+        if(local_sockets[i].pending_time.tv_sec != 0 &&
+           timeval_compare(&local_sockets[i].pending_time, &now) <= 0)
+            local_send_pending_1(&local_sockets[i]);
     }
 }
 
+/* Interfaces and neighbours are few, and are sent out right away. */
 static void
-local_notify_all_1(struct local_socket *s)
+local_dump_start(struct local_socket *s, struct local_monitor *scope,
+                 int reply)
 {
     struct interface *ifp;
     struct neighbour *neigh;
-    struct xroute_stream *xroutes;
-    struct route_stream *routes;
 
-    FOR_ALL_INTERFACES(ifp) {
-        local_notify_interface_1(s, ifp, LOCAL_ADD);
+    s->dump = LOCAL_DUMP_XROUTES;
+    s->dump_scope = *scope;
+    s->dump_reply = reply;
+    s->dump_index = 0;
+    s->dump_routes = 0;
+
+    if(scope->classes & LOCAL_INTERFACES) {
+        FOR_ALL_INTERFACES(ifp) {
+            local_notify_interface_1(s, ifp, LOCAL_ADD, 0);
+        }
     }
 
-    FOR_ALL_NEIGHBOURS(neigh) {
-        local_notify_neighbour_1(s, neigh, LOCAL_ADD);
+    if(scope->classes & LOCAL_NEIGHBOURS) {
+        FOR_ALL_NEIGHBOURS(neigh) {
+            local_notify_neighbour_1(s, neigh, LOCAL_ADD, 0);
+        }
     }
+}
+
+static void
+local_dump_done(struct local_socket *s)
+{
+    int rc;
 
-    xroutes = xroute_stream();
-    if(xroutes) {
-        while(1) {
-            struct xroute *xroute = xroute_stream_next(xroutes);
-            if(xroute == NULL)
-                break;
-            local_notify_xroute_1(s, xroute, LOCAL_ADD);
+    s->dump = LOCAL_DUMP_NONE;
+    if(s->dump_reply) {
+        rc = local_output(s, "ok\n", 3, 0, 0);
+        if(rc < 0)
+            return;
+    }
+
+    /* Requests that arrived during the dump. */
+    local_process(s);
+}
+
+static void
+local_dump_slice(struct local_socket *s)
+{
+    struct xroute *xroute;
+    struct babel_route *route;
+    int n = 0;
+
+    while(s->dump == LOCAL_DUMP_XROUTES && n < LOCAL_DUMP_SLICE) {
+        xroute = xroute_at(s->dump_index);
+        if(xroute == NULL) {
+            s->dump = LOCAL_DUMP_ROUTES;
+            break;
         }
-        xroute_stream_done(xroutes);
+        s->dump_index++;
+        if(local_in_scope(&s->dump_scope, LOCAL_XROUTES,
+                          xroute->prefix, xroute->plen))
+            local_notify_xroute_1(s, xroute, LOCAL_ADD, 0);
+        n++;
     }
 
-    routes = route_stream(ROUTE_ALL);
-    if(routes) {
-        while(1) {
-            struct babel_route *route = route_stream_next(routes);
-            if(route == NULL)
-                break;
-            local_notify_route_1(s, route, LOCAL_ADD);
+    while(s->dump == LOCAL_DUMP_ROUTES && n < LOCAL_DUMP_SLICE) {
+        route = next_route_slot(s->dump_routes ? s->dump_prefix : NULL,
+                                s->dump_plen,
+                                s->dump_src_prefix, s->dump_src_plen);
+        if(route == NULL) {
+            local_dump_done(s);
+            return;
+        }
+        memcpy(s->dump_prefix, route->src->prefix, 16);
+        s->dump_plen = route->src->plen;
+        memcpy(s->dump_src_prefix, route->src->src_prefix, 16);
+        s->dump_src_plen = route->src->src_plen;
+        s->dump_routes = 1;
+        if(!local_in_scope(&s->dump_scope, LOCAL_ROUTES,
+                           route->src->prefix, route->src->plen))
+            route = NULL;
+        while(route && s->dump == LOCAL_DUMP_ROUTES) {
+            local_notify_route_1(s, route, LOCAL_ADD, 0);
+            route = route->next;
         }
-        route_stream_done(routes);
+        n++;
+    }
+}
+
+/* A dump only proceeds while the client keeps up, and leaves half of the
+   output queue to monitor events. */
+static int
+local_dump_ready(struct local_socket *s)
+{
+    return s->dump != LOCAL_DUMP_NONE &&
+        s->out_len < local_high_water_mark / 2;
+}
+
+int
+local_dumping()
+{
+    int i;
+    for(i = 0; i < num_local_sockets; i++) {
+        if(local_dump_ready(&local_sockets[i]))
+            return 1;
+    }
+    return 0;
+}
+
+void
+local_dump()
+{
+    int i;
+    for(i = 0; i < num_local_sockets; i++) {
+        if(local_dump_ready(&local_sockets[i]))
+            local_dump_slice(&local_sockets[i]);
     }
-    return;
 }
 
 int
 local_read(struct local_socket *s)
 {
-    int rc, n;
-    char *eol;
-    char reply[100] = "ok\n";
-    const char *message = NULL;
+    int rc;
 
     if(s->buf == NULL)
         s->buf = malloc(LOCAL_BUFSIZE);
@@ -336,29 +818,57 @@ local_read(struct local_socket *s)
         return rc;
     s->n += rc;
 
-    while(s->n > 0) {
+    return local_process(s);
+
+ fail:
+    shutdown(s->fd, 1);
+    return -1;
+}
+
+/* Requests are not processed while a dump is in progress, the reply to
+   the dump must come first. */
+static int
+local_process(struct local_socket *s)
+{
+    int rc, n;
+    char *eol;
+    char reply[100];
+    const char *message;
+    struct local_monitor monitor;
+
+    while(s->n > 0 && s->dump == LOCAL_DUMP_NONE) {
+        strcpy(reply, "ok\n");
+        message = NULL;
         eol = memchr(s->buf, '\n', s->n);
         if(eol == NULL)
             break;
         n = eol + 1 - s->buf;
 
-        rc = parse_config_from_string(s->buf, n, &message);
+        rc = parse_config_from_string(s->buf, n, &message, &monitor);
         switch(rc) {
         case CONFIG_ACTION_DONE:
             break;
         case CONFIG_ACTION_QUIT:
-            shutdown(s->fd, 1);
+            if(s->out_len > 0)
+                s->quit = 1;
+            else
+                shutdown(s->fd, 1);
             reply[0] = '\0';
             break;
         case CONFIG_ACTION_DUMP:
-            local_notify_all_1(s);
+            local_dump_start(s, &monitor, 1);
+            reply[0] = '\0';
             break;
         case CONFIG_ACTION_MONITOR:
-            local_notify_all_1(s);
+            local_pending_clear(s);
+            s->scope = monitor;
+            local_dump_start(s, &monitor, 1);
             s->monitor = 1;
+            reply[0] = '\0';
             break;
         case CONFIG_ACTION_UNMONITOR:
             s->monitor = 0;
+            local_pending_clear(s);
             break;
         case CONFIG_ACTION_NO:
             snprintf(reply, sizeof(reply), "no%s%s\n",
@@ -369,10 +879,9 @@ local_read(struct local_socket *s)
         }
 
         if(reply[0] != '\0') {
-            rc = write_timeout(s->fd, reply, strlen(reply));
-            if(rc < 0) {
-                goto fail;
-            }
+            rc = local_output(s, reply, strlen(reply), 0, 0);
+            if(rc < 0)
+                return -1;
         }
         if(s->n > n)
             memmove(s->buf, s->buf + n, s->n - n);
@@ -385,10 +894,6 @@ local_read(struct local_socket *s)
     }
 
     return 1;
-
- fail:
-    shutdown(s->fd, 1);
-    return -1;
 }
 
 int
@@ -405,9 +910,9 @@ local_header(struct local_socket *s)
                   BABELD_VERSION, host, format_eui64(myid));
     if(rc < 0 || rc >= 512)
         goto fail;
-    rc = write_timeout(s->fd, buf, rc);
+    rc = local_output(s, buf, rc, 0, 0);
     if(rc < 0)
-        goto fail;
+        return -1;
 
     return 1;
 
@@ -438,6 +943,8 @@ local_socket_destroy(int i)
     }
 
     free(local_sockets[i].buf);
+    free(local_sockets[i].out);
+    free(local_sockets[i].pending);
     close(local_sockets[i].fd);
     local_sockets[i] = local_sockets[--num_local_sockets];
     VALGRIND_MAKE_MEM_UNDEFINED(local_sockets + num_local_sockets,
@@ -34,11 +34,63 @@ struct xroute;
 
 #define LOCAL_BUFSIZE 1024
 
+/* What to do with a monitoring client whose output exceeds the high-water
+   mark. */
+#define LOCAL_OVERFLOW_DISCONNECT 0
+#define LOCAL_OVERFLOW_COALESCE 1
+
+/* Classes of objects, for dump and monitor requests. */
+#define LOCAL_INTERFACES 1
+#define LOCAL_NEIGHBOURS 2
+#define LOCAL_XROUTES 4
+#define LOCAL_ROUTES 8
+#define LOCAL_ALL 15
+
+/* What a dump or monitor request applies to. */
+struct local_monitor {
+    int classes;
+    unsigned char prefix[16];   /* routes and xroutes within this prefix */
+    unsigned char plen;
+    int interval;               /* if not 0, coalesce events over msecs */
+};
+
+/* Progress of a dump, which is sent out incrementally. */
+#define LOCAL_DUMP_NONE 0
+#define LOCAL_DUMP_XROUTES 1
+#define LOCAL_DUMP_ROUTES 2
+
+/* Xroutes or route slots dumped per iteration of the main loop. */
+#ifndef LOCAL_DUMP_SLICE
+#define LOCAL_DUMP_SLICE 256
+#endif
+
+struct local_pending;
+
 struct local_socket {
     int fd;
     char *buf;
     int n;
     int monitor;
+    struct local_monitor scope;
+    /* Objects with coalesced events, a hash table of maxpending entries,
+       sent out at pending_time. */
+    struct local_pending *pending;
+    int numpending, maxpending;
+    struct timeval pending_time;
+    /* Output not yet written, a ring buffer of out_size bytes. */
+    char *out;
+    int out_start, out_len, out_size;
+    int overflow;               /* events were dropped, resync pending */
+    int quit;                   /* shut down once output is written */
+    /* Dump in progress.  The xroutes below dump_index, and the routes up
+       to the destination dump_prefix, have been sent. */
+    int dump;
+    struct local_monitor dump_scope;
+    int dump_reply;             /* reply to the request once done */
+    int dump_index;
+    int dump_routes;            /* dump_prefix is valid */
+    unsigned char dump_prefix[16], dump_src_prefix[16];
+    unsigned char dump_plen, dump_src_plen;
 };
 
 extern int local_server_socket;
@@ -46,12 +98,18 @@ extern struct local_socket local_sockets[MAX_LOCAL_SOCKETS];
 extern int num_local_sockets;
 extern int local_server_port;
 extern char *local_server_path;
+extern int local_high_water_mark;
+extern int local_overflow;
 
 void local_notify_interface(struct interface *ifp, int kind);
 void local_notify_neighbour(struct neighbour *neigh, int kind);
 void local_notify_xroute(struct xroute *xroute, int kind);
 void local_notify_route(struct babel_route *route, int kind);
 int local_read(struct local_socket *s);
+int local_flush(struct local_socket *s);
 int local_header(struct local_socket *s);
+int local_dumping(void);
+void local_dump(void);
+void local_send_pending(void);
 struct local_socket *local_socket_create(int fd);
 void local_socket_destroy(int i);
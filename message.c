@@ -45,6 +45,13 @@ unsigned char packet_header[4] = {42, 2};
 
 int split_horizon = 1;
 
+/* Multi-hop requests sent to a neighbour per second, 0 for no limit. */
+int request_rate = 0;
+/* Multi-hop requests received, forwarded, and sent in total, and those
+   that were not sent to a neighbour because of request_rate. */
+unsigned int requests_received = 0, requests_forwarded = 0;
+unsigned int requests_sent = 0, requests_limited = 0;
+
 unsigned short myseqno = 0;
 struct timeval seqno_time = {0, 0};
 
@@ -425,7 +432,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             /* Nothing right now */
         } else if(type == MESSAGE_HELLO) {
             unsigned short seqno, interval;
-            int unicast, changed, have_timestamp, rc;
+            int unicast, have_timestamp, rc;
             unsigned int timestamp;
             if(len < 6) goto fail;
             unicast = !!(message[2] & 0x80);
@@ -439,14 +446,11 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                                     &timestamp, &have_timestamp);
             if(rc < 0)
                 goto done;
-            changed =
-                update_neighbour(neigh,
-                                 unicast ? &neigh->uhello : &neigh->hello,
-                                 unicast, seqno, interval);
-            update_neighbour_metric(neigh, changed);
-            if(interval > 0)
-                /* Multiply by 3/2 to allow hellos to expire. */
-                schedule_neighbours_check(interval * 15, 0);
+            update_neighbour(neigh,
+                             unicast ? &neigh->uhello : &neigh->hello,
+                             unicast, seqno, interval);
+            update_neighbour_metric(neigh, 1);
+            reschedule_neighbour(neigh);
             if(have_timestamp) {
                 neigh->hello_send_us = timestamp;
                 neigh->hello_rtt_receive_time = now;
@@ -466,20 +470,16 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                    format_address(from), ifp->name,
                    format_address(address));
             if(message[2] == 0 || interface_ll_address(ifp, address)) {
-                int changed;
                 rc = parse_ihu_subtlv(message + 8 + rc, len - 6 - rc,
                                       &hello_send_us, &hello_rtt_receive_time,
                                       NULL);
                 if(rc < 0)
                     goto done;
-                changed = txcost != neigh->txcost;
                 neigh->txcost = txcost;
                 neigh->ihu_time = now;
                 neigh->ihu_interval = interval;
-                update_neighbour_metric(neigh, changed);
-                if(interval > 0)
-                    /* Multiply by 3/2 to allow neighbours to expire. */
-                    schedule_neighbours_check(interval * 45, 0);
+                update_neighbour_metric(neigh, 1);
+                reschedule_neighbour(neigh);
             }
         } else if(type == MESSAGE_ROUTER_ID) {
             int rc;
@@ -855,8 +855,6 @@ parse_packet(const unsigned char *from, struct interface *ifp,
     if(have_hello_rtt && hello_send_us && hello_rtt_receive_time) {
         int remote_waiting_us, local_waiting_us;
         unsigned int rtt, smoothed_rtt;
-        unsigned int old_rttcost;
-        int changed = 0;
         remote_waiting_us = neigh->hello_send_us - hello_rtt_receive_time;
         local_waiting_us = time_us(neigh->hello_rtt_receive_time) -
             hello_send_us;
@@ -870,8 +868,11 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         debugf("RTT to %s on %s sample result: %d us.\n",
                format_address(from), ifp->name, rtt);
 
-        old_rttcost = neighbour_rttcost(neigh);
         if(valid_rtt(neigh)) {
+            unsigned int deviation =
+                neigh->rtt >= rtt ? neigh->rtt - rtt : rtt - neigh->rtt;
+            /* Mean deviation, with a gain of 1/4 as in TCP. */
+            neigh->rtt_var = (3 * neigh->rtt_var + deviation) / 4;
             /* Running exponential average. */
             smoothed_rtt = (ifp->rtt_decay * rtt +
                             (256 - ifp->rtt_decay) * neigh->rtt);
@@ -883,14 +884,41 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                (higher RTT) */
             assert(rtt <= 0x7FFFFFFF);
             neigh->rtt = 2*rtt;
+            neigh->rtt_var = 0;
         }
-        changed = (neighbour_rttcost(neigh) == old_rttcost ? 0 : 1);
-        update_neighbour_metric(neigh, changed);
         neigh->rtt_time = now;
+        update_neighbour_metric(neigh, 1);
+        reschedule_neighbour(neigh);
     }
     return;
 }
 
+/* Limit the multi-hop requests sent to a neighbour to request_rate per
+   second, in bursts of up to twice that. */
+
+static int
+check_request_bucket(struct neighbour *neigh)
+{
+    if(request_rate <= 0)
+        return 1;
+
+    if(neigh->request_bucket <= 0) {
+        int seconds = now.tv_sec - neigh->request_bucket_time;
+        if(seconds > 0) {
+            neigh->request_bucket = MIN(2 * request_rate,
+                                        seconds * request_rate);
+        }
+        neigh->request_bucket_time = now.tv_sec;
+    }
+
+    if(neigh->request_bucket > 0) {
+        neigh->request_bucket--;
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
 /* Under normal circumstances, there are enough moderation mechanisms
    elsewhere in the protocol to make sure that this last-ditch check
    should never trigger.  But I'm superstitious. */
@@ -1184,6 +1212,45 @@ send_hello(struct interface *ifp)
         send_marginal_ihu(ifp);
 }
 
+/* Send a unicast hello to every neighbour on the interface.  These are
+   sent immediately, since the receiver uses them to detect failures. */
+void
+send_probes(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    int timestamps = !!(ifp->flags & IF_TIMESTAMPS);
+    unsigned interval = (ifp->probe_interval + 9) / 10;
+    int rc;
+
+    set_timeout(&ifp->probe_timeout, ifp->probe_interval);
+
+    if(!if_up(ifp))
+        return;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        neigh->uhello_seqno = seqno_plus(neigh->uhello_seqno, 1);
+        debugf("Sending unicast hello %d (%d) to %s on %s.\n",
+               neigh->uhello_seqno, interval,
+               format_address(neigh->address), ifp->name);
+        rc = start_unicast_message(neigh, MESSAGE_HELLO, timestamps ? 12 : 6);
+        if(rc < 0)
+            return;
+        accumulate_unicast_short(neigh, 0x8000);
+        accumulate_unicast_short(neigh, neigh->uhello_seqno);
+        accumulate_unicast_short(neigh, interval > 0xFFFF ? 0xFFFF : interval);
+        if(timestamps) {
+            gettime(&now);
+            accumulate_unicast_byte(neigh, SUBTLV_TIMESTAMP);
+            accumulate_unicast_byte(neigh, 4);
+            accumulate_unicast_int(neigh, time_us(now));
+        }
+        end_unicast_message(neigh, MESSAGE_HELLO, timestamps ? 12 : 6);
+        flush_unicast(0);
+    }
+}
+
 void
 flush_unicast(int dofree)
 {
@@ -2027,6 +2094,7 @@ send_multihop_request(struct interface *ifp,
     debugf("Sending request (%d) on %s for %s from %s.\n",
            hop_count, ifp->name, format_prefix(prefix, plen),
            format_prefix(src_prefix, src_plen));
+    requests_sent++;
     v4 = plen >= 96 && v4mapped(prefix);
     pb = v4 ? ((plen - 96) + 7) / 8 : (plen + 7) / 8;
     len = 6 + 8 + pb;
@@ -2063,7 +2131,8 @@ send_multihop_request(struct interface *ifp,
     }
 }
 
-void
+/* Returns 0 if the request was not sent because of request_rate. */
+int
 send_unicast_multihop_request(struct neighbour *neigh,
                               const unsigned char *prefix, unsigned char plen,
                               const unsigned char *src_prefix,
@@ -2073,6 +2142,17 @@ send_unicast_multihop_request(struct neighbour *neigh,
 {
     int rc, v4, pb, spb, len, is_ss;
 
+    if(!check_request_bucket(neigh)) {
+        debugf("Not sending multi-hop request to %s for %s from %s "
+               "(rate limited).\n",
+               format_address(neigh->address),
+               format_prefix(prefix, plen),
+               format_prefix(src_prefix, src_plen));
+        neigh->requests_limited++;
+        requests_limited++;
+        return 0;
+    }
+
     /* Make sure any buffered updates go out before this request. */
     flushupdates(neigh->ifp);
 
@@ -2093,7 +2173,9 @@ send_unicast_multihop_request(struct neighbour *neigh,
         spb = 0;
         rc = start_unicast_message(neigh, MESSAGE_MH_REQUEST, len);
     }
-    if(rc < 0) return;
+    if(rc < 0) return -1;
+    neigh->requests_sent++;
+    requests_sent++;
     accumulate_unicast_byte(neigh, v4 ? 1 : 2);
     accumulate_unicast_byte(neigh, v4 ? plen - 96 : plen);
     accumulate_unicast_short(neigh, seqno);
@@ -2115,6 +2197,7 @@ send_unicast_multihop_request(struct neighbour *neigh,
     } else {
         end_unicast_message(neigh, MESSAGE_MH_REQUEST, len);
     }
+    return 1;
 }
 
 /* Send a request to a well-chosen neighbour and resend.  If there is no
@@ -2126,10 +2209,16 @@ send_request_resend(const unsigned char *prefix, unsigned char plen,
 {
     struct babel_route *route;
 
+    if(request_pending(prefix, plen, src_prefix, src_plen, seqno, id)) {
+        request_duplicates++;
+        return;
+    }
+
     route = find_best_route(prefix, plen, src_prefix, src_plen, 0, NULL);
 
     if(route) {
         struct neighbour *neigh = route->neigh;
+        /* If rate limited, the resend will try again. */
         send_unicast_multihop_request(neigh, prefix, plen, src_prefix, src_plen,
                                       seqno, id, 127);
         record_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen, seqno,
@@ -2150,6 +2239,10 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
     struct xroute *xroute;
     struct babel_route *route;
     struct neighbour *successor = NULL;
+    int rc;
+
+    neigh->requests_received++;
+    requests_received++;
 
     xroute = find_xroute(prefix, plen, src_prefix, src_plen);
     route = find_installed_route(prefix, plen, src_prefix, src_plen);
@@ -2185,8 +2278,10 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
     }
 
     if(request_redundant(neigh->ifp, prefix, plen, src_prefix, src_plen,
-                         seqno, id))
+                         seqno, id)) {
+        request_duplicates++;
         return;
+    }
 
     /* Let's try to forward this request. */
     if(route && route_metric(route) < INFINITY)
@@ -2207,8 +2302,13 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
         /* Give up */
         return;
 
-    send_unicast_multihop_request(successor, prefix, plen, src_prefix, src_plen,
-                                  seqno, id, hop_count - 1);
+    rc = send_unicast_multihop_request(successor, prefix, plen,
+                                       src_prefix, src_plen,
+                                       seqno, id, hop_count - 1);
+    if(rc <= 0)
+        /* The requestor will resend. */
+        return;
+    requests_forwarded++;
     record_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen, seqno, id,
                   neigh->ifp, 0);
 }
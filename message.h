@@ -52,6 +52,9 @@ extern struct timeval seqno_time;
 
 extern int broadcast_ihu;
 extern int split_horizon;
+extern int request_rate;
+extern unsigned int requests_received, requests_forwarded;
+extern unsigned int requests_sent, requests_limited;
 
 extern unsigned char packet_header[4];
 
@@ -66,6 +69,7 @@ void send_ack(struct neighbour *neigh, unsigned short nonce,
               unsigned short interval);
 void send_hello_noupdate(struct interface *ifp, unsigned interval);
 void send_hello(struct interface *ifp);
+void send_probes(struct interface *ifp);
 void flush_unicast(int dofree);
 void send_update(struct interface *ifp, int urgent,
                  const unsigned char *prefix, unsigned char plen,
@@ -92,7 +96,7 @@ void send_multihop_request(struct interface *ifp,
                            unsigned char src_plen,
                            unsigned short seqno, const unsigned char *id,
                            unsigned short hop_count);
-void
+int
 send_unicast_multihop_request(struct neighbour *neigh,
                               const unsigned char *prefix, unsigned char plen,
                               const unsigned char *src_prefix,
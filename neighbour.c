@@ -39,6 +39,132 @@ THE SOFTWARE.
 
 struct neighbour *neighs = NULL;
 
+/* Neighbours are checked when something is due to happen to them, rather
+   than all at once.  This is a binary heap ordered by check_time. */
+static struct neighbour **check_heap = NULL;
+static int check_heap_size = 0, check_heap_max = 0;
+
+static void
+check_heap_set(int i, struct neighbour *neigh)
+{
+    check_heap[i] = neigh;
+    neigh->check_index = i;
+}
+
+static void
+check_heap_up(int i)
+{
+    struct neighbour *neigh = check_heap[i];
+
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(timeval_compare(&check_heap[parent]->check_time,
+                           &neigh->check_time) <= 0)
+            break;
+        check_heap_set(i, check_heap[parent]);
+        i = parent;
+    }
+    check_heap_set(i, neigh);
+}
+
+static void
+check_heap_down(int i)
+{
+    struct neighbour *neigh = check_heap[i];
+
+    while(1) {
+        int child = 2 * i + 1;
+        if(child >= check_heap_size)
+            break;
+        if(child + 1 < check_heap_size &&
+           timeval_compare(&check_heap[child + 1]->check_time,
+                           &check_heap[child]->check_time) < 0)
+            child++;
+        if(timeval_compare(&neigh->check_time,
+                           &check_heap[child]->check_time) <= 0)
+            break;
+        check_heap_set(i, check_heap[child]);
+        i = child;
+    }
+    check_heap_set(i, neigh);
+}
+
+static int
+check_heap_insert(struct neighbour *neigh)
+{
+    if(check_heap_size >= check_heap_max) {
+        int n = check_heap_max < 1 ? 8 : 2 * check_heap_max;
+        struct neighbour **new_heap =
+            realloc(check_heap, n * sizeof(struct neighbour*));
+        if(new_heap == NULL)
+            return -1;
+        check_heap = new_heap;
+        check_heap_max = n;
+    }
+    check_heap_set(check_heap_size++, neigh);
+    check_heap_up(neigh->check_index);
+    return 1;
+}
+
+static void
+check_heap_remove(struct neighbour *neigh)
+{
+    int i = neigh->check_index;
+    struct neighbour *last = check_heap[--check_heap_size];
+
+    if(i < check_heap_size) {
+        check_heap_set(i, last);
+        check_heap_up(i);
+        check_heap_down(last->check_index);
+    }
+}
+
+static void
+deadline_min(struct timeval *d, const struct timeval *time, unsigned msecs)
+{
+    struct timeval t;
+
+    if(time->tv_sec == 0)
+        return;
+    timeval_add_msec(&t, time, msecs);
+    if(timeval_compare(&t, &now) > 0)
+        timeval_min(d, &t);
+}
+
+/* Compute the next time at which something may happen to a neighbour
+   without any packet being received: a hello is considered missed, the
+   txcost is reset, or the rxcost, RTT or neighbour itself expire.  This
+   must be called whenever any of the timestamps involved change. */
+void
+reschedule_neighbour(struct neighbour *neigh)
+{
+    struct timeval d = {0, 0}, max;
+
+    if(neigh->hello.interval > 0)
+        deadline_min(&d, &neigh->hello.time, neigh->hello.interval * 17);
+    if(neigh->uhello.interval > 0)
+        deadline_min(&d, &neigh->uhello.time, neigh->uhello.interval * 17);
+    if((neigh->ifp->flags & IF_LQ))
+        deadline_min(&d, &neigh->hello.time, 40000);
+    deadline_min(&d, &neigh->hello.time, 180000);
+    deadline_min(&d, &neigh->uhello.time, 180000);
+    deadline_min(&d, &neigh->hello.time, 300000);
+    if(neigh->ihu_interval > 0) {
+        deadline_min(&d, &neigh->ihu_time, neigh->ihu_interval * 30);
+        deadline_min(&d, &neigh->ihu_time, neigh->ihu_interval * 100);
+    }
+    deadline_min(&d, &neigh->ihu_time, 180000);
+    deadline_min(&d, &neigh->rtt_time, 180000);
+
+    timeval_add_msec(&max, &now, 50000);
+    timeval_min(&d, &max);
+
+    neigh->check_time = d;
+    check_heap_up(neigh->check_index);
+    check_heap_down(neigh->check_index);
+    timeval_min(&check_neighbours_timeout, &neigh->check_time);
+}
+
 static struct neighbour *
 find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 {
@@ -67,6 +193,7 @@ flush_neighbour(struct neighbour *neigh)
             previous = previous->next;
         previous->next = neigh->next;
     }
+    check_heap_remove(neigh);
     local_notify_neighbour(neigh, LOCAL_FLUSH);
     free(neigh);
 }
@@ -91,13 +218,24 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     }
 
     neigh->hello.seqno = neigh->uhello.seqno = -1;
+    neigh->uhello_seqno = (random() & 0xFFFF);
+    neigh->hello_adapt_seqno = -1;
     memcpy(neigh->address, address, 16);
     neigh->txcost = INFINITY;
+    neigh->cost = INFINITY;
     neigh->ihu_time = now;
     neigh->hello.time = neigh->uhello.time = zero;
     neigh->hello_rtt_receive_time = zero;
     neigh->rtt_time = zero;
+    neigh->hello_adapt_rtt_time = zero;
     neigh->ifp = ifp;
+    neigh->check_time = now;
+    if(check_heap_insert(neigh) < 0) {
+        perror("malloc(neighbour)");
+        free(neigh);
+        return NULL;
+    }
+    reschedule_neighbour(neigh);
     neigh->next = neighs;
     neighs = neigh;
     local_notify_neighbour(neigh, LOCAL_ADD);
@@ -217,17 +355,32 @@ neighbour_txcost(struct neighbour *neigh)
     return neigh->txcost;
 }
 
-unsigned
+/* When fast probing, a neighbour that sends us probes is dead as soon
+   as the last probe_multiplier of them have been missed. */
+static int
+probe_failed(struct neighbour *neigh)
+{
+    unsigned short mask;
+
+    if(neigh->ifp->probe_interval == 0 || neigh->uhello.interval == 0 ||
+       neigh->uhello.seqno < 0)
+        return 0;
+
+    mask = 0xFFFF << (16 - neigh->ifp->probe_multiplier);
+    return (neigh->uhello.reach & mask) == 0;
+}
+
+void
 check_neighbours()
 {
     struct neighbour *neigh;
-    unsigned msecs = 50000;
 
     debugf("Checking neighbours.\n");
 
-    neigh = neighs;
-    while(neigh) {
+    while(check_heap_size > 0 &&
+          timeval_compare(&check_heap[0]->check_time, &now) <= 0) {
         int changed, rc;
+        neigh = check_heap[0];
         changed = update_neighbour(neigh, &neigh->hello, 0, -1, 0);
         rc = update_neighbour(neigh, &neigh->uhello, 1, -1, 0);
         changed = changed || rc;
@@ -235,27 +388,29 @@ check_neighbours()
         if(neigh->hello.reach == 0 ||
            neigh->hello.time.tv_sec > now.tv_sec || /* clock stepped */
            timeval_minus_msec(&now, &neigh->hello.time) > 300000) {
-            struct neighbour *old = neigh;
-            neigh = neigh->next;
-            flush_neighbour(old);
+            flush_neighbour(neigh);
+            continue;
+        }
+
+        if(probe_failed(neigh)) {
+            debugf("Lost probes from %s on %s.\n",
+                   format_address(neigh->address), neigh->ifp->name);
+            flush_neighbour(neigh);
             continue;
         }
 
         rc = reset_txcost(neigh);
         changed = changed || rc;
 
+        /* This also takes care of the cost decaying over time. */
         update_neighbour_metric(neigh, changed);
-
-        if(neigh->hello.interval > 0)
-            msecs = MIN(msecs, neigh->hello.interval * 10);
-        if(neigh->uhello.interval > 0)
-            msecs = MIN(msecs, neigh->uhello.interval * 10);
-        if(neigh->ihu_interval > 0)
-            msecs = MIN(msecs, neigh->ihu_interval * 10);
-        neigh = neigh->next;
+        reschedule_neighbour(neigh);
     }
 
-    return msecs;
+    if(check_heap_size > 0)
+        check_neighbours_timeout = check_heap[0]->check_time;
+    else
+        timeval_add_msec(&check_neighbours_timeout, &now, 50000);
 }
 
 /* To lose one hello is a misfortune, to lose two is carelessness. */
@@ -327,8 +482,8 @@ neighbour_rttcost(struct neighbour *neigh)
     }
 }
 
-unsigned
-neighbour_cost(struct neighbour *neigh)
+static unsigned
+compute_neighbour_cost(struct neighbour *neigh)
 {
     unsigned a, b, cost;
 
@@ -362,6 +517,25 @@ neighbour_cost(struct neighbour *neigh)
     return MIN(cost, INFINITY);
 }
 
+/* The cost is cached, since it is needed for every update received.  This
+   must be called whenever anything it depends on changes. */
+int
+update_neighbour_cost(struct neighbour *neigh)
+{
+    unsigned cost = compute_neighbour_cost(neigh);
+
+    if(cost == neigh->cost)
+        return 0;
+    neigh->cost = cost;
+    return 1;
+}
+
+unsigned
+neighbour_cost(struct neighbour *neigh)
+{
+    return neigh->cost;
+}
+
 int
 valid_rtt(struct neighbour *neigh)
 {
@@ -33,6 +33,9 @@ struct neighbour {
     unsigned char address[16];
     struct hello_history hello;
     struct hello_history uhello; /* for Unicast hellos */
+    unsigned short uhello_seqno; /* of the unicast hellos we send */
+    int hello_adapt_seqno;       /* see adapt_hello_interval */
+    struct timeval hello_adapt_rtt_time;
     unsigned short txcost;
     struct timeval ihu_time;
     unsigned short ihu_interval;   /* in centiseconds */
@@ -42,8 +45,17 @@ struct neighbour {
     unsigned int hello_send_us;
     struct timeval hello_rtt_receive_time;
     unsigned int rtt;
+    unsigned int rtt_var;       /* mean deviation of RTT samples */
     struct timeval rtt_time;
     struct interface *ifp;
+    unsigned short cost;        /* see update_neighbour_cost */
+    struct babel_route *routes; /* the routes through this neighbour */
+    struct timeval check_time;  /* when check_neighbours next looks at it */
+    int check_index;            /* position in the check heap */
+    /* Multi-hop requests, see check_request_bucket. */
+    time_t request_bucket_time;
+    int request_bucket;
+    unsigned int requests_received, requests_sent, requests_limited;
 };
 
 extern struct neighbour *neighs;
@@ -57,9 +69,11 @@ struct neighbour *find_neighbour(const unsigned char *address,
                                  struct interface *ifp);
 int update_neighbour(struct neighbour *neigh, struct hello_history *hist,
                      int unicast, int hello, int hello_interval);
-unsigned check_neighbours(void);
+void reschedule_neighbour(struct neighbour *neigh);
+void check_neighbours(void);
 unsigned neighbour_txcost(struct neighbour *neigh);
 unsigned neighbour_rxcost(struct neighbour *neigh);
 unsigned neighbour_rttcost(struct neighbour *neigh);
 unsigned neighbour_cost(struct neighbour *neigh);
+int update_neighbour_cost(struct neighbour *neigh);
 int valid_rtt(struct neighbour *neigh);
@@ -36,6 +36,60 @@ THE SOFTWARE.
 struct timeval resend_time = {0, 0};
 struct resend *to_resend = NULL;
 
+/* Requests that were not sent because an equivalent one was pending. */
+unsigned int request_duplicates = 0;
+
+/* The entries of to_resend are also hashed by kind and destination, so
+   that checking for a pending request or update doesn't need to walk the
+   whole list.  The size of the table is a power of two. */
+static struct resend **resend_hash = NULL;
+static int resend_hash_size = 0, num_resends = 0;
+
+static unsigned int
+resend_hash_key(int kind, const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        h = (h ^ prefix[i]) * 16777619U;
+    h = (h ^ plen) * 16777619U;
+    for(i = 0; i < 16; i++)
+        h = (h ^ src_prefix[i]) * 16777619U;
+    h = (h ^ src_plen) * 16777619U;
+    return h ^ kind;
+}
+
+static struct resend **
+resend_bucket(struct resend **table, int size, const struct resend *resend)
+{
+    unsigned int h = resend_hash_key(resend->kind,
+                                     resend->prefix, resend->plen,
+                                     resend->src_prefix, resend->src_plen);
+    return &table[h & (size - 1)];
+}
+
+static int
+resend_hash_resize(int size)
+{
+    struct resend **table, *resend, **bucket;
+
+    table = calloc(size, sizeof(struct resend*));
+    if(table == NULL)
+        return -1;
+
+    for(resend = to_resend; resend; resend = resend->next) {
+        bucket = resend_bucket(table, size, resend);
+        resend->hash_next = *bucket;
+        *bucket = resend;
+    }
+    free(resend_hash);
+    resend_hash = table;
+    resend_hash_size = size;
+    return 1;
+}
+
 static int
 resend_match(struct resend *resend,
              int kind, const unsigned char *prefix, unsigned char plen,
@@ -57,21 +111,20 @@ flush_resends(struct neighbour *neigh)
 
 static struct resend *
 find_resend(int kind, const unsigned char *prefix, unsigned char plen,
-            const unsigned char *src_prefix, unsigned char src_plen,
-            struct resend **previous_return)
+            const unsigned char *src_prefix, unsigned char src_plen)
 {
-    struct resend *current, *previous;
+    struct resend *current;
+    unsigned int h;
 
-    previous = NULL;
-    current = to_resend;
+    if(resend_hash_size == 0)
+        return NULL;
+
+    h = resend_hash_key(kind, prefix, plen, src_prefix, src_plen);
+    current = resend_hash[h & (resend_hash_size - 1)];
     while(current) {
-        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen)) {
-            if(previous_return)
-                *previous_return = previous;
+        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen))
             return current;
-        }
-        previous = current;
-        current = current->next;
+        current = current->hash_next;
     }
 
     return NULL;
@@ -79,11 +132,9 @@ find_resend(int kind, const unsigned char *prefix, unsigned char plen,
 
 struct resend *
 find_request(const unsigned char *prefix, unsigned char plen,
-             const unsigned char *src_prefix, unsigned char src_plen,
-             struct resend **previous_return)
+             const unsigned char *src_prefix, unsigned char src_plen)
 {
-    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen,
-                       previous_return);
+    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen);
 }
 
 int
@@ -107,7 +158,7 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
     if(delay >= 0xFFFF)
         delay = 0xFFFF;
 
-    resend = find_resend(kind, prefix, plen, src_prefix, src_plen, NULL);
+    resend = find_resend(kind, prefix, plen, src_prefix, src_plen);
     if(resend) {
         if(resend->delay && delay)
             resend->delay = MIN(resend->delay, delay);
@@ -127,6 +178,12 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         if(resend->ifp != ifp)
             resend->ifp = NULL;
     } else {
+        struct resend **bucket;
+        if(num_resends >= resend_hash_size) {
+            int rc = resend_hash_resize(MAX(2 * resend_hash_size, 64));
+            if(rc < 0 && resend_hash_size == 0)
+                return -1;
+        }
         resend = calloc(1, sizeof(struct resend));
         if(resend == NULL)
             return -1;
@@ -144,6 +201,10 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         resend->time = now;
         resend->next = to_resend;
         to_resend = resend;
+        bucket = resend_bucket(resend_hash, resend_hash_size, resend);
+        resend->hash_next = *bucket;
+        *bucket = resend;
+        num_resends++;
     }
 
     if(resend->delay) {
@@ -172,7 +233,7 @@ unsatisfied_request(const unsigned char *prefix, unsigned char plen,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -183,6 +244,30 @@ unsatisfied_request(const unsigned char *prefix, unsigned char plen,
     return 0;
 }
 
+/* Determine whether a request for a given seqno would duplicate one that
+   we sent recently or that will be resent. */
+int
+request_pending(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen,
+                unsigned short seqno, const unsigned char *id)
+{
+    struct resend *request;
+
+    request = find_request(prefix, plen, src_prefix, src_plen);
+    if(request == NULL || resend_expired(request))
+        return 0;
+
+    if(memcmp(request->id, id, 8) != 0 ||
+       seqno_compare(request->seqno, seqno) < 0)
+        return 0;
+
+    if(request->max > 0 && request->delay > 0)
+        /* Will be resent. */
+        return 1;
+
+    return timeval_minus_msec(&now, &request->time) < 1000;
+}
+
 /* Determine whether a given request should be forwarded. */
 int
 request_redundant(struct interface *ifp,
@@ -192,7 +277,7 @@ request_redundant(struct interface *ifp,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -221,9 +306,9 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
                 unsigned short seqno, const unsigned char *id,
                 struct interface *ifp)
 {
-    struct resend *request, *previous;
+    struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, &previous);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL)
         return 0;
 
@@ -243,6 +328,17 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
     return 0;
 }
 
+static void
+resend_unhash(struct resend *resend)
+{
+    struct resend **bucket = resend_bucket(resend_hash, resend_hash_size,
+                                           resend);
+    while(*bucket != resend)
+        bucket = &(*bucket)->hash_next;
+    *bucket = resend->hash_next;
+    num_resends--;
+}
+
 void
 expire_resend()
 {
@@ -253,6 +349,7 @@ expire_resend()
     current = to_resend;
     while(current) {
         if(resend_expired(current)) {
+            resend_unhash(current);
             if(previous == NULL) {
                 to_resend = current->next;
                 free(current);
@@ -39,13 +39,14 @@ struct resend {
     unsigned char id[8];
     struct interface *ifp;
     struct resend *next;
+    struct resend *hash_next;   /* next in the same bucket of resend_hash */
 };
 
 extern struct timeval resend_time;
+extern unsigned int request_duplicates;
 
 struct resend *find_request(const unsigned char *prefix, unsigned char plen,
-                    const unsigned char *src_prefix, unsigned char src_plen,
-                    struct resend **previous_return);
+                    const unsigned char *src_prefix, unsigned char src_plen);
 void flush_resends(struct neighbour *neigh);
 int record_resend(int kind, const unsigned char *prefix, unsigned char plen,
                   const unsigned char *src_prefix, unsigned char src_plen,
@@ -54,6 +55,9 @@ int record_resend(int kind, const unsigned char *prefix, unsigned char plen,
 int unsatisfied_request(const unsigned char *prefix, unsigned char plen,
                         const unsigned char *src_prefix, unsigned char src_plen,
                         unsigned short seqno, const unsigned char *id);
+int request_pending(const unsigned char *prefix, unsigned char plen,
+                    const unsigned char *src_prefix, unsigned char src_plen,
+                    unsigned short seqno, const unsigned char *id);
 int request_redundant(struct interface *ifp,
                       const unsigned char *prefix, unsigned char plen,
                       const unsigned char *src_prefix, unsigned char src_plen,
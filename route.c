@@ -43,35 +43,58 @@ THE SOFTWARE.
 
 struct babel_route **routes = NULL;
 static int route_slots = 0, max_route_slots = 0;
+
+/* The result of find_best_route for each slot, indexed like routes and
+   by feasible.  Unless a route changes, feasibility can only decrease
+   until a source is garbage-collected, and smoothed metrics only change
+   when now.tv_sec does and some metric has not converged yet.  So a
+   cached route remains the best as long as it is still acceptable,
+   during the second it was computed in or, if all metrics had
+   converged, until the first source expires. */
+struct route_choice {
+    struct babel_route *route;  /* NULL if there is no acceptable route */
+    unsigned short metric;      /* its smoothed metric */
+    unsigned char valid;
+    time_t time, until;
+};
+struct route_cache {
+    struct route_choice choice[2];
+};
+static struct route_cache *route_caches = NULL;
+
+/* The first specific_route_slots slots hold source-specific routes. */
+static int specific_route_slots = 0;
 int kernel_metric = 0, reflect_kernel_metric = 0;
 int allow_duplicates = -1;
 int diversity_kind = DIVERSITY_NONE;
 int diversity_factor = 256;     /* in units of 1/256 */
+int ecmp_tolerance = -1;        /* negative to disable multipath */
+
+/* How much worse than required to join the multipath set a route must
+   get before it leaves it. */
+#define ECMP_HYSTERESIS 16
 
 static int smoothing_half_life = 0;
-static int two_to_the_one_over_hl = 0; /* 2^(1/hl) * 0x10000 */
 
-static int
-check_specific_first(void)
-{
-    /* All source-specific routes are in front of the list */
-    int specific = 1;
-    int i;
-    for(i = 0; i < route_slots; i++) {
-        if(is_default(routes[i]->src->src_prefix, routes[i]->src->src_plen)) {
-            specific = 0;
-        } else if(!specific) {
-            return 0;
-        }
-    }
-    return 1;
-}
+/* 2^(-i/64) * 0x10000, used to compute the decay of the smoothed metric. */
+static const unsigned int two_to_the_minus[64] = {
+    65536, 64830, 64132, 63441, 62757, 62081, 61413, 60751,
+    60097, 59449, 58809, 58176, 57549, 56929, 56316, 55709,
+    55109, 54515, 53928, 53347, 52773, 52204, 51642, 51085,
+    50535, 49991, 49452, 48920, 48393, 47871, 47356, 46846,
+    46341, 45842, 45348, 44859, 44376, 43898, 43425, 42958,
+    42495, 42037, 41584, 41136, 40693, 40255, 39821, 39392,
+    38968, 38548, 38133, 37722, 37316, 36914, 36516, 36123,
+    35734, 35349, 34968, 34591, 34219, 33850, 33486, 33125,
+};
 
 /* We maintain a list of "slots", ordered by prefix.  Every slot
    contains a linked list of the routes to this prefix, with the
-   installed route, if any, at the head of the list. */
+   installed route, if any, at the head of the list.  Source-specific
+   slots sort before all others, so that they form a prefix of the
+   list of length specific_route_slots. */
 
-static int
+int
 route_compare(const unsigned char *prefix, unsigned char plen,
               const unsigned char *src_prefix, unsigned char src_plen,
               struct babel_route *route)
@@ -144,6 +167,28 @@ find_route_slot(const unsigned char *prefix, unsigned char plen,
     return -1;
 }
 
+/* Returns the slot that follows the given destination in the table, or
+   the first slot if prefix is NULL.  Since it only depends on the
+   destination, it can be used to walk the table incrementally while it
+   is being modified. */
+
+struct babel_route *
+next_route_slot(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen)
+{
+    int i, n;
+
+    if(prefix == NULL) {
+        n = 0;
+    } else {
+        i = find_route_slot(prefix, plen, src_prefix, src_plen, &n);
+        if(i >= 0)
+            n = i + 1;
+    }
+
+    return n < route_slots ? routes[n] : NULL;
+}
+
 struct babel_route *
 find_route(const unsigned char *prefix, unsigned char plen,
            const unsigned char *src_prefix, unsigned char src_plen,
@@ -189,22 +234,95 @@ static int
 resize_route_table(int new_slots)
 {
     struct babel_route **new_routes;
+    struct route_cache *new_caches;
     assert(new_slots >= route_slots);
 
     if(new_slots == 0) {
         new_routes = NULL;
         free(routes);
+        new_caches = NULL;
+        free(route_caches);
     } else {
         new_routes = realloc(routes, new_slots * sizeof(struct babel_route*));
         if(new_routes == NULL)
             return -1;
+        routes = new_routes;
+        new_caches = realloc(route_caches,
+                             new_slots * sizeof(struct route_cache));
+        if(new_caches == NULL)
+            return -1;
     }
 
     max_route_slots = new_slots;
     routes = new_routes;
+    route_caches = new_caches;
+    return 1;
+}
+
+static int
+route_acceptable(struct babel_route *route, int feasible,
+                 struct neighbour *exclude)
+{
+    if(route_expired(route))
+        return 0;
+    if(feasible && !route_feasible(route))
+        return 0;
+    if(exclude && route->neigh == exclude)
+        return 0;
     return 1;
 }
 
+static int
+route_choice_valid(struct route_choice *choice)
+{
+    return choice->valid &&
+        (choice->time == now.tv_sec ||
+         (choice->time < now.tv_sec && now.tv_sec <= choice->until));
+}
+
+/* Update the validity period of a cached choice to account for route. */
+static void
+route_choice_limit(struct route_choice *choice, struct babel_route *route)
+{
+    if(route_smoothed_metric(route) != route_metric(route)) {
+        choice->time = now.tv_sec;
+        choice->until = now.tv_sec;
+    }
+    choice->until = MIN(choice->until, route->src->time + SOURCE_GC_TIME);
+}
+
+/* Called when a route in slot i was added or changed. */
+static void
+route_cache_changed(int i, struct babel_route *route)
+{
+    int f;
+
+    for(f = 0; f <= 1; f++) {
+        struct route_choice *choice = &route_caches[i].choice[f];
+        int acceptable, metric;
+
+        if(!route_choice_valid(choice)) {
+            choice->valid = 0;
+            continue;
+        }
+
+        route_choice_limit(choice, route);
+        acceptable = route_acceptable(route, f, NULL);
+        metric = route_smoothed_metric(route);
+        if(choice->route == route) {
+            if(acceptable && metric <= choice->metric)
+                choice->metric = metric;
+            else
+                /* It may have become worse than another route. */
+                choice->valid = 0;
+        } else if(acceptable &&
+                  (choice->route == NULL || metric < choice->metric)) {
+            choice->route = route;
+            choice->metric = metric;
+        }
+    }
+}
+
 /* Insert a route into the table.  If successful, retains the route.
    On failure, caller must free the route. */
 static struct babel_route *
@@ -223,11 +341,19 @@ insert_route(struct babel_route *route)
         if(route_slots >= max_route_slots)
             return NULL;
         route->next = NULL;
-        if(n < route_slots)
+        if(n < route_slots) {
             memmove(routes + n + 1, routes + n,
                     (route_slots - n) * sizeof(struct babel_route*));
+            memmove(route_caches + n + 1, route_caches + n,
+                    (route_slots - n) * sizeof(struct route_cache));
+        }
         route_slots++;
         routes[n] = route;
+        memset(&route_caches[n], 0, sizeof(struct route_cache));
+        if(!is_default(route->src->src_prefix, route->src->src_plen)) {
+            assert(n <= specific_route_slots);
+            specific_route_slots++;
+        }
     } else {
         struct babel_route *r;
         r = routes[i];
@@ -235,11 +361,134 @@ insert_route(struct babel_route *route)
             r = r->next;
         r->next = route;
         route->next = NULL;
+        route_cache_changed(i, route);
     }
 
+    route->neigh_prev = NULL;
+    route->neigh_next = route->neigh->routes;
+    if(route->neigh_next)
+        route->neigh_next->neigh_prev = route;
+    route->neigh->routes = route;
+
     return route;
 }
 
+/* Multipath.  If ecmp_tolerance is not negative, feasible routes whose
+   smoothed metric is within ecmp_tolerance of that of the installed route
+   are used as additional nexthops of its kernel route, and have their
+   multipath flag set.  The installed route remains the only one that we
+   announce.  The other kernel operations only deal with single-path
+   routes, so the set is collapsed before any of them is applied to the
+   installed route, and recomputed by update_multipath afterwards. */
+
+static int
+sync_multipath(int i)
+{
+    struct babel_route *others[KERNEL_MAX_NEXTHOPS - 1];
+    struct babel_route *r;
+    int n = 0, rc;
+
+    for(r = routes[i]->next; r; r = r->next) {
+        if(r->multipath && n < KERNEL_MAX_NEXTHOPS - 1)
+            others[n++] = r;
+    }
+
+    rc = kchange_route_nexthops(routes[i], others, n);
+    if(rc < 0) {
+        int enosys = errno == ENOSYS;
+        for(r = routes[i]->next; r; r = r->next)
+            r->multipath = 0;
+        if(enosys) {
+            fprintf(stderr, "Multipath routes not supported, "
+                    "disabling ECMP.\n");
+            ecmp_tolerance = -1;
+        } else if(n > 0) {
+            kchange_route_nexthops(routes[i], NULL, 0);
+        }
+    }
+    return rc;
+}
+
+static void
+collapse_multipath(struct babel_route *route)
+{
+    struct babel_route *r;
+    int i, n = 0;
+
+    if(ecmp_tolerance < 0)
+        return;
+
+    i = find_route_slot(route->src->prefix, route->src->plen,
+                        route->src->src_prefix, route->src->src_plen, NULL);
+    if(i < 0 || !routes[i]->installed)
+        return;
+
+    for(r = routes[i]->next; r; r = r->next) {
+        if(r->multipath) {
+            r->multipath = 0;
+            n++;
+        }
+    }
+
+    if(n > 0)
+        sync_multipath(i);
+}
+
+/* Whether the nexthop of route is already used by the installed route
+   or by a member of the multipath set that precedes it. */
+static int
+multipath_duplicate(int i, struct babel_route *route)
+{
+    struct babel_route *r;
+
+    for(r = routes[i]; r != route; r = r->next) {
+        if((r->installed || r->multipath) &&
+           r->neigh->ifp == route->neigh->ifp &&
+           memcmp(r->nexthop, route->nexthop, 16) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Recompute the multipath set of slot i, and update the kernel route if
+   it changed. */
+static void
+update_multipath(int i)
+{
+    struct babel_route *installed, *r;
+    int metric, n = 0, changed = 0;
+
+    if(ecmp_tolerance < 0 || i < 0)
+        return;
+
+    installed = routes[i];
+    if(!installed->installed ||
+       !is_default(installed->src->src_prefix, installed->src->src_plen))
+        return;
+
+    metric = route_smoothed_metric(installed);
+    for(r = installed->next; r; r = r->next) {
+        int threshold =
+            metric + ecmp_tolerance + (r->multipath ? ECMP_HYSTERESIS : 0);
+        int member =
+            n < KERNEL_MAX_NEXTHOPS - 1 &&
+            route_metric(installed) < INFINITY &&
+            route_metric(r) < INFINITY &&
+            !route_expired(r) && route_feasible(r) &&
+            route_smoothed_metric(r) <= threshold &&
+            !multipath_duplicate(i, r);
+        if(member)
+            n++;
+        if(member != r->multipath) {
+            r->multipath = member;
+            changed = 1;
+        }
+    }
+
+    if(changed)
+        sync_multipath(i);
+}
+
 static void
 destroy_route(struct babel_route *route)
 {
@@ -267,17 +516,39 @@ flush_route(struct babel_route *route)
                         route->src->src_prefix, route->src->src_plen, NULL);
     assert(i >= 0 && i < route_slots);
 
+    if(route->multipath) {
+        route->multipath = 0;
+        sync_multipath(i);
+    }
+
     local_notify_route(route, LOCAL_FLUSH);
 
+    if(route_caches[i].choice[0].route == route)
+        route_caches[i].choice[0].valid = 0;
+    if(route_caches[i].choice[1].route == route)
+        route_caches[i].choice[1].valid = 0;
+
+    if(route->neigh_prev)
+        route->neigh_prev->neigh_next = route->neigh_next;
+    else
+        route->neigh->routes = route->neigh_next;
+    if(route->neigh_next)
+        route->neigh_next->neigh_prev = route->neigh_prev;
+
     if(route == routes[i]) {
         routes[i] = route->next;
         route->next = NULL;
         destroy_route(route);
 
         if(routes[i] == NULL) {
-            if(i < route_slots - 1)
+            if(i < specific_route_slots)
+                specific_route_slots--;
+            if(i < route_slots - 1) {
                 memmove(routes + i, routes + i + 1,
                         (route_slots - i - 1) * sizeof(struct babel_route*));
+                memmove(route_caches + i, route_caches + i + 1,
+                        (route_slots - i - 1) * sizeof(struct route_cache));
+            }
             routes[route_slots - 1] = NULL;
             route_slots--;
             VALGRIND_MAKE_MEM_UNDEFINED(routes + route_slots, sizeof(struct route *));
@@ -307,6 +578,10 @@ flush_all_routes()
 {
     int i;
 
+    /* Settle pending changes first, so that nothing refers to the
+       routes' sources once they are flushed. */
+    process_route_changes();
+
     /* Start from the end, to avoid shifting the table. */
     i = route_slots - 1;
     while(i >= 0) {
@@ -325,23 +600,8 @@ flush_all_routes()
 void
 flush_neighbour_routes(struct neighbour *neigh)
 {
-    int i;
-
-    i = 0;
-    while(i < route_slots) {
-        struct babel_route *r;
-        r = routes[i];
-        while(r) {
-            if(r->neigh == neigh) {
-                flush_route(r);
-                goto again;
-            }
-            r = r->next;
-        }
-        i++;
-    again:
-        ;
-    }
+    while(neigh->routes)
+        flush_route(neigh->routes);
 }
 
 void
@@ -379,9 +639,6 @@ route_stream(int which)
 {
     struct route_stream *stream;
 
-    if(!check_specific_first())
-        fprintf(stderr, "Invariant failed: specific routes first in RIB.\n");
-
     stream = calloc(1, sizeof(struct route_stream));
     if(stream == NULL)
         return NULL;
@@ -397,17 +654,12 @@ struct babel_route *
 route_stream_next(struct route_stream *stream)
 {
     if(stream->installed) {
-        while(stream->index < route_slots)
-            if(stream->installed == ROUTE_SS_INSTALLED &&
-               is_default(routes[stream->index]->src->src_prefix,
-                          routes[stream->index]->src->src_plen))
-                return NULL;
-            else if(routes[stream->index]->installed)
-                break;
-            else
-                stream->index++;
+        int slots = stream->installed == ROUTE_SS_INSTALLED ?
+            specific_route_slots : route_slots;
+        while(stream->index < slots && !routes[stream->index]->installed)
+            stream->index++;
 
-        if(stream->index < route_slots)
+        if(stream->index < slots)
             return routes[stream->index++];
         else
             return NULL;
@@ -500,6 +752,8 @@ uninstall_route(struct babel_route *route)
     if(!route->installed)
         return;
 
+    collapse_multipath(route);
+
     route->installed = 0;
 
     kuninstall_route(route);
@@ -528,6 +782,8 @@ switch_routes(struct babel_route *old, struct babel_route *new)
         fprintf(stderr, "WARNING: switching to unfeasible route "
                 "(this shouldn't happen).");
 
+    collapse_multipath(old);
+
     rc = kswitch_routes(old, new);
     if(rc < 0)
         return;
@@ -546,7 +802,7 @@ static void
 change_route_metric(struct babel_route *route,
                     unsigned refmetric, unsigned cost, unsigned add)
 {
-    int old, new;
+    int old, new, i;
     int newmetric = MIN(refmetric + cost + add, INFINITY);
 
     old = metric_to_kernel(route_metric(route));
@@ -554,6 +810,7 @@ change_route_metric(struct babel_route *route,
 
     if(route->installed && old != new) {
         int rc;
+        collapse_multipath(route);
         rc = kchange_route_metric(route, refmetric, cost, add);
         if(rc < 0)
             return;
@@ -571,6 +828,11 @@ change_route_metric(struct babel_route *route,
         route->smoothed_metric_time = now.tv_sec;
     }
 
+    i = find_route_slot(route->src->prefix, route->src->plen,
+                        route->src->src_prefix, route->src->src_plen, NULL);
+    if(i >= 0)
+        route_cache_changed(i, route);
+
     local_notify_route(route, LOCAL_CHANGE);
 }
 
@@ -661,21 +923,12 @@ update_feasible(struct source *src,
 void
 change_smoothing_half_life(int half_life)
 {
-    if(half_life <= 0) {
-        smoothing_half_life = 0;
-        two_to_the_one_over_hl = 0;
-        return;
-    }
+    int i;
 
-    smoothing_half_life = half_life;
-    switch(smoothing_half_life) {
-    case 1: two_to_the_one_over_hl = 131072; break;
-    case 2: two_to_the_one_over_hl = 92682; break;
-    case 3: two_to_the_one_over_hl = 82570; break;
-    case 4: two_to_the_one_over_hl = 77935; break;
-    default:
-        /* 2^(1/x) is 1 + log(2)/x + O(1/x^2) at infinity. */
-        two_to_the_one_over_hl = 0x10000 + 45426 / half_life;
+    smoothing_half_life = MAX(half_life, 0);
+    for(i = 0; i < route_slots; i++) {
+        route_caches[i].choice[0].valid = 0;
+        route_caches[i].choice[1].valid = 0;
     }
 }
 
@@ -691,25 +944,41 @@ route_smoothed_metric(struct babel_route *route)
        route->smoothed_metric == metric) {         /* already converged */
         route->smoothed_metric = metric;
         route->smoothed_metric_time = now.tv_sec;
+        route->smoothed_metric_carry = 0;
+    } else if(now.tv_sec - route->smoothed_metric_time >=
+              16 * smoothing_half_life) {
+        /* Less than 2^-16 of the difference remains. */
+        route->smoothed_metric = metric;
+        route->smoothed_metric_time = now.tv_sec;
+        route->smoothed_metric_carry = 0;
     } else {
-        int diff;
-        /* We randomise the computation, to minimise global synchronisation
-           and hence oscillations. */
-        while(route->smoothed_metric_time <= now.tv_sec - smoothing_half_life) {
+        int diff, decay, k;
+        unsigned remain;
+        long long steps;
+        /* The difference decays by 2^(-t/hl) after t seconds, which we
+           apply in steps of hl/64.  The time that doesn't make up a whole
+           step is carried over (in 1/64 s), lest frequent calls slow
+           down the decay. */
+        steps = (long long)(now.tv_sec - route->smoothed_metric_time) * 64 +
+            route->smoothed_metric_carry;
+        k = steps / smoothing_half_life;
+        route->smoothed_metric_carry = steps % smoothing_half_life;
+        route->smoothed_metric_time = now.tv_sec;
+
+        if(k > 0) {
+            remain = two_to_the_minus[k % 64] >> (k / 64);
             diff = metric - route->smoothed_metric;
-            route->smoothed_metric += roughly(diff) / 2;
-            route->smoothed_metric_time += smoothing_half_life;
-        }
-        while(route->smoothed_metric_time < now.tv_sec) {
+            /* We randomise the decay, to minimise global synchronisation
+               and hence oscillations, but never overshoot. */
+            decay = roughly(diff - (int)((long long)diff * remain / 0x10000));
+            if(diff > 0 ? decay > diff : decay < diff)
+                decay = diff;
+            route->smoothed_metric += decay;
+
             diff = metric - route->smoothed_metric;
-            route->smoothed_metric +=
-                roughly(diff) * (two_to_the_one_over_hl - 0x10000) / 0x10000;
-            route->smoothed_metric_time++;
+            if(diff > -4 && diff < 4)
+                route->smoothed_metric = metric;
         }
-
-        diff = metric - route->smoothed_metric;
-        if(diff > -4 && diff < 4)
-            route->smoothed_metric = metric;
     }
 
     /* change_route_metric relies on this */
@@ -717,19 +986,6 @@ route_smoothed_metric(struct babel_route *route)
     return route->smoothed_metric;
 }
 
-static int
-route_acceptable(struct babel_route *route, int feasible,
-                 struct neighbour *exclude)
-{
-    if(route_expired(route))
-        return 0;
-    if(feasible && !route_feasible(route))
-        return 0;
-    if(exclude && route->neigh == exclude)
-        return 0;
-    return 1;
-}
-
 /* Find the best route according to the weak ordering.  Any
    linearisation of the strong ordering (see consider_route) will do,
    we use sm <= sm'.  We could probably use a lexical ordering, but
@@ -741,24 +997,48 @@ find_best_route(const unsigned char *prefix, unsigned char plen,
                 int feasible, struct neighbour *exclude)
 {
     struct babel_route *route, *r;
+    struct route_choice *choice;
     int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
 
     if(i < 0)
         return NULL;
 
+    choice = &route_caches[i].choice[!!feasible];
+    if(route_choice_valid(choice)) {
+        route = choice->route;
+        if(route == NULL)
+            return NULL;
+        if(route_acceptable(route, feasible, NULL)) {
+            /* The best route is also the best non-excluded one. */
+            if(!exclude || route->neigh != exclude)
+                return route;
+        } else {
+            choice->valid = 0;
+        }
+    }
+
     route = routes[i];
     while(route && !route_acceptable(route, feasible, exclude))
         route = route->next;
 
-    if(!route)
-        return NULL;
+    if(route) {
+        r = route->next;
+        while(r) {
+            if(route_acceptable(r, feasible, exclude) &&
+               (route_smoothed_metric(r) < route_smoothed_metric(route)))
+                route = r;
+            r = r->next;
+        }
+    }
 
-    r = route->next;
-    while(r) {
-        if(route_acceptable(r, feasible, exclude) &&
-           (route_smoothed_metric(r) < route_smoothed_metric(route)))
-            route = r;
-        r = r->next;
+    if(!exclude) {
+        choice->route = route;
+        choice->metric = route ? route_smoothed_metric(route) : 0;
+        choice->valid = 1;
+        choice->time = now.tv_sec;
+        choice->until = now.tv_sec + SOURCE_GC_TIME;
+        for(r = routes[i]; r; r = r->next)
+            route_choice_limit(choice, r);
     }
 
     return route;
@@ -779,12 +1059,19 @@ update_route_metric(struct babel_route *route)
         }
     } else {
         struct neighbour *neigh = route->neigh;
-        int add_metric = input_filter(route->src->id,
+        int add_metric;
+        if(route->filter_generation == filter_generation) {
+            add_metric = route->filter_metric;
+        } else {
+            add_metric = input_filter(route->src->id,
                                       route->src->prefix, route->src->plen,
                                       route->src->src_prefix,
                                       route->src->src_plen,
                                       neigh->address,
                                       neigh->ifp->ifindex);
+            route->filter_metric = add_metric;
+            route->filter_generation = filter_generation;
+        }
         change_route_metric(route, route->refmetric,
                             neighbour_cost(route->neigh), add_metric);
         if(route_metric(route) != oldmetric ||
@@ -793,40 +1080,33 @@ update_route_metric(struct babel_route *route)
     }
 }
 
-/* Called whenever a neighbour's cost changes, to update the metric of
-   all routes through that neighbour.  Calls local_notify_neighbour. */
+/* Called whenever something that a neighbour's cost depends on may have
+   changed.  If the cost did change, updates the metric of the routes
+   through that neighbour.  Changed is true if something else visible
+   to monitoring clients may have changed. */
 void
 update_neighbour_metric(struct neighbour *neigh, int changed)
 {
+    struct babel_route *r;
 
-    if(changed) {
-        int i;
-
-        for(i = 0; i < route_slots; i++) {
-            struct babel_route *r = routes[i];
-            while(r) {
-                if(r->neigh == neigh)
-                    update_route_metric(r);
-                r = r->next;
-            }
-        }
+    if(update_neighbour_cost(neigh)) {
+        for(r = neigh->routes; r; r = r->neigh_next)
+            update_route_metric(r);
+        changed = 1;
     }
 
-    local_notify_neighbour(neigh, LOCAL_CHANGE);
+    if(changed)
+        local_notify_neighbour(neigh, LOCAL_CHANGE);
 }
 
 void
 update_interface_metric(struct interface *ifp)
 {
-    int i;
+    struct neighbour *neigh;
 
-    for(i = 0; i < route_slots; i++) {
-        struct babel_route *r = routes[i];
-        while(r) {
-            if(r->neigh->ifp == ifp)
-                update_route_metric(r);
-            r = r->next;
-        }
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp == ifp)
+            update_neighbour_metric(neigh, 1);
     }
 }
 
@@ -860,13 +1140,19 @@ update_route(const unsigned char *id,
     if(is_v4 != v4mapped(src_prefix))
         return NULL;
 
-    add_metric = input_filter(id, prefix, plen, src_prefix, src_plen,
-                              neigh->address, neigh->ifp->ifindex);
+    route = find_route(prefix, plen, src_prefix, src_plen, neigh, nexthop);
+
+    /* The verdict only depends on the neighbour, which is part of the
+       route, and on the router-id, which the route may not share. */
+    if(route && route->filter_generation == filter_generation &&
+       memcmp(route->src->id, id, 8) == 0)
+        add_metric = route->filter_metric;
+    else
+        add_metric = input_filter(id, prefix, plen, src_prefix, src_plen,
+                                  neigh->address, neigh->ifp->ifindex);
     if(add_metric >= INFINITY)
         return NULL;
 
-    route = find_route(prefix, plen, src_prefix, src_plen, neigh, nexthop);
-
     if(route && memcmp(route->src->id, id, 8) == 0)
         /* Avoid scanning the source table. */
         src = route->src;
@@ -906,6 +1192,8 @@ update_route(const unsigned char *id,
         }
 
         route->src = retain_source(src);
+        route->filter_metric = add_metric;
+        route->filter_generation = filter_generation;
         if(refmetric < INFINITY)
             route->time = now.tv_sec;
         route->seqno = seqno;
@@ -964,6 +1252,8 @@ update_route(const unsigned char *id,
         route->refmetric = refmetric;
         route->cost = neighbour_cost(neigh);
         route->add_metric = add_metric;
+        route->filter_metric = add_metric;
+        route->filter_generation = filter_generation;
         route->seqno = seqno;
         route->neigh = neigh;
         memcpy(route->nexthop, nexthop, 16);
@@ -971,6 +1261,7 @@ update_route(const unsigned char *id,
         route->hold_time = hold_time;
         route->smoothed_metric = MAX(route_metric(route), INFINITY / 2);
         route->smoothed_metric_time = now.tv_sec;
+        route->smoothed_metric_carry = 0;
         if(channels_len > 0) {
             route->channels = malloc(channels_len);
             if(route->channels == NULL) {
@@ -987,7 +1278,7 @@ update_route(const unsigned char *id,
             return NULL;
         }
         local_notify_route(route, LOCAL_ADD);
-        consider_route(route);
+        route_changed(route, NULL, INFINITY);
     }
     return route;
 }
@@ -1009,15 +1300,214 @@ send_unfeasible_request(struct neighbour *neigh, int force,
     }
 
     if(force || !route || route_metric(route) >= metric + 512) {
-        send_unicast_multihop_request(neigh, src->prefix, src->plen,
-                                      src->src_prefix, src->src_plen,
-                                      src->metric >= INFINITY ?
-                                      src->seqno :
-                                      seqno_plus(src->seqno, 1),
-                                      src->id, 127);
+        unsigned short request_seqno =
+            src->metric >= INFINITY ? src->seqno : seqno_plus(src->seqno, 1);
+        int rc;
+
+        /* Every unfeasible update would otherwise trigger its own
+           request. */
+        if(request_pending(src->prefix, src->plen,
+                           src->src_prefix, src->src_plen,
+                           request_seqno, src->id)) {
+            request_duplicates++;
+            return;
+        }
+
+        rc = send_unicast_multihop_request(neigh, src->prefix, src->plen,
+                                           src->src_prefix, src->src_plen,
+                                           request_seqno, src->id, 127);
+        if(rc > 0)
+            record_resend(RESEND_REQUEST, src->prefix, src->plen,
+                          src->src_prefix, src->src_plen,
+                          request_seqno, src->id, neigh->ifp, 0);
     }
 }
 
+/* Flap damping, after RFC 2439.  Whenever the selected route to a
+   destination is lost or replaced, the destination accrues a penalty
+   that decays with a half-life of damping_half_life seconds.  While the
+   penalty is above damping_suppress, we keep the selected route as long
+   as it remains usable and feasible, and only send urgent triggered
+   updates for it, until the penalty decays below damping_reuse.  Since
+   we neither select nor keep an unfeasible route, this cannot create
+   routing loops. */
+
+struct damping {
+    unsigned char prefix[16], src_prefix[16];
+    unsigned char plen, src_plen;
+    unsigned char suppressed;
+    unsigned int penalty;
+    time_t time;                /* when penalty was last decayed */
+};
+
+static struct damping *dampings = NULL;
+static int num_dampings = 0, max_dampings = 0;
+
+int damping_half_life = 0;      /* 0 to disable damping */
+int damping_penalty = 1000, damping_suppress = 2000, damping_reuse = 750;
+
+static int
+damping_compare(const struct damping *d,
+                const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen)
+{
+    int i;
+
+    i = memcmp(d->prefix, prefix, 16);
+    if(i != 0)
+        return i;
+    if(d->plen != plen)
+        return d->plen < plen ? -1 : 1;
+    i = memcmp(d->src_prefix, src_prefix, 16);
+    if(i != 0)
+        return i;
+    if(d->src_plen != src_plen)
+        return d->src_plen < src_plen ? -1 : 1;
+    return 0;
+}
+
+static struct damping *
+find_damping(const unsigned char *prefix, unsigned char plen,
+             const unsigned char *src_prefix, unsigned char src_plen,
+             int create)
+{
+    int p = 0, g = num_dampings - 1, m, c;
+    struct damping *d;
+
+    while(p <= g) {
+        m = (p + g) / 2;
+        c = damping_compare(&dampings[m], prefix, plen, src_prefix, src_plen);
+        if(c == 0)
+            return &dampings[m];
+        else if(c < 0)
+            p = m + 1;
+        else
+            g = m - 1;
+    }
+
+    if(!create)
+        return NULL;
+
+    if(num_dampings >= max_dampings) {
+        int n = max_dampings < 1 ? 8 : 2 * max_dampings;
+        struct damping *new_dampings =
+            realloc(dampings, n * sizeof(struct damping));
+        if(new_dampings == NULL) {
+            perror("malloc(dampings)");
+            return NULL;
+        }
+        dampings = new_dampings;
+        max_dampings = n;
+    }
+
+    memmove(dampings + p + 1, dampings + p,
+            (num_dampings - p) * sizeof(struct damping));
+    num_dampings++;
+    d = &dampings[p];
+    memset(d, 0, sizeof(struct damping));
+    memcpy(d->prefix, prefix, 16);
+    d->plen = plen;
+    memcpy(d->src_prefix, src_prefix, 16);
+    d->src_plen = src_plen;
+    d->time = now.tv_sec;
+    return d;
+}
+
+static void
+damping_decay(struct damping *d)
+{
+    time_t t = now.tv_sec - d->time;
+
+    if(t <= 0) {
+        /* Protect against the clock being stepped. */
+        d->time = MIN(d->time, now.tv_sec);
+        return;
+    }
+
+    if(t >= 32 * damping_half_life) {
+        d->penalty = 0;
+    } else {
+        int k = (t * 64 + damping_half_life / 2) / damping_half_life;
+        /* Rounding may yield 32 half-lives, too large a shift. */
+        if(k >= 64 * 32)
+            d->penalty = 0;
+        else
+            d->penalty = (unsigned long long)d->penalty *
+                (two_to_the_minus[k % 64] >> (k / 64)) / 0x10000;
+    }
+    d->time = now.tv_sec;
+}
+
+static void
+damping_notify(const struct damping *d)
+{
+    int i = find_route_slot(d->prefix, d->plen, d->src_prefix, d->src_plen,
+                            NULL);
+    struct babel_route *r;
+
+    if(i < 0)
+        return;
+    for(r = routes[i]; r; r = r->next)
+        local_notify_route(r, LOCAL_CHANGE);
+}
+
+/* The selected route to a destination was just lost or replaced. */
+static void
+damping_flap(const unsigned char *prefix, unsigned char plen,
+             const unsigned char *src_prefix, unsigned char src_plen)
+{
+    struct damping *d;
+    /* Limit suppression to four half-lives. */
+    unsigned int ceiling = MAX(16 * damping_reuse, damping_suppress);
+
+    if(damping_half_life <= 0)
+        return;
+
+    d = find_damping(prefix, plen, src_prefix, src_plen, 1);
+    if(d == NULL)
+        return;
+
+    damping_decay(d);
+    d->penalty = MIN(d->penalty + damping_penalty, ceiling);
+    if(!d->suppressed && d->penalty >= damping_suppress) {
+        debugf("Suppressing %s from %s (penalty %u).\n",
+               format_prefix(prefix, plen),
+               format_prefix(src_prefix, src_plen), d->penalty);
+        d->suppressed = 1;
+        damping_notify(d);
+    }
+}
+
+static int
+route_suppressed(const struct babel_route *route)
+{
+    struct damping *d;
+
+    if(num_dampings == 0)
+        return 0;
+    d = find_damping(route->src->prefix, route->src->plen,
+                     route->src->src_prefix, route->src->src_plen, 0);
+    return d && d->suppressed;
+}
+
+/* Returns -1 if a destination has no flap history, otherwise whether it
+   is suppressed, and its penalty in penalty_return. */
+int
+route_damping(const struct source *src, unsigned int *penalty_return)
+{
+    struct damping *d;
+
+    if(num_dampings == 0)
+        return -1;
+    d = find_damping(src->prefix, src->plen,
+                     src->src_prefix, src->src_plen, 0);
+    if(d == NULL)
+        return -1;
+    damping_decay(d);
+    *penalty_return = d->penalty;
+    return d->suppressed;
+}
+
 /* This takes a feasible route and decides whether to install it.
    This uses the strong ordering, which is defined by sm <= sm' AND
    m <= m'.  This ordering is not total, which is what causes
@@ -1053,6 +1543,12 @@ consider_route(struct babel_route *route)
     if(route_metric(installed) >= INFINITY)
         goto install;
 
+    if(route_suppressed(installed) && !route_expired(installed) &&
+       route_feasible(installed))
+        /* Flapping, stick to the selected route while it is usable and
+           feasible. */
+        return;
+
     if(route_metric(installed) >= route_metric(route) &&
        route_smoothed_metric(installed) > route_smoothed_metric(route))
         goto install;
@@ -1117,6 +1613,9 @@ send_triggered_update(struct babel_route *route, struct source *oldsrc,
                                 route->seqno, route->src->id))
         /* Make sure that requests are satisfied speedily */
         urgent = 1;
+    else if(route_suppressed(route))
+        /* Flapping, let the periodic updates carry the changes. */
+        return;
     else if(oldmetric >= INFINITY && newmetric < INFINITY)
         /* New route */
         urgent = 0;
@@ -1145,36 +1644,106 @@ send_triggered_update(struct babel_route *route, struct source *oldsrc,
     }
 }
 
-/* A route has just changed.  Decide whether to switch to a different route or
-   send an update. */
+/* Route changes are not acted upon immediately: the destinations they
+   affect are recorded, and route selection, kernel programming and
+   triggered updates are done once per destination by
+   process_route_changes, at the end of each iteration of the main loop.
+   For every destination, we keep the installed route's source and metric
+   as they were before the first change, so that the triggered update
+   reflects the net effect of the whole batch. */
+
+struct route_change {
+    struct source *key;         /* any source for the destination */
+    struct source *oldsrc;      /* NULL if nothing was known installed */
+    unsigned short oldmetric;
+    int seqno;                  /* order in which changes were recorded */
+};
+
+static struct route_change *route_changes = NULL;
+static int num_route_changes = 0, max_route_changes = 0;
+
+static void
+record_route_change(struct source *key,
+                    struct source *oldsrc, unsigned short oldmetric)
+{
+    struct route_change *change;
+
+    if(num_route_changes >= max_route_changes) {
+        int n = max_route_changes < 1 ? 16 : 2 * max_route_changes;
+        struct route_change *new_changes =
+            realloc(route_changes, n * sizeof(struct route_change));
+        if(new_changes == NULL) {
+            perror("malloc(route_changes)");
+            return;
+        }
+        route_changes = new_changes;
+        max_route_changes = n;
+    }
+
+    change = &route_changes[num_route_changes];
+    change->key = retain_source(key);
+    change->oldsrc = oldsrc ? retain_source(oldsrc) : NULL;
+    change->oldmetric = oldmetric;
+    change->seqno = num_route_changes;
+    num_route_changes++;
+}
+
+/* A route has just changed.  Schedule a decision whether to switch to
+   a different route or send an update. */
 void
 route_changed(struct babel_route *route,
               struct source *oldsrc, unsigned short oldmetric)
 {
     if(route->installed) {
-        struct babel_route *better_route;
-        /* Do this unconditionally -- microoptimisation is not worth it. */
-        better_route =
-            find_best_route(route->src->prefix, route->src->plen,
-                            route->src->src_prefix, route->src->src_plen,
-                            1, NULL);
-        if(better_route && route_metric(better_route) < route_metric(route))
-            consider_route(better_route);
-    }
-
-    if(route->installed) {
-        /* We didn't change routes after all. */
-        send_triggered_update(route, oldsrc, oldmetric);
+        record_route_change(route->src, oldsrc, oldmetric);
     } else {
         /* Reconsider routes even when their metric didn't decrease,
            they may not have been feasible before. */
-        consider_route(route);
+        record_route_change(route->src, NULL, INFINITY);
     }
 }
 
 /* We just lost the installed route to a given destination. */
 void
 route_lost(struct source *src, unsigned oldmetric)
+{
+    record_route_change(src, src, oldmetric);
+}
+
+static int
+route_change_destination_compare(const struct route_change *c1,
+                                 const struct route_change *c2)
+{
+    const struct source *s1 = c1->key, *s2 = c2->key;
+    int i;
+
+    i = memcmp(s1->prefix, s2->prefix, 16);
+    if(i != 0)
+        return i;
+    if(s1->plen != s2->plen)
+        return s1->plen < s2->plen ? -1 : 1;
+    i = memcmp(s1->src_prefix, s2->src_prefix, 16);
+    if(i != 0)
+        return i;
+    if(s1->src_plen != s2->src_plen)
+        return s1->src_plen < s2->src_plen ? -1 : 1;
+    return 0;
+}
+
+static int
+route_change_compare(const void *a, const void *b)
+{
+    const struct route_change *c1 = a, *c2 = b;
+    int i;
+
+    i = route_change_destination_compare(c1, c2);
+    if(i != 0)
+        return i;
+    return c1->seqno < c2->seqno ? -1 : c1->seqno > c2->seqno ? 1 : 0;
+}
+
+static void
+lost_route(struct source *src, unsigned oldmetric)
 {
     struct babel_route *new_route;
     new_route = find_best_route(src->prefix, src->plen,
@@ -1197,6 +1766,131 @@ route_lost(struct source *src, unsigned oldmetric)
     }
 }
 
+/* Act upon the changes recorded for a single destination.  Oldsrc and
+   oldmetric describe the installed route before the first change to it,
+   others is true if a route that was not installed changed. */
+static void
+process_destination(struct source *key,
+                    struct source *oldsrc, unsigned short oldmetric,
+                    int others)
+{
+    struct babel_route *installed, *best;
+    int usable;
+
+    installed = find_installed_route(key->prefix, key->plen,
+                                     key->src_prefix, key->src_plen);
+    usable = oldsrc ? oldmetric < INFINITY :
+        installed && route_metric(installed) < INFINITY;
+
+    if(oldsrc == NULL) {
+        /* Only routes that were not installed changed. */
+        best = find_best_route(key->prefix, key->plen,
+                               key->src_prefix, key->src_plen, 1, NULL);
+        if(best)
+            consider_route(best);
+    } else if(installed) {
+        /* Do this unconditionally -- microoptimisation is not worth it. */
+        best = find_best_route(key->prefix, key->plen,
+                               key->src_prefix, key->src_plen, 1, NULL);
+        if(best && best != installed &&
+           (others || route_metric(best) < route_metric(installed)))
+            consider_route(best);
+        if(installed->installed)
+            /* We didn't change routes after all. */
+            send_triggered_update(installed, oldsrc, oldmetric);
+    } else {
+        lost_route(oldsrc, oldmetric);
+    }
+
+    if(usable && damping_half_life > 0) {
+        struct babel_route *r = find_installed_route(key->prefix, key->plen,
+                                                     key->src_prefix,
+                                                     key->src_plen);
+        if(r == NULL || r != installed || route_metric(r) >= INFINITY)
+            damping_flap(key->prefix, key->plen,
+                         key->src_prefix, key->src_plen);
+    }
+
+    update_multipath(find_route_slot(key->prefix, key->plen,
+                                     key->src_prefix, key->src_plen, NULL));
+}
+
+void
+process_route_changes(void)
+{
+    while(num_route_changes > 0) {
+        struct route_change *changes = route_changes;
+        int n = num_route_changes;
+        int i, j;
+
+        /* Acting upon a change may record new ones. */
+        route_changes = NULL;
+        num_route_changes = max_route_changes = 0;
+
+        qsort(changes, n, sizeof(struct route_change), route_change_compare);
+
+        i = 0;
+        while(i < n) {
+            struct source *oldsrc = NULL;
+            unsigned short oldmetric = INFINITY;
+            int others = 0;
+            j = i;
+            while(j < n &&
+                  route_change_destination_compare(&changes[i],
+                                                   &changes[j]) == 0) {
+                if(changes[j].oldsrc == NULL) {
+                    others = 1;
+                } else if(oldsrc == NULL) {
+                    oldsrc = changes[j].oldsrc;
+                    oldmetric = changes[j].oldmetric;
+                }
+                j++;
+            }
+            process_destination(changes[i].key, oldsrc, oldmetric, others);
+            for(; i < j; i++) {
+                release_source(changes[i].key);
+                if(changes[i].oldsrc)
+                    release_source(changes[i].oldsrc);
+            }
+        }
+        free(changes);
+    }
+}
+
+/* Called periodically to lift suppression and forget about destinations
+   that no longer flap. */
+void
+expire_damping(void)
+{
+    int i = 0, j = 0;
+
+    while(i < num_dampings) {
+        struct damping *d = &dampings[i];
+
+        damping_decay(d);
+        if(d->suppressed && d->penalty < damping_reuse) {
+            int slot = find_route_slot(d->prefix, d->plen,
+                                       d->src_prefix, d->src_plen, NULL);
+            debugf("Reusing %s from %s.\n",
+                   format_prefix(d->prefix, d->plen),
+                   format_prefix(d->src_prefix, d->src_plen));
+            d->suppressed = 0;
+            damping_notify(d);
+            /* A better route may have been held back. */
+            if(slot >= 0)
+                record_route_change(routes[slot]->src, NULL, INFINITY);
+        }
+
+        if(d->suppressed || d->penalty >= damping_reuse / 2) {
+            if(j < i)
+                dampings[j] = *d;
+            j++;
+        }
+        i++;
+    }
+    num_dampings = j;
+}
+
 /* This is called periodically to flush old routes.  It will also send
    requests for routes that are about to expire. */
 void
@@ -1228,6 +1922,8 @@ expire_routes(void)
             }
             r = r->next;
         }
+        /* Smoothed metrics may have moved. */
+        update_multipath(i);
         i++;
     again:
         ;
@@ -37,10 +37,16 @@ struct babel_route {
     unsigned short hold_time;    /* in seconds */
     unsigned short smoothed_metric; /* for route selection */
     time_t smoothed_metric_time;
+    unsigned int smoothed_metric_carry; /* see route_smoothed_metric */
     short installed;
+    short multipath;                /* a nexthop of the installed route */
+    unsigned short filter_metric;  /* input filter verdict, valid if */
+    unsigned int filter_generation; /* this is filter_generation */
     short channels_len;
     unsigned char *channels;
     struct babel_route *next;
+    /* The routes through the same neighbour. */
+    struct babel_route *neigh_prev, *neigh_next;
 };
 
 #define ROUTE_ALL 0
@@ -51,6 +57,9 @@ struct route_stream;
 extern struct babel_route **routes;
 extern int kernel_metric, allow_duplicates, reflect_kernel_metric;
 extern int diversity_kind, diversity_factor;
+extern int ecmp_tolerance;
+extern int damping_half_life, damping_penalty;
+extern int damping_suppress, damping_reuse;
 
 static inline int
 route_metric(const struct babel_route *route)
@@ -81,6 +90,12 @@ void flush_route(struct babel_route *route);
 void flush_all_routes(void);
 void flush_neighbour_routes(struct neighbour *neigh);
 void flush_interface_routes(struct interface *ifp, int v4only);
+int route_compare(const unsigned char *prefix, unsigned char plen,
+                  const unsigned char *src_prefix, unsigned char src_plen,
+                  struct babel_route *route);
+struct babel_route *next_route_slot(const unsigned char *prefix,
+                        unsigned char plen, const unsigned char *src_prefix,
+                        unsigned char src_plen);
 struct route_stream *route_stream(int which);
 struct babel_route *route_stream_next(struct route_stream *stream);
 void route_stream_done(struct route_stream *stream);
@@ -123,4 +138,7 @@ void send_triggered_update(struct babel_route *route,
 void route_changed(struct babel_route *route,
                    struct source *oldsrc, unsigned short oldmetric);
 void route_lost(struct source *src, unsigned oldmetric);
+void process_route_changes(void);
+int route_damping(const struct source *src, unsigned int *penalty_return);
+void expire_damping(void);
 void expire_routes(void);
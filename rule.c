@@ -34,32 +34,81 @@ THE SOFTWARE.
 
 int src_table_idx = 10;
 int src_table_prio = 100;
+int src_table_num = 10;
 
-/* The table used for non-specific routes is "export_table", therefore, we can
-   take the convention of plen == 0 <=> empty table. */
+/* The table used for non-specific routes is "export_table", so only
+   source-specific prefixes ever get a rule. */
 struct rule {
     unsigned char src[16];
     unsigned char plen;
-    unsigned char table;
+    int priority;
+    int table;
 };
 
-/* rules contains informations about the rules we installed. It is an array
-   indexed by: <table priority> - src_table_prio.
-   (First entries are the most specific, since they have priority.) */
-static struct rule rules[SRC_TABLE_NUM];
-/* used tables is indexed by: <table number> - src_table_idx
+/* rules contains informations about the rules we installed, ordered by
+   priority.  (First entries are the most specific, since they have
+   priority.)  Priorities are allocated with gaps between them, so that
+   a new rule can usually be inserted without renumbering the others. */
+static struct rule *rules = NULL;
+static int num_rules = 0, max_rules = 0;
+/* used_tables is indexed by: <table number> - src_table_idx
    used_tables[i] == 1 <=> the table number (i + src_table_idx) is used */
-static char used_tables[SRC_TABLE_NUM] = {0};
+static char *used_tables = NULL;
+static int max_used_tables = 0;
+
+/* With a source-table-count of 0, tables are allocated on demand up to
+   the last table number below the reserved ones. */
+int
+max_source_tables(void)
+{
+    return src_table_num > 0 ? src_table_num : 253 - src_table_idx;
+}
+
+int
+own_rule_priority(int priority)
+{
+    return priority >= src_table_prio &&
+        priority < src_table_prio + max_source_tables() * SRC_RULE_GAP;
+}
+
+static int
+table_used(int table)
+{
+    int i = table - src_table_idx;
+    return i >= 0 && i < max_used_tables && used_tables[i];
+}
+
+static int
+reserved_table(int table)
+{
+    int i;
+    if(table == export_table)
+        return 1;
+    for(i = 0; i < import_table_count; i++)
+        if(table == import_tables[i])
+            return 1;
+    return 0;
+}
 
 static int
 get_free_table(void)
 {
     int i;
-    for(i = 0; i < SRC_TABLE_NUM; i++)
-        if(!used_tables[i]) {
+    for(i = 0; i < max_source_tables(); i++) {
+        if(i >= max_used_tables) {
+            int n = MIN(MAX(2 * max_used_tables, 8), max_source_tables());
+            char *new_used = realloc(used_tables, n);
+            if(new_used == NULL)
+                return -1;
+            memset(new_used + max_used_tables, 0, n - max_used_tables);
+            used_tables = new_used;
+            max_used_tables = n;
+        }
+        if(!used_tables[i] && !reserved_table(i + src_table_idx)) {
             used_tables[i] = 1;
             return i + src_table_idx;
         }
+    }
     return -1;
 }
 
@@ -69,49 +118,85 @@ release_table(int i)
     used_tables[i - src_table_idx] = 0;
 }
 
+/* Return a free priority for a rule inserted at index idx, or -1 if
+   its neighbours have consecutive priorities. */
 static int
-find_hole_around(int i)
+free_priority(int idx)
 {
-    int j;
-    for(j = i; j < SRC_TABLE_NUM; j++)
-        if(rules[j].plen == 0)
-            return j;
-    for(j = i - 1; j >= 0; j--)
-        if(rules[j].plen == 0)
-            return j;
-    return -1;
+    int lo = idx > 0 ? rules[idx - 1].priority : src_table_prio - 1;
+    int hi = idx < num_rules ?
+        rules[idx].priority : src_table_prio + max_source_tables() * SRC_RULE_GAP;
+
+    if(hi - lo < 2)
+        return -1;
+    /* Keep the rules packed at the start of the range. */
+    if(idx == num_rules)
+        return MIN(lo + SRC_RULE_GAP, (lo + hi) / 2);
+    if(idx == 0)
+        return MAX(hi - SRC_RULE_GAP, (lo + hi + 1) / 2);
+    return (lo + hi) / 2;
 }
 
 static int
-shift_rule(int from, int to)
+priority_used(int priority, int except)
 {
-    int dec = (from < to) ? 1 /* right */ : -1 /* left */;
-    int rc;
-    while(to != from) {
-        to -= dec;
-        rc = change_rule(to + dec + src_table_prio, to + src_table_prio,
-                         rules[to].src, rules[to].plen, rules[to].table);
-        if(rc < 0) {
-            perror("change_table_priority");
-            return -1;
+    int i;
+    for(i = 0; i < num_rules; i++)
+        if(i != except && rules[i].priority == priority)
+            return 1;
+    return 0;
+}
+
+/* Spread the rules evenly over the priority range, leaving a hole at
+   index idx.  Since relative order is preserved, a rule can always be
+   moved once the rule that holds its new priority has moved. */
+static int
+renumber_rules(int idx)
+{
+    int i, rc, pending, failed = 0;
+
+    kdebugf("Renumbering %d rules.\n", num_rules);
+
+    kernel_batch(1);
+    do {
+        pending = 0;
+        for(i = 0; i < num_rules; i++) {
+            int priority =
+                src_table_prio + SRC_RULE_GAP * (i < idx ? i : i + 1);
+            if(rules[i].priority == priority)
+                continue;
+            if(priority_used(priority, i)) {
+                pending = 1;
+                continue;
+            }
+            rc = change_rule(priority, rules[i].priority,
+                             rules[i].src, rules[i].plen, rules[i].table);
+            if(rc < 0) {
+                failed = 1;
+                break;
+            }
+            rules[i].priority = priority;
         }
-        rules[to+dec] = rules[to];
-        rules[to].plen = 0;
+    } while(pending && !failed);
+    rc = kernel_batch(0);
+    if(failed || rc < 0) {
+        perror("change_rule");
+        return -1;
     }
     return 0;
 }
 
-/* Return a new table at index [idx] of rules.  If cell at that index is not
-   free, we need to shift cells (and rules).  If it's full, return NULL. */
+/* Return a new table for a rule at index [idx] of rules.  If there is
+   no free priority at that index, we need to renumber the rules.  If
+   all tables are used, return NULL. */
 static struct rule *
-insert_table(const unsigned char *src, unsigned short src_plen, int idx)
+insert_rule(const unsigned char *src, unsigned short src_plen, int idx)
 {
-    int table;
+    int table, priority;
     int rc;
-    int hole;
 
-    if(idx < 0 || idx >= SRC_TABLE_NUM) {
-        fprintf(stderr, "Incorrect table number %d\n", idx);
+    if(idx < 0 || idx > num_rules) {
+        fprintf(stderr, "Incorrect rule index %d\n", idx);
         return NULL;
     }
 
@@ -121,22 +206,40 @@ insert_table(const unsigned char *src, unsigned short src_plen, int idx)
         return NULL;
     }
 
-    hole = find_hole_around(idx);
-    if(hole < 0) {
-        fprintf(stderr, "Have free table but not free rule.\n");
-        goto fail;
+    if(num_rules >= max_rules) {
+        int n = max_rules < 1 ? 8 : 2 * max_rules;
+        struct rule *new_rules = realloc(rules, n * sizeof(struct rule));
+        if(new_rules == NULL)
+            goto fail;
+        rules = new_rules;
+        max_rules = n;
     }
-    rc = shift_rule(idx, hole);
-    if(rc < 0)
-        goto fail;
 
-    rc = add_rule(idx + src_table_prio, src, src_plen, table);
+    priority = free_priority(idx);
+    if(priority < 0) {
+        rc = renumber_rules(idx);
+        if(rc < 0)
+            goto fail;
+        priority = free_priority(idx);
+        if(priority < 0) {
+            fprintf(stderr, "Have free table but not free rule.\n");
+            goto fail;
+        }
+    }
+
+    rc = add_rule(priority, src, src_plen, table);
     if(rc < 0) {
         perror("add rule");
         goto fail;
     }
+
+    if(idx < num_rules)
+        memmove(rules + idx + 1, rules + idx,
+                (num_rules - idx) * sizeof(struct rule));
+    num_rules++;
     memcpy(rules[idx].src, src, 16);
     rules[idx].plen = src_plen;
+    rules[idx].priority = priority;
     rules[idx].table = table;
 
     return &rules[idx];
@@ -155,10 +258,8 @@ find_table_slot(const unsigned char *src, unsigned short src_plen, int *found)
     int i;
     *found = 0;
 
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
+    for(i = 0; i < num_rules; i++) {
         kr = &rules[i];
-        if(kr->plen == 0)
-            return i;
         switch(prefix_cmp(src, src_plen, kr->src, kr->plen)) {
         case PST_LESS_SPECIFIC:
         case PST_DISJOINT:
@@ -171,7 +272,7 @@ find_table_slot(const unsigned char *src, unsigned short src_plen, int *found)
         }
     }
 
-    return -1;
+    return num_rules;
 }
 
 int
@@ -194,9 +295,7 @@ find_table(const unsigned char *dest, unsigned short plen,
     i = find_table_slot(src, src_plen, &found);
     if(found)
         return rules[i].table;
-    if(i < 0)
-        return -1;
-    kr = insert_table(src, src_plen, i);
+    kr = insert_rule(src, src_plen, i);
     return kr == NULL ? -1 : kr->table;
 }
 
@@ -204,81 +303,127 @@ void
 release_tables(void)
 {
     int i;
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
-        if(rules[i].plen != 0) {
-            flush_rule(i + src_table_prio,
-                       v4mapped(rules[i].src) ? AF_INET : AF_INET6);
-            rules[i].plen = 0;
-        }
-        used_tables[i] = 0;
+    kernel_batch(1);
+    for(i = 0; i < num_rules; i++)
+        flush_rule(rules[i].priority,
+                   v4mapped(rules[i].src) ? AF_INET : AF_INET6);
+    kernel_batch(0);
+    num_rules = 0;
+    if(used_tables)
+        memset(used_tables, 0, max_used_tables);
+}
+
+static int
+find_rule(int priority)
+{
+    int p = 0, g = num_rules - 1, m;
+    while(p <= g) {
+        m = (p + g) / 2;
+        if(rules[m].priority == priority)
+            return m;
+        else if(rules[m].priority < priority)
+            p = m + 1;
+        else
+            g = m - 1;
     }
+    return -1;
 }
 
+/* The state of the kernel rules within our range of priorities: for each
+   of our rules, whether it is installed (1), missing (0) or shadowed by
+   foreign rules (-1); and the priorities of foreign rules that point to
+   one of our tables.  Other foreign rules are left alone. */
+struct rule_check {
+    char *exists;
+    int (*stale)[2];            /* priority, family */
+    int num_stale, max_stale;
+};
+
 static int
 filter_rule(struct kernel_rule *rule, void *data)
 {
     int i;
-    char (*rule_exists)[2][SRC_TABLE_NUM] = data;
+    struct rule_check *check = data;
     int is_v4 = v4mapped(rule->src);
-    int r = is_v4 ? 0 : 1;
 
     if(martian_prefix(rule->src, rule->src_plen))
         return 0;
 
-    i = rule->priority - src_table_prio;
+    if(!own_rule_priority(rule->priority))
+        return 0;
+
+    i = find_rule(rule->priority);
+    if(i >= 0 && !!v4mapped(rules[i].src) == !!is_v4) {
+        if(prefix_cmp(rule->src, rule->src_plen,
+                      rules[i].src, rules[i].plen) == PST_EQUALS &&
+           rule->table == rules[i].table &&
+           check->exists[i] == 0)
+            check->exists[i] = 1;
+        else
+            check->exists[i] = -1;
+        return 1;
+    }
 
-    if(i < 0 || SRC_TABLE_NUM <= i)
+    if(!table_used(rule->table))
         return 0;
 
-    if(prefix_cmp(rule->src, rule->src_plen,
-                  rules[i].src, rules[i].plen) == PST_EQUALS &&
-       rule->table == rules[i].table &&
-       (*rule_exists)[r][i] == 0)
-        (*rule_exists)[r][i] = 1;
-    else
-        (*rule_exists)[r][i] = -1;
+    if(check->num_stale >= check->max_stale) {
+        int n = check->max_stale < 1 ? 8 : 2 * check->max_stale;
+        int (*new_stale)[2] = realloc(check->stale, n * sizeof(int[2]));
+        if(new_stale == NULL)
+            return -1;
+        check->stale = new_stale;
+        check->max_stale = n;
+    }
+    check->stale[check->num_stale][0] = rule->priority;
+    check->stale[check->num_stale][1] = is_v4 ? AF_INET : AF_INET6;
+    check->num_stale++;
 
     return 1;
 }
 
-/* This functions should be executed wrt the code just bellow: [rule_exists]
-   contains is a boolean array telling whether the rules we should have
-   installed in the kernel are installed or not.  If they aren't, then reinstall
-   them (this can append when rules are modified by third parties). */
+static void
+flush_rules_at(int priority, int family, const char *what)
+{
+    int rc;
+    do {
+        rc = flush_rule(priority, family);
+    } while(rc >= 0);
+    if(errno != ENOENT && errno != EEXIST)
+        fprintf(stderr, "Cannot remove rule %d: %s (%s)\n",
+                priority, what, strerror(errno));
+}
+
+/* This functions should be executed wrt the code just bellow: [check]
+   tells whether the rules we should have installed in the kernel are
+   installed or not.  If they aren't, then reinstall them (this can append
+   when rules are modified by third parties). */
 
 static void
-install_missing_rules(char rule_exists[SRC_TABLE_NUM], int v4)
+install_missing_rules(struct rule_check *check)
 {
     int i, rc;
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
-        int priority = i + src_table_prio;
-        if(rule_exists[i] == 1)
-            continue;
 
-        if(rule_exists[i] != 0) {
-            int rc;
-            do {
-                rc = flush_rule(priority, v4 ? AF_INET : AF_INET6);
-            } while(rc >= 0);
-            if(errno != ENOENT && errno != EEXIST)
-                fprintf(stderr,
-                        "Cannot remove rule %d: from %s table %d (%s)\n",
-                        priority,
-                        format_prefix(rules[i].src, rules[i].plen),
-                        rules[i].table, strerror(errno));
-        }
+    for(i = 0; i < check->num_stale; i++)
+        flush_rules_at(check->stale[i][0], check->stale[i][1], "unknown");
 
-        /* Be wise, our priority are both for v4 and v6 (does not overlap). */
-        if(!!v4mapped(rules[i].src) == !!v4 && rules[i].plen != 0) {
-            rc = add_rule(priority, rules[i].src,
-                          rules[i].plen, rules[i].table);
-            if(rc < 0)
-                fprintf(stderr,
-                        "Cannot install rule %d: from %s table %d (%s)\n",
-                        priority,
-                        format_prefix(rules[i].src, rules[i].plen),
-                        rules[i].table, strerror(errno));
-        }
+    for(i = 0; i < num_rules; i++) {
+        int family = v4mapped(rules[i].src) ? AF_INET : AF_INET6;
+        if(check->exists[i] == 1)
+            continue;
+
+        if(check->exists[i] != 0)
+            flush_rules_at(rules[i].priority, family,
+                           format_prefix(rules[i].src, rules[i].plen));
+
+        rc = add_rule(rules[i].priority, rules[i].src,
+                      rules[i].plen, rules[i].table);
+        if(rc < 0)
+            fprintf(stderr,
+                    "Cannot install rule %d: from %s table %d (%s)\n",
+                    rules[i].priority,
+                    format_prefix(rules[i].src, rules[i].plen),
+                    rules[i].table, strerror(errno));
     }
 }
 
@@ -286,17 +431,23 @@ int
 check_rules(void)
 {
     int rc;
-    char rule_exists[2][SRC_TABLE_NUM]; /* v4, v6 */
+    struct rule_check check = {NULL, NULL, 0, 0};
     struct kernel_filter filter = {0};
+
+    if(num_rules > 0) {
+        check.exists = calloc(num_rules, 1);
+        if(check.exists == NULL)
+            return -1;
+    }
+
     filter.rule = filter_rule;
-    filter.rule_closure = (void*) rule_exists;
-    memset(rule_exists, 0, sizeof(rule_exists));
+    filter.rule_closure = (void*)&check;
 
     rc = kernel_dump(CHANGE_RULE, &filter);
-    if(rc < 0)
-        return -1;
-    install_missing_rules(rule_exists[0], 1);
-    install_missing_rules(rule_exists[1], 0);
+    if(rc >= 0)
+        install_missing_rules(&check);
 
-    return 0;
+    free(check.exists);
+    free(check.stale);
+    return rc < 0 ? -1 : 0;
 }
@@ -20,10 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#define SRC_TABLE_NUM 10
+/* Spacing between the priorities of consecutive rules. */
+#define SRC_RULE_GAP 8
 
 extern int src_table_idx; /* number of the first table */
 extern int src_table_prio; /* first prio range */
+extern int src_table_num; /* maximum number of tables, 0 for no limit */
 
 /* Return the number of the table using src_plen, allocate the table in the
    kernel if necessary. */
@@ -31,3 +33,7 @@ int find_table(const unsigned char *dest, unsigned short plen,
                const unsigned char *src, unsigned short src_plen);
 void release_tables(void);
 int check_rules(void);
+/* The number of tables that may be allocated. */
+int max_source_tables(void);
+/* Whether priority is in the range used for source-specific rules. */
+int own_rule_priority(int priority);
@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2026 by the babeld authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "babeld.h"
+#include "util.h"
+#include "trie.h"
+
+static int
+bit_at(const unsigned char *prefix, int i)
+{
+    return (prefix[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* Number of leading bits that p1 and p2 have in common, at most max. */
+
+static int
+common_bits(const unsigned char *p1, const unsigned char *p2, int max)
+{
+    int i = 0, n;
+    unsigned char x;
+
+    while(i < max / 8 && p1[i] == p2[i])
+        i++;
+    n = i * 8;
+    if(n >= max)
+        return max;
+    x = p1[i] ^ p2[i];
+    while(n < max && (x & (0x80 >> (n % 8))) == 0)
+        n++;
+    return n;
+}
+
+static struct trie_node *
+new_node(const unsigned char *prefix, unsigned char plen)
+{
+    struct trie_node *node;
+
+    node = calloc(1, sizeof(struct trie_node));
+    if(node == NULL)
+        return NULL;
+    normalize_prefix(node->prefix, prefix, plen);
+    node->plen = plen;
+    return node;
+}
+
+static void
+replace_child(struct trie *trie, struct trie_node *parent,
+              struct trie_node *old, struct trie_node *new)
+{
+    if(parent == NULL)
+        trie->root = new;
+    else if(parent->children[0] == old)
+        parent->children[0] = new;
+    else
+        parent->children[1] = new;
+    if(new)
+        new->parent = parent;
+}
+
+/* Returns the node that holds exactly prefix, if it carries data. */
+
+struct trie_node *
+trie_find(struct trie *trie, const unsigned char *prefix, unsigned char plen)
+{
+    struct trie_node *node = trie->root;
+
+    while(node) {
+        if(node->plen > plen ||
+           common_bits(prefix, node->prefix, node->plen) < node->plen)
+            return NULL;
+        if(node->plen == plen)
+            return node->data ? node : NULL;
+        node = node->children[bit_at(prefix, node->plen)];
+    }
+    return NULL;
+}
+
+/* Returns the node that holds exactly prefix, creating it if necessary.
+   The caller is expected to set its data; a node without data must be
+   passed to trie_release. */
+
+struct trie_node *
+trie_get(struct trie *trie, const unsigned char *prefix, unsigned char plen)
+{
+    struct trie_node *node = trie->root, *parent = NULL, *new, *glue;
+    int c = 0;
+
+    while(node) {
+        c = common_bits(prefix, node->prefix, MIN(plen, node->plen));
+        if(c < node->plen)
+            break;
+        if(node->plen == plen)
+            return node;
+        parent = node;
+        node = node->children[bit_at(prefix, node->plen)];
+    }
+
+    new = new_node(prefix, plen);
+    if(new == NULL)
+        return NULL;
+
+    if(node == NULL) {
+        if(parent == NULL)
+            trie->root = new;
+        else
+            parent->children[bit_at(prefix, parent->plen)] = new;
+        new->parent = parent;
+        return new;
+    }
+
+    if(c == plen) {
+        /* The new node covers node. */
+        replace_child(trie, parent, node, new);
+        new->children[bit_at(node->prefix, plen)] = node;
+        node->parent = new;
+        return new;
+    }
+
+    glue = new_node(prefix, c);
+    if(glue == NULL) {
+        free(new);
+        return NULL;
+    }
+    replace_child(trie, parent, node, glue);
+    glue->children[bit_at(prefix, c)] = new;
+    glue->children[bit_at(node->prefix, c)] = node;
+    new->parent = glue;
+    node->parent = glue;
+    return new;
+}
+
+/* Frees node if it carries no data and is not needed to split the
+   tree, along with any ancestor that has become useless. */
+
+void
+trie_release(struct trie *trie, struct trie_node *node)
+{
+    while(node && node->data == NULL &&
+          (node->children[0] == NULL || node->children[1] == NULL)) {
+        struct trie_node *parent = node->parent;
+        struct trie_node *child =
+            node->children[0] ? node->children[0] : node->children[1];
+        replace_child(trie, parent, node, child);
+        free(node);
+        node = parent;
+    }
+}
+
+static void
+flush_subtree(struct trie_node *node, void (*free_data)(void *data))
+{
+    if(node == NULL)
+        return;
+    flush_subtree(node->children[0], free_data);
+    flush_subtree(node->children[1], free_data);
+    if(node->data && free_data)
+        free_data(node->data);
+    free(node);
+}
+
+/* Frees all the nodes of trie, calling free_data on their data. */
+
+void
+trie_flush(struct trie *trie, void (*free_data)(void *data))
+{
+    flush_subtree(trie->root, free_data);
+    trie->root = NULL;
+}
+
+/* Calls walker on every node with data whose prefix contains the given
+   prefix, from the least to the most specific. */
+
+int
+trie_covering(struct trie *trie,
+              const unsigned char *prefix, unsigned char plen,
+              trie_walker walker, void *closure)
+{
+    struct trie_node *node = trie->root;
+    int rc;
+
+    while(node) {
+        if(node->plen > plen ||
+           common_bits(prefix, node->prefix, node->plen) < node->plen)
+            break;
+        if(node->data) {
+            rc = walker(node, closure);
+            if(rc)
+                return rc;
+        }
+        if(node->plen == plen)
+            break;
+        node = node->children[bit_at(prefix, node->plen)];
+    }
+    return 0;
+}
+
+static int
+walk_subtree(struct trie_node *node, trie_walker walker, void *closure)
+{
+    int rc;
+
+    if(node == NULL)
+        return 0;
+    if(node->data) {
+        rc = walker(node, closure);
+        if(rc)
+            return rc;
+    }
+    rc = walk_subtree(node->children[0], walker, closure);
+    if(rc)
+        return rc;
+    return walk_subtree(node->children[1], walker, closure);
+}
+
+/* Calls walker on every node with data whose prefix is contained in the
+   given prefix, parents before their children. */
+
+int
+trie_covered(struct trie *trie,
+             const unsigned char *prefix, unsigned char plen,
+             trie_walker walker, void *closure)
+{
+    struct trie_node *node = trie->root;
+
+    while(node) {
+        if(node->plen >= plen) {
+            if(common_bits(prefix, node->prefix, plen) < plen)
+                return 0;
+            return walk_subtree(node, walker, closure);
+        }
+        if(common_bits(prefix, node->prefix, node->plen) < node->plen)
+            return 0;
+        node = node->children[bit_at(prefix, node->plen)];
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+Copyright (c) 2026 by the babeld authors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* A path-compressed binary trie indexed by prefixes.  Every node holds
+   a prefix; the nodes that carry data are the ones that have been
+   inserted, the others only exist in order to split the tree. */
+
+struct trie_node {
+    unsigned char prefix[16];
+    unsigned char plen;
+    struct trie_node *parent;
+    struct trie_node *children[2];
+    void *data;
+};
+
+struct trie {
+    struct trie_node *root;
+};
+
+/* Walker callback; a non-zero return value stops the walk. */
+typedef int (*trie_walker)(struct trie_node *node, void *closure);
+
+struct trie_node *trie_find(struct trie *trie,
+                            const unsigned char *prefix, unsigned char plen);
+struct trie_node *trie_get(struct trie *trie,
+                           const unsigned char *prefix, unsigned char plen);
+void trie_release(struct trie *trie, struct trie_node *node);
+void trie_flush(struct trie *trie, void (*free_data)(void *data));
+int trie_covering(struct trie *trie,
+                  const unsigned char *prefix, unsigned char plen,
+                  trie_walker walker, void *closure);
+int trie_covered(struct trie *trie,
+                 const unsigned char *prefix, unsigned char plen,
+                 trie_walker walker, void *closure);
@@ -500,8 +500,8 @@ prefix_cmp(const unsigned char *p1, unsigned char plen1,
         return PST_DISJOINT;
 
     if(plen % 8 != 0) {
-        int i = plen / 8 + 1;
-        unsigned char mask = (0xFF << (plen % 8)) & 0xFF;
+        int i = plen / 8;
+        unsigned char mask = (0xFF << (8 - (plen % 8))) & 0xFF;
         if((p1[i] & mask) != (p2[i] & mask))
             return PST_DISJOINT;
     }
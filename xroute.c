@@ -118,6 +118,7 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
     xroutes[numxroutes].metric = metric;
     xroutes[numxroutes].ifindex = ifindex;
     xroutes[numxroutes].proto = proto;
+    xroutes[numxroutes].filter_generation = 0;
     numxroutes++;
     local_notify_xroute(&xroutes[numxroutes - 1], LOCAL_ADD);
     return 1;
@@ -130,6 +131,20 @@ xroutes_estimate()
     return numxroutes;
 }
 
+/* The table only grows at the end, and flush_xroute moves the last entry
+   into the hole it leaves, which allows walking it by position. */
+int
+xroute_index(struct xroute *xroute)
+{
+    return xroute - xroutes;
+}
+
+struct xroute *
+xroute_at(int i)
+{
+    return i >= 0 && i < numxroutes ? &xroutes[i] : NULL;
+}
+
 struct xroute_stream {
     int index;
 };
@@ -161,6 +176,21 @@ xroute_stream_done(struct xroute_stream *stream)
     free(stream);
 }
 
+/* The verdict of the redistribute filters for an xroute, cached until
+   the configuration changes. */
+static int
+xroute_filter(struct xroute *xroute)
+{
+    if(xroute->filter_generation != filter_generation) {
+        xroute->filter_metric =
+            redistribute_filter(xroute->prefix, xroute->plen,
+                                xroute->src_prefix, xroute->src_plen,
+                                xroute->ifindex, xroute->proto, NULL);
+        xroute->filter_generation = filter_generation;
+    }
+    return xroute->filter_metric;
+}
+
 static int
 filter_route(struct kernel_route *route, void *data) {
     void **args = (void**)data;
@@ -249,6 +279,7 @@ check_xroutes(int send_updates)
 {
     int i, j, metric, export, change = 0, rc;
     struct kernel_route *routes;
+    unsigned short *verdicts;
     struct filter_result filter_result;
     int numroutes, numaddresses;
     static int maxroutes = 8;
@@ -283,18 +314,35 @@ check_xroutes(int send_updates)
     if(numroutes >= maxroutes)
         goto resize;
 
-    /* Apply filter to kernel routes (e.g. change the source prefix). */
+    verdicts = calloc(MAX(numroutes, 1), sizeof(unsigned short));
+    if(verdicts == NULL) {
+        free(routes);
+        return -1;
+    }
+
+    /* Apply filter to kernel routes (e.g. change the source prefix), and
+       remember the verdict so that it is computed once per route.  It
+       must be computed again if the source prefix was changed. */
 
-    for(i = numaddresses; i < numroutes; i++) {
-        redistribute_filter(routes[i].prefix, routes[i].plen,
-                            routes[i].src_prefix, routes[i].src_plen,
-                            routes[i].ifindex, routes[i].proto,
-                            &filter_result);
+    for(i = 0; i < numroutes; i++) {
+        if(martian_prefix(routes[i].prefix, routes[i].plen)) {
+            verdicts[i] = INFINITY;
+            continue;
+        }
+        memset(&filter_result, 0, sizeof(filter_result));
+        verdicts[i] =
+            redistribute_filter(routes[i].prefix, routes[i].plen,
+                                routes[i].src_prefix, routes[i].src_plen,
+                                routes[i].ifindex, routes[i].proto,
+                                i >= numaddresses ? &filter_result : NULL);
         if(filter_result.src_prefix) {
             memcpy(routes[i].src_prefix, filter_result.src_prefix, 16);
             routes[i].src_plen = filter_result.src_plen;
+            verdicts[i] =
+                redistribute_filter(routes[i].prefix, routes[i].plen,
+                                    routes[i].src_prefix, routes[i].src_plen,
+                                    routes[i].ifindex, routes[i].proto, NULL);
         }
-
     }
 
     /* Check for any routes that need to be flushed */
@@ -302,10 +350,7 @@ check_xroutes(int send_updates)
     i = 0;
     while(i < numxroutes) {
         export = 0;
-        metric = redistribute_filter(xroutes[i].prefix, xroutes[i].plen,
-                                     xroutes[i].src_prefix, xroutes[i].src_plen,
-                                     xroutes[i].ifindex, xroutes[i].proto,
-                                     NULL);
+        metric = xroute_filter(&xroutes[i]);
         if(metric < INFINITY && metric == xroutes[i].metric) {
             for(j = 0; j < numroutes; j++) {
                 if(xroutes[i].plen == routes[j].plen &&
@@ -343,11 +388,7 @@ check_xroutes(int send_updates)
     /* Add any new routes */
 
     for(i = 0; i < numroutes; i++) {
-        if(martian_prefix(routes[i].prefix, routes[i].plen))
-            continue;
-        metric = redistribute_filter(routes[i].prefix, routes[i].plen,
-                                     routes[i].src_prefix, routes[i].src_plen,
-                                     routes[i].ifindex, routes[i].proto, NULL);
+        metric = verdicts[i];
         if(metric < INFINITY) {
             rc = add_xroute(routes[i].prefix, routes[i].plen,
                             routes[i].src_prefix, routes[i].src_plen,
@@ -370,6 +411,7 @@ check_xroutes(int send_updates)
         }
     }
 
+    free(verdicts);
     free(routes);
     /* Set up maxroutes for the next call. */
     maxroutes = MIN(numroutes + 8, maxmaxroutes);
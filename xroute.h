@@ -28,6 +28,8 @@ struct xroute {
     unsigned short metric;
     unsigned int ifindex;
     int proto;
+    unsigned short filter_metric;  /* redistribute verdict, valid if */
+    unsigned int filter_generation; /* this is filter_generation */
 };
 
 struct xroute_stream;
@@ -39,6 +41,8 @@ int add_xroute(unsigned char prefix[16], unsigned char plen,
                unsigned char src_prefix[16], unsigned char src_plen,
                unsigned short metric, unsigned int ifindex, int proto);
 int xroutes_estimate(void);
+int xroute_index(struct xroute *xroute);
+struct xroute *xroute_at(int i);
 struct xroute_stream *xroute_stream();
 struct xroute *xroute_stream_next(struct xroute_stream *stream);
 void xroute_stream_done(struct xroute_stream *stream);